@@ -0,0 +1,256 @@
+#include "binmodel.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libsvm/svm.h"
+
+const char warco::BIN_MAGIC[8] = {'W', 'A', 'R', 'C', 'O', 'B', 'I', 'N'};
+const char warco::BIN_TRAIN_MAGIC[8] = {'W', 'A', 'R', 'C', 'O', 'T', 'R', 'N'};
+
+warco::BinWriter::BinWriter(std::string fname)
+    : _f(fname, std::ios::binary | std::ios::trunc)
+    , _fname(fname)
+    , _pos(0)
+{
+    if(! _f)
+        throw std::runtime_error("Couldn't create binary model file '" + fname + "'");
+}
+
+uint64_t warco::BinWriter::append(const void* data, std::size_t bytes)
+{
+    static const char zeros[BIN_ALIGN] = {0};
+    const std::size_t pad = (BIN_ALIGN - _pos % BIN_ALIGN) % BIN_ALIGN;
+    _f.write(zeros, pad);
+
+    const uint64_t off = _pos + pad;
+    _f.write(static_cast<const char*>(data), bytes);
+    _pos = off + bytes;
+
+    if(! _f)
+        throw std::runtime_error("Error writing binary model file '" + _fname + "'");
+    return off;
+}
+
+void warco::BinWriter::write_at(uint64_t off, const void* data, std::size_t bytes)
+{
+    _f.seekp(off);
+    _f.write(static_cast<const char*>(data), bytes);
+    _f.seekp(_pos);
+
+    if(! _f)
+        throw std::runtime_error("Error writing binary model file '" + _fname + "'");
+}
+
+warco::MappedFile::MappedFile(std::string fname)
+    : _data(nullptr)
+    , _size(0)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw std::runtime_error("Couldn't open binary model file '" + fname + "': " + std::strerror(errno));
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error("Couldn't stat binary model file '" + fname + "' or it is empty");
+    }
+    _size = st.st_size;
+
+    void* p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        throw std::runtime_error("Couldn't map binary model file '" + fname + "': " + std::strerror(errno));
+    _data = static_cast<const uint8_t*>(p);
+}
+
+warco::MappedFile::~MappedFile()
+{
+    munmap(const_cast<uint8_t*>(_data), _size);
+}
+
+void warco::MappedFile::check(uint64_t off, std::size_t bytes) const
+{
+    if(off > _size || bytes > _size - off)
+        throw std::runtime_error("Truncated or corrupt binary model file.");
+}
+
+bool warco::is_binary_model(std::string fname)
+{
+    std::ifstream f(fname, std::ios::binary);
+    char magic[sizeof(BIN_MAGIC)];
+    return f.read(magic, sizeof(magic)) && std::memcmp(magic, BIN_MAGIC, sizeof(magic)) == 0;
+}
+
+uint64_t warco::write_svm(BinWriter& w, const svm_model* m)
+{
+    const int k = m->nr_class, l = m->l, npairs = k*(k-1)/2;
+
+    BinSvm b = BinSvm();
+    b.svm_type = m->param.svm_type;
+    b.kernel_type = m->param.kernel_type;
+    b.nr_class = k;
+    b.l = l;
+
+    std::vector<int32_t> ids(l);
+    for(int i = 0 ; i < l ; ++i) {
+        if(m->SV[i][0].index != 0)
+            throw std::runtime_error("Only precomputed-kernel SVMs can be stored in binary models.");
+        ids[i] = static_cast<int32_t>(m->SV[i][0].value);
+    }
+
+    std::vector<double> coef;
+    for(int i = 0 ; i < k-1 ; ++i)
+        coef.insert(coef.end(), m->sv_coef[i], m->sv_coef[i] + l);
+
+    b.label_off = w.append(m->label, k*sizeof(int32_t));
+    b.nsv_off = w.append(m->nSV, k*sizeof(int32_t));
+    b.ids_off = w.append(ids.data(), l*sizeof(int32_t));
+    b.rho_off = w.append(m->rho, npairs*sizeof(double));
+    if(m->probA && m->probB) {
+        b.has_prob = 1;
+        b.proba_off = w.append(m->probA, npairs*sizeof(double));
+        b.probb_off = w.append(m->probB, npairs*sizeof(double));
+    }
+    b.coef_off = w.append(coef.data(), coef.size()*sizeof(double));
+
+    return w.append(&b, sizeof(b));
+}
+
+template<typename T>
+static T* copy_of(const T* src, std::size_t n)
+{
+    T* dst = static_cast<T*>(malloc(std::max<std::size_t>(1, n)*sizeof(T)));
+    std::memcpy(dst, src, n*sizeof(T));
+    return dst;
+}
+
+svm_model* warco::read_svm(const MappedFile& f, uint64_t off)
+{
+    const BinSvm& b = *f.at<BinSvm>(off);
+    if(b.nr_class < 1 || b.l < 0)
+        throw std::runtime_error("Corrupt SVM in binary model file.");
+
+    // Get (and bounds-check) everything first, such that nothing leaks.
+    const std::size_t k = b.nr_class, l = b.l, npairs = k*(k-1)/2;
+    const int32_t* label = f.at<int32_t>(b.label_off, k);
+    const int32_t* nsv = f.at<int32_t>(b.nsv_off, k);
+    const int32_t* ids = f.at<int32_t>(b.ids_off, l);
+    const double* rho = f.at<double>(b.rho_off, npairs);
+    const double* probA = b.has_prob ? f.at<double>(b.proba_off, npairs) : nullptr;
+    const double* probB = b.has_prob ? f.at<double>(b.probb_off, npairs) : nullptr;
+    const double* coef = f.at<double>(b.coef_off, (k-1)*l);
+
+    svm_model* m = static_cast<svm_model*>(malloc(sizeof(svm_model)));
+    m->param = svm_parameter();
+    m->param.svm_type = b.svm_type;
+    m->param.kernel_type = b.kernel_type;
+    m->nr_class = k;
+    m->l = l;
+    m->label = copy_of(label, k);
+    m->nSV = copy_of(nsv, k);
+    m->rho = copy_of(rho, npairs);
+    m->probA = probA ? copy_of(probA, npairs) : nullptr;
+    m->probB = probB ? copy_of(probB, npairs) : nullptr;
+    m->sv_indices = nullptr;
+
+    m->sv_coef = static_cast<double**>(malloc(std::max<std::size_t>(1, k-1)*sizeof(double*)));
+    for(std::size_t i = 0 ; i < k-1 ; ++i)
+        m->sv_coef[i] = copy_of(coef + i*l, l);
+
+    // Same shape as what PatchModel::keep_svs leaves behind.
+    m->SV = static_cast<svm_node**>(malloc(std::max<std::size_t>(1, l)*sizeof(svm_node*)));
+    svm_node* x_space = l > 0 ? static_cast<svm_node*>(malloc(2*l*sizeof(svm_node))) : nullptr;
+    for(std::size_t i = 0 ; i < l ; ++i) {
+        m->SV[i] = x_space + 2*i;
+        m->SV[i][0].index = 0;
+        m->SV[i][0].value = ids[i];
+        m->SV[i][1].index = -1;
+    }
+    m->free_sv = 1;
+
+    return m;
+}
+
+void warco::test_binmodel()
+{
+    std::cout << "Binary SVM round-trip... " << std::flush;
+
+    // A small 3-class problem on a precomputed RBF kernel of 1D points.
+    const int N = 30;
+    std::vector<double> y(N), pts(N);
+    for(int i = 0 ; i < N ; ++i) {
+        y[i] = i % 3;
+        pts[i] = y[i] + 0.8*std::sin(7.0*i);
+    }
+    std::vector<svm_node> nodes(N*(N+2));
+    std::vector<svm_node*> x(N);
+    for(int i = 0 ; i < N ; ++i) {
+        x[i] = &nodes[i*(N+2)];
+        x[i][0].index = 0;
+        x[i][0].value = 1+i;
+        for(int j = 0 ; j < N ; ++j) {
+            x[i][1+j].index = 1+j;
+            x[i][1+j].value = std::exp(-std::abs(pts[i] - pts[j]));
+        }
+        x[i][N+1].index = -1;
+    }
+
+    svm_problem prob;
+    prob.l = N;
+    prob.y = &y[0];
+    prob.x = &x[0];
+    svm_parameter param = svm_parameter();
+    param.svm_type = C_SVC;
+    param.kernel_type = PRECOMPUTED;
+    param.cache_size = 1;
+    param.eps = 0.001;
+    param.C = 1.0;
+    param.probability = 1;
+    param.seed = 1;
+    svm_model* orig = svm_train(&prob, &param);
+
+    const char* tmp = getenv("TMPDIR");
+    std::string fname = std::string(tmp ? tmp : "/tmp") + "/warco-utest.bin";
+    uint64_t off;
+    {
+        BinWriter w(fname);
+        char c = 42;
+        w.append(&c, 1);
+        off = write_svm(w, orig);
+    }
+
+    bool ok = off % BIN_ALIGN == 0;
+    {
+        MappedFile f(fname);
+        svm_model* loaded = read_svm(f, off);
+
+        std::vector<double> p1(3), p2(3);
+        for(int i = 0 ; i < N ; ++i) {
+            ok &= svm_predict_probability(orig, x[i], &p1[0]) == svm_predict_probability(loaded, x[i], &p2[0]);
+            ok &= p1 == p2;
+        }
+        svm_free_and_destroy_model(&loaded);
+    }
+    svm_free_and_destroy_model(&orig);
+    std::remove(fname.c_str());
+
+    if(! ok) {
+        std::cerr << "Failed! (the loaded SVM predicts differently)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
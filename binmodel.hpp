@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+struct svm_model;
+
+namespace warco {
+
+    // Single-file binary model, laid out such that it can be memory-mapped
+    // and used without parsing. All offsets are from the start of the file,
+    // all sections start at a multiple of BIN_ALIGN and numbers are in the
+    // machine's native byte order:
+    //
+    //   BinHeader
+    //   BinPatch[npatches]
+    //   The filters' data, then BinMat[nfilters] describing them
+    //   For each patch, its packed descriptors, then either the SVM's arrays
+    //   followed by their BinSvm or, for feature map models, their YAML.
+    const uint32_t BIN_VERSION = 1;
+    const std::size_t BIN_ALIGN = 64;
+    extern const char BIN_MAGIC[8];
+
+    struct BinHeader {
+        char magic[8];          // "WARCOBIN"
+        uint32_t version;
+        uint32_t npatches;
+        uint32_t nfilters;
+        uint32_t reserved;
+        uint64_t patches_off;   // BinPatch[npatches]
+        uint64_t filters_off;   // BinMat[nfilters]
+        uint64_t size;          // Of the whole file, catches truncated ones.
+    };
+
+    struct BinMat {
+        int32_t rows, cols, type, reserved;
+        uint64_t off;           // Continuous rows*cols elements of `type`.
+    };
+
+    struct BinPatch {
+        double weight, x, y, w, h;
+        double mean;
+        char dist[32];          // Distance::name()
+        char kind[32];          // "kernel" or FeatureMap::name()
+        uint32_t precision;     // QuantCorrs::Precision
+        uint32_t nsamples;
+        // The descriptors are nsamples continuous rows x cols matrices of
+        // `type`, or int8 ones to be multiplied by `scale`.
+        int32_t rows, cols, type;
+        float scale;
+        uint64_t corrs_off;
+        uint64_t model_off;
+        uint64_t model_size;
+    };
+
+    // The SVs are all of the `{0:id}` kind of precomputed-kernel models.
+    struct BinSvm {
+        int32_t svm_type, kernel_type, nr_class, l;
+        int32_t has_prob, reserved;
+        uint64_t label_off;     // int32_t[nr_class]
+        uint64_t nsv_off;       // int32_t[nr_class]
+        uint64_t ids_off;       // int32_t[l]
+        uint64_t rho_off;       // double[nr_class*(nr_class-1)/2], same for probA/B
+        uint64_t proba_off;
+        uint64_t probb_off;
+        uint64_t coef_off;      // double[nr_class-1][l]
+    };
+
+    // The whole training set of a patch model, kept for incremental training
+    // in its own "<patch>.train" file, laid out by the same rules.
+    const uint32_t BIN_TRAIN_VERSION = 1;
+
+    struct BinTrainSet {
+        char magic[8];          // "WARCOTRN"
+        uint32_t version;
+        uint32_t n;
+        int32_t rows, cols, type;
+        uint32_t nsv;
+        double C;
+        double accuracy;        // The cross-validated one, i.e. patch weight.
+        uint64_t lbls_off;      // double[n]
+        uint64_t corrs_off;     // n continuous rows x cols matrices of `type`
+        uint64_t svs_off;       // int32_t[nsv], the SVs' indices into the above
+        uint64_t dists_off;     // float[n*n], raw distances
+    };
+    extern const char BIN_TRAIN_MAGIC[8];
+
+    // Writes a file as a sequence of aligned sections.
+    class BinWriter {
+    public:
+        BinWriter(std::string fname);
+
+        // Returns the offset at which `data` has been written.
+        uint64_t append(const void* data, std::size_t bytes);
+        void write_at(uint64_t off, const void* data, std::size_t bytes);
+        uint64_t size() const { return _pos; }
+
+    protected:
+        std::ofstream _f;
+        std::string _fname;
+        uint64_t _pos;
+    };
+
+    // A whole file, mapped read-only. Shared by all models pointing into it.
+    class MappedFile {
+    public:
+        typedef std::shared_ptr<MappedFile> Ptr;
+
+        MappedFile(std::string fname);
+        ~MappedFile();
+
+        std::size_t size() const { return _size; }
+
+        // Pointer to `n` Ts at `off`, throws if they're not all in the file.
+        template<typename T>
+        const T* at(uint64_t off, std::size_t n = 1) const
+        {
+            this->check(off, n*sizeof(T));
+            return reinterpret_cast<const T*>(_data + off);
+        }
+
+    protected:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        void check(uint64_t off, std::size_t bytes) const;
+
+        const uint8_t* _data;
+        std::size_t _size;
+    };
+
+    bool is_binary_model(std::string fname);
+
+    uint64_t write_svm(BinWriter& w, const svm_model* model);
+    // The returned model owns copies of all it needs, as libsvm frees it.
+    svm_model* read_svm(const MappedFile& f, uint64_t off);
+
+    void test_binmodel();
+
+} // namespace warco
@@ -0,0 +1,344 @@
+#include "compiled.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "libsvm/svm.h"
+
+warco::CompiledSvm::CompiledSvm()
+    : _nclass(0)
+    , _nsv(0)
+    , _nrow(0)
+{ }
+
+void warco::CompiledSvm::compile(const svm_model* svm)
+{
+    this->clear();
+    if(! svm)
+        return;
+
+    if(svm->param.svm_type != C_SVC && svm->param.svm_type != NU_SVC)
+        throw std::runtime_error("Only classification SVMs can be compiled.");
+
+    const unsigned k = svm->nr_class;
+    _nclass = k;
+    _nsv = svm->l;
+
+    // The `0:id` nodes of the precomputed kernel, one-based.
+    _idx.resize(_nsv);
+    bool identity = true;
+    for(std::size_t s = 0 ; s < _nsv ; ++s) {
+        const int id = static_cast<int>(svm->SV[s][0].value);
+        if(svm->SV[s][0].index != 0 || id < 1)
+            throw std::runtime_error("Only SVMs with a precomputed kernel can be compiled.");
+        _idx[s] = id - 1;
+        _nrow = std::max<std::size_t>(_nrow, id);
+        identity &= _idx[s] == s;
+    }
+    if(identity)
+        _idx.clear();
+
+    _coef.resize((k-1)*_nsv);
+    for(unsigned r = 0 ; r+1 < k ; ++r)
+        std::copy(svm->sv_coef[r], svm->sv_coef[r] + _nsv, _coef.begin() + r*_nsv);
+
+    _start.resize(k+1);
+    _start[0] = 0;
+    for(unsigned c = 0 ; c < k ; ++c)
+        _start[c+1] = _start[c] + svm->nSV[c];
+
+    _labels.assign(svm->label, svm->label + k);
+    _rho.assign(svm->rho, svm->rho + k*(k-1)/2);
+    if(svm->probA && svm->probB) {
+        _probA.assign(svm->probA, svm->probA + k*(k-1)/2);
+        _probB.assign(svm->probB, svm->probB + k*(k-1)/2);
+    }
+}
+
+void warco::CompiledSvm::clear()
+{
+    _nclass = 0;
+    _nsv = 0;
+    _nrow = 0;
+    _idx.clear();
+    _coef.clear();
+    _start.clear();
+    _labels.clear();
+    _rho.clear();
+    _probA.clear();
+    _probB.clear();
+}
+
+void warco::CompiledSvm::decision_values(const double* kv, double* dec) const
+{
+    const unsigned k = _nclass;
+
+    std::vector<double> gathered;
+    if(! _idx.empty()) {
+        gathered.resize(_nsv);
+        for(std::size_t s = 0 ; s < _nsv ; ++s)
+            gathered[s] = kv[_idx[s]];
+        kv = gathered.data();
+    }
+
+    // dot[r*k + c] is the r-th coefficient row's dot product with the kernel
+    // values of class c's SVs.
+    std::vector<double> dot((k-1)*k);
+    for(unsigned r = 0 ; r+1 < k ; ++r) {
+        const double* coef = &_coef[r*_nsv];
+        for(unsigned c = 0 ; c < k ; ++c) {
+            double sum = 0.0;
+#if _OPENMP >= 201307
+            #pragma omp simd reduction(+:sum)
+#endif
+            for(std::size_t i = _start[c] ; i < _start[c+1] ; ++i)
+                sum += coef[i]*kv[i];
+            dot[r*k + c] = sum;
+        }
+    }
+
+    // Pair (i,j) weighs class i's SVs by their coefficients for j, which is
+    // their (j-1)-th other class, and class j's by those for i.
+    unsigned p = 0;
+    for(unsigned i = 0 ; i < k ; ++i)
+        for(unsigned j = i+1 ; j < k ; ++j, ++p)
+            dec[p] = dot[(j-1)*k + i] + dot[i*k + j] - _rho[p];
+}
+
+double warco::CompiledSvm::predict(const double* kv) const
+{
+    const unsigned k = _nclass;
+    std::vector<double> dec(k*(k-1)/2);
+    this->decision_values(kv, dec.data());
+
+    std::vector<unsigned> votes(k, 0);
+    unsigned p = 0;
+    for(unsigned i = 0 ; i < k ; ++i)
+        for(unsigned j = i+1 ; j < k ; ++j, ++p)
+            ++votes[dec[p] > 0 ? i : j];
+
+    // The first one wins ties, like in svm_predict.
+    return _labels[std::max_element(votes.begin(), votes.end()) - votes.begin()];
+}
+
+// Same as libsvm's, avoiding catastrophic cancellation in 1-p.
+static double sigmoid_predict(double dec, double A, double B)
+{
+    const double fApB = dec*A + B;
+    return fApB >= 0 ? std::exp(-fApB)/(1.0 + std::exp(-fApB)) : 1.0/(1.0 + std::exp(fApB));
+}
+
+double warco::CompiledSvm::predict_probas(const double* kv, double* probas) const
+{
+    const unsigned k = _nclass;
+    if(! this->probabilistic()) {
+        std::fill(probas, probas + k, 0.0);
+        return this->predict(kv);
+    }
+
+    std::vector<double> dec(k*(k-1)/2);
+    this->decision_values(kv, dec.data());
+
+    // r[i*k+j] is the probability of i rather than j.
+    const double min_prob = 1e-7;
+    std::vector<double> r(k*k, 0.0);
+    unsigned p = 0;
+    for(unsigned i = 0 ; i < k ; ++i) {
+        for(unsigned j = i+1 ; j < k ; ++j, ++p) {
+            r[i*k + j] = std::min(std::max(sigmoid_predict(dec[p], _probA[p], _probB[p]), min_prob), 1-min_prob);
+            r[j*k + i] = 1 - r[i*k + j];
+        }
+    }
+
+    // Method 2 of Wu, Lin and Weng: the probabilities minimize p'Qp under
+    // sum(p) = 1, whose optimality conditions Qp + b = 0 and sum(p) = 1 are
+    // the (k+1)x(k+1) system A [p b]' = [0 ... 0 1]'. Q's diagonal is
+    // positive, so eliminating in order (with partial pivoting for safety)
+    // is stable for the few classes we have.
+    const unsigned n = k+1;
+    std::vector<double> A(n*(n+1), 0.0);
+    for(unsigned t = 0 ; t < k ; ++t) {
+        for(unsigned j = 0 ; j < k ; ++j) {
+            if(j != t) {
+                A[t*(n+1) + t] += r[j*k + t]*r[j*k + t];
+                A[t*(n+1) + j] = -r[j*k + t]*r[t*k + j];
+            }
+        }
+        A[t*(n+1) + k] = 1.0;
+        A[k*(n+1) + t] = 1.0;
+    }
+    A[k*(n+1) + n] = 1.0;
+
+    for(unsigned c = 0 ; c < n ; ++c) {
+        unsigned piv = c;
+        for(unsigned i = c+1 ; i < n ; ++i)
+            if(std::abs(A[i*(n+1) + c]) > std::abs(A[piv*(n+1) + c]))
+                piv = i;
+        if(piv != c)
+            std::swap_ranges(A.begin() + c*(n+1), A.begin() + (c+1)*(n+1), A.begin() + piv*(n+1));
+
+        for(unsigned i = c+1 ; i < n ; ++i) {
+            const double f = A[i*(n+1) + c] / A[c*(n+1) + c];
+            for(unsigned j = c ; j <= n ; ++j)
+                A[i*(n+1) + j] -= f*A[c*(n+1) + j];
+        }
+    }
+
+    std::vector<double> x(n);
+    for(unsigned i = n ; i-- > 0 ; ) {
+        double s = A[i*(n+1) + n];
+        for(unsigned j = i+1 ; j < n ; ++j)
+            s -= A[i*(n+1) + j]*x[j];
+        x[i] = s / A[i*(n+1) + i];
+    }
+    std::copy(x.begin(), x.begin() + k, probas);
+
+    // The first one wins ties, like in svm_predict_probability.
+    return _labels[std::max_element(probas, probas + k) - probas];
+}
+
+std::size_t warco::CompiledSvm::bytes() const
+{
+    return sizeof(*this) + _idx.capacity()*sizeof(std::size_t) + (_coef.capacity() + _labels.capacity() + _rho.capacity() + _probA.capacity() + _probB.capacity())*sizeof(double)
+         + _start.capacity()*sizeof(std::size_t);
+}
+
+void warco::test_compiled()
+{
+    std::cout << "Compiled SVM... " << std::flush;
+
+    // Five classes of points in the plane, with a Gaussian kernel.
+    const unsigned N = 250, Q = 100;
+    cv::RNG& rng = cv::theRNG();
+    std::vector<double> px(N+Q), py(N+Q), y(N);
+    for(unsigned i = 0 ; i < N+Q ; ++i) {
+        px[i] = rng.uniform(0.0, 1.0);
+        py[i] = rng.uniform(0.0, 1.0);
+        if(i < N)
+            y[i] = 1 + static_cast<int>(px[i]*3.3 + py[i]*1.7 + rng.gaussian(0.3) + 5) % 5;
+    }
+    auto kernel = [&](unsigned a, unsigned b) {
+        return std::exp(-4.0*std::hypot(px[a] - px[b], py[a] - py[b]));
+    };
+
+    std::vector<float> K(N*N);
+    for(unsigned i = 0 ; i < N ; ++i)
+        for(unsigned j = 0 ; j < N ; ++j)
+            K[i*N + j] = kernel(i, j);
+
+    std::vector<svm_node> xes(2*N);
+    std::vector<svm_node*> x(N);
+    for(unsigned i = 0 ; i < N ; ++i) {
+        x[i] = &xes[2*i];
+        x[i][0].index = 0;
+        x[i][0].value = 1+i;
+        x[i][1].index = -1;
+    }
+    svm_problem prob;
+    prob.l = N;
+    prob.y = y.data();
+    prob.x = x.data();
+
+    svm_parameter param = svm_parameter();
+    param.svm_type = C_SVC;
+    param.kernel_type = PRECOMPUTED;
+    param.cache_size = 100;
+    param.eps = 0.001;
+    param.shrinking = int(true);
+    param.probability = int(true);
+    param.C = 10.0;
+    param.gram = K.data();
+    param.gram_ld = N;
+    param.seed = 0x5eed;
+    svm_model* svm = svm_train(&prob, &param);
+    svm->param.gram = nullptr;
+
+    // A model as saved by libsvm, whose SVs' ids index the whole training set.
+    const char* tmp = getenv("TMPDIR");
+    const std::string fname = std::string(tmp ? tmp : "/tmp") + "/warco-utest.svm";
+    svm_save_model(fname.c_str(), svm);
+    svm_model* loaded = svm_load_model(fname.c_str());
+    std::remove(fname.c_str());
+
+    CompiledSvm c;
+    c.compile(loaded);
+    const unsigned k = loaded->nr_class, l = loaded->l;
+    bool ok = c.nclass() == k && c.nsv() == l && c.probabilistic() && l < N && c.nrow() <= N;
+
+    // And one renumbered like `keep_svs` does, whose SVs are the kernel row.
+    std::vector<svm_node> sv_nodes(2*l);
+    for(unsigned s = 0 ; s < l ; ++s) {
+        sv_nodes[2*s].index = 0;
+        sv_nodes[2*s].value = 1+s;
+        sv_nodes[2*s+1].index = -1;
+    }
+    std::vector<unsigned> sv_ids(l);
+    for(unsigned s = 0 ; s < l ; ++s) {
+        sv_ids[s] = static_cast<int>(svm->SV[s][0].value) - 1;
+        svm->SV[s] = &sv_nodes[2*s];
+    }
+    CompiledSvm c_svs;
+    c_svs.compile(svm);
+    ok &= c_svs.nrow() == l;
+
+    // Kernel rows of new points: as nodes for libsvm, whole for the compiled
+    // loaded model, and only the SVs' for the renumbered one.
+    std::vector<svm_node> nodes(N+2), sv_row(l+2);
+    std::vector<double> row(N), kv(l), dec1(k*(k-1)/2), dec2(k*(k-1)/2), dec3(k*(k-1)/2), dec4(k*(k-1)/2), p1(k), p2(k);
+    unsigned nagree = 0;
+    for(unsigned q = N ; q < N+Q ; ++q) {
+        nodes[0].index = 0;
+        for(unsigned i = 0 ; i < N ; ++i) {
+            row[i] = kernel(q, i);
+            nodes[1+i].index = 1+i;
+            nodes[1+i].value = row[i];
+        }
+        nodes[N+1].index = -1;
+        sv_row[0].index = 0;
+        for(unsigned s = 0 ; s < l ; ++s) {
+            kv[s] = row[sv_ids[s]];
+            sv_row[1+s].index = 1+s;
+            sv_row[1+s].value = kv[s];
+        }
+        sv_row[l+1].index = -1;
+
+        // The saved model's rho is rounded, so each against its own libsvm.
+        const double v1 = svm_predict_values(loaded, &nodes[0], &dec1[0]);
+        const double v2 = svm_predict_values(svm, &sv_row[0], &dec3[0]);
+        c.decision_values(&row[0], &dec2[0]);
+        c_svs.decision_values(&kv[0], &dec4[0]);
+        for(unsigned p = 0 ; p < dec1.size() ; ++p)
+            ok &= std::abs(dec1[p] - dec2[p]) < 1e-9 && std::abs(dec3[p] - dec4[p]) < 1e-9;
+        ok &= v1 == c.predict(&row[0]) && v2 == c_svs.predict(&kv[0]);
+
+        // Only up to the tolerance of libsvm's iterations.
+        const double l1 = svm_predict_probability(loaded, &nodes[0], &p1[0]);
+        const double l2 = c.predict_probas(&row[0], &p2[0]);
+        double sum = 0.0;
+        for(unsigned i = 0 ; i < k ; ++i) {
+            ok &= std::abs(p1[i] - p2[i]) < 0.01;
+            sum += p2[i];
+        }
+        ok &= std::abs(sum - 1.0) < 1e-9;
+        if(l1 == l2)
+            ++nagree;
+    }
+    ok &= nagree >= Q*95/100;
+
+    svm_free_and_destroy_model(&loaded);
+    svm_free_and_destroy_model(&svm);
+
+    if(! ok) {
+        std::cerr << "Failed! (differs from libsvm's predictions)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
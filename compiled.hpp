@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+struct svm_model;
+
+namespace warco {
+
+    // A trained multi-class C-SVC, laid out for prediction from a kernel
+    // row, i.e. the kernel values of a sample with each of the samples the
+    // SVs' (precomputed kernel) ids refer to. For models trained by
+    // PatchModel, those are just the SVs in order, see `keep_svs`. Older
+    // ones refer to their whole training set, whose SVs get gathered first.
+    //
+    // libsvm keeps, for each SV, one coefficient per other class. Those
+    // become the rows of one dense (classes-1) x SVs matrix, and a single
+    // pass of it over the kernel row gives each row's dot product with each
+    // class's SVs, out of which all pairs' decision values are sums of two.
+    // The pairwise probabilities are then coupled by solving the
+    // (classes+1)-sized linear system of the problem that libsvm solves
+    // iteratively, which is a fixed amount of work.
+    //
+    // Everything matches `svm_predict` and `svm_predict_probability` up to
+    // rounding, and their iterations' tolerance for the probabilities.
+    class CompiledSvm {
+    public:
+        CompiledSvm();
+
+        void compile(const svm_model* svm);
+        void clear();
+        bool empty() const { return _nclass == 0; }
+
+        unsigned nclass() const { return _nclass; }
+        std::size_t nsv() const { return _nsv; }
+        // How many values a kernel row needs, i.e. the largest SV id.
+        std::size_t nrow() const { return _nrow; }
+        bool probabilistic() const { return ! _probA.empty(); }
+
+        // All pairs' decision values for the kernel row `k` of nrow() values,
+        // in libsvm's order.
+        void decision_values(const double* k, double* dec) const;
+        // The label voted for by the pairs, like `svm_predict`.
+        double predict(const double* k) const;
+        // Fills `probas` with nclass() probabilities in the order of the
+        // model's labels and returns the most probable label, like
+        // `svm_predict_probability`. Without probabilities, the same as
+        // `predict` and all of `probas` are 0.
+        double predict_probas(const double* k, double* probas) const;
+
+        std::size_t bytes() const;
+
+    protected:
+        unsigned _nclass;
+        std::size_t _nsv;
+        std::size_t _nrow;
+        // Each SV's index into the kernel row, empty if it's its own.
+        std::vector<std::size_t> _idx;
+        // Row r holds the SVs' coefficients for the r-th other class.
+        std::vector<double> _coef;
+        std::vector<std::size_t> _start;
+        std::vector<double> _labels;
+        std::vector<double> _rho;
+        std::vector<double> _probA;
+        std::vector<double> _probB;
+    };
+
+    void test_compiled();
+
+} // namespace warco
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "warco.hpp"
+
+static double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// The process's resident memory in kB, as heap and the like (anonymous) and
+// as mapped files, or zeros where /proc doesn't tell.
+struct Resident {
+    long anon;
+    long file;
+};
+
+static Resident resident()
+{
+    Resident nrvo = {0, 0};
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    long kb;
+    while(status >> key) {
+        if(key == "RssAnon:" && status >> kb)
+            nrvo.anon = kb;
+        else if(key == "RssFile:" && status >> kb)
+            nrvo.file = kb;
+    }
+    return nrvo;
+}
+
+static void print_footprint(const warco::Warco& model)
+{
+    auto bytes = model.footprints();
+    std::cout << "Resident: " << std::accumulate(bytes.begin(), bytes.end(), std::size_t(0))/(1024.*1024.) << " MB, "
+              << *std::max_element(bytes.begin(), bytes.end())/(1024.*1024.) << " MB for the largest of "
+              << bytes.size() << " patches." << std::endl;
+}
+
+// Loads the model in each of its formats, first once each to measure the
+// memory it takes, keeping all of them such that none gets memory another
+// one freed, then `repeats` more times each for the fastest load time.
+static int bench_load(std::string dir, std::string bin, unsigned repeats)
+{
+    struct Format {
+        const char* name;
+        std::string fname;
+        bool lazy;
+        double load_s;
+        std::size_t footprint;
+        Resident grown;
+    };
+    Format formats[] = {
+        {"YAML/libsvm directory", dir, false, 0.0, 0, {0, 0}},
+        {"binary file", bin, false, 0.0, 0, {0, 0}},
+        {"binary file, lazily", bin, true, 0.0, 0, {0, 0}},
+    };
+
+    std::vector<std::unique_ptr<warco::Warco>> kept;
+    for(auto& f : formats) {
+        Resident r0 = resident();
+        auto t0 = std::chrono::steady_clock::now();
+        kept.emplace_back(new warco::Warco(f.fname, f.lazy));
+        f.load_s = seconds_since(t0);
+        Resident r1 = resident();
+
+        auto bytes = kept.back()->footprints();
+        f.footprint = std::accumulate(bytes.begin(), bytes.end(), std::size_t(0));
+        f.grown.anon = r1.anon - r0.anon;
+        f.grown.file = r1.file - r0.file;
+    }
+
+    std::cout << "format,load_s,footprint_mb,rss_anon_mb,rss_file_mb" << std::endl;
+    for(auto& f : formats) {
+        for(unsigned i = 0 ; i < repeats ; ++i) {
+            auto t0 = std::chrono::steady_clock::now();
+            warco::Warco model(f.fname, f.lazy);
+            f.load_s = std::min(f.load_s, seconds_since(t0));
+        }
+
+        std::cout << f.name << "," << f.load_s << "," << f.footprint/(1024.*1024.) << ","
+                  << f.grown.anon/1024. << "," << f.grown.file/1024. << std::endl;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc >= 4 && std::string(argv[1]) == "--bench-load")
+        return bench_load(argv[2], argv[3], argc > 4 ? std::atoi(argv[4]) : 3);
+
+    if(argc != 3) {
+        std::cout << "Usage: " << argv[0] << " MODEL_NAME OUT_FILE" << std::endl;
+        std::cout << "       " << argv[0] << " --bench-load MODEL_NAME BIN_FILE [REPEATS]" << std::endl;
+        std::cout << std::endl;
+        std::cout << "MODEL_NAME Name of the model which should be converted. Is a directory." << std::endl;
+        std::cout << "OUT_FILE   Name of the single-file binary model to write." << std::endl;
+        std::cout << std::endl;
+        std::cout << "With --bench-load, nothing gets written, but the time it takes to load" << std::endl;
+        std::cout << "MODEL_NAME and its conversion BIN_FILE (the fastest of 1+REPEATS loads," << std::endl;
+        std::cout << "3 by default) and the memory they take get printed as CSV. The latter" << std::endl;
+        std::cout << "both as the models' footprints and as how much the process's resident" << std::endl;
+        std::cout << "anonymous and file-backed memory grew by loading them." << std::endl;
+        return 0;
+    }
+
+    std::cout << "Loading the model... " << std::flush;
+    auto t0 = std::chrono::steady_clock::now();
+    warco::Warco model(argv[1]);
+    double t_dir = seconds_since(t0);
+    std::cout << "Done in " << t_dir << "s." << std::endl;
+    print_footprint(model);
+
+    std::cout << "Saving the binary model... " << std::flush;
+    model.save_binary(argv[2]);
+    std::cout << "Done." << std::endl;
+
+    std::cout << "Loading the binary model... " << std::flush;
+    t0 = std::chrono::steady_clock::now();
+    warco::Warco binmodel(argv[2]);
+    double t_bin = seconds_since(t0);
+    std::cout << "Done in " << t_bin << "s (" << t_dir/t_bin << "x faster)." << std::endl;
+    print_footprint(binmodel);
+
+    std::cout << "Opening it lazily... " << std::flush;
+    t0 = std::chrono::steady_clock::now();
+    warco::Warco lazymodel(argv[2], true);
+    std::cout << "Done in " << seconds_since(t0) << "s." << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include "distcache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "binmodel.hpp"
+#include "cvutils.hpp"
+#include "dists.hpp"
+#include "gram.hpp"
+#include "to_s.hpp"
+
+const char warco::DIST_CACHE_MAGIC[8] = {'W', 'A', 'R', 'C', 'O', 'D', 'S', 'T'};
+
+// 64 bit FNV-1a, continuing from `h`.
+static uint64_t fnv1a(const void* data, std::size_t bytes, uint64_t h = 14695981039346656037ull)
+{
+    const auto* p = static_cast<const uint8_t*>(data);
+    for(std::size_t i = 0 ; i < bytes ; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t warco::sample_hash(const cv::Mat& corr)
+{
+    const int32_t shape[3] = {corr.rows, corr.cols, corr.type()};
+    uint64_t h = fnv1a(shape, sizeof(shape));
+    for(int r = 0 ; r < corr.rows ; ++r)
+        h = fnv1a(corr.ptr(r), corr.cols*corr.elemSize(), h);
+    return h;
+}
+
+static std::string cache_fname(std::string dir, std::string dname, const std::vector<uint64_t>& hashes)
+{
+    uint64_t h = fnv1a(dname.data(), dname.size());
+    h = fnv1a(hashes.data(), hashes.size()*sizeof(uint64_t), h);
+
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h));
+    return dir + "/" + hex + ".dists";
+}
+
+// Number of leading samples of `hashes` whose distances `fname` holds, 0 if
+// it's of no use. Broken or foreign files are simply no use.
+static std::size_t cached_prefix(std::string fname, std::string dname, const std::vector<uint64_t>& hashes, warco::MappedFile::Ptr& f)
+{
+    try {
+        f = std::make_shared<warco::MappedFile>(fname);
+        const warco::BinDistCache& c = *f->at<warco::BinDistCache>(0);
+        if(std::memcmp(c.magic, warco::DIST_CACHE_MAGIC, sizeof(c.magic)) != 0
+         || c.version != warco::DIST_CACHE_VERSION
+         || dname != std::string(c.dist, strnlen(c.dist, sizeof(c.dist)))
+         || c.n > hashes.size())
+            return 0;
+
+        const uint64_t* h = f->at<uint64_t>(c.hashes_off, c.n);
+        f->at<float>(c.dists_off, static_cast<std::size_t>(c.n)*c.n);
+        return std::equal(h, h + c.n, hashes.begin()) ? c.n : 0;
+    } catch(const std::runtime_error&) {
+        return 0;
+    }
+}
+
+static void store(std::string fname, std::string dname, const std::vector<uint64_t>& hashes, const float* D)
+{
+    const std::size_t N = hashes.size();
+
+    warco::BinDistCache c = warco::BinDistCache();
+    std::memcpy(c.magic, warco::DIST_CACHE_MAGIC, sizeof(c.magic));
+    c.version = warco::DIST_CACHE_VERSION;
+    c.n = N;
+    std::strncpy(c.dist, dname.c_str(), sizeof(c.dist) - 1);
+
+    // Written aside and renamed, such that concurrent trainings never see
+    // half a file. The buffer's address tells concurrent patches apart.
+    const std::string tmp = fname + ".tmp" + warco::to_s(getpid()) + "-" + warco::to_s(static_cast<const void*>(D));
+    {
+        warco::BinWriter w(tmp);
+        w.append(&c, sizeof(c));
+        c.hashes_off = w.append(hashes.data(), N*sizeof(uint64_t));
+        c.dists_off = w.append(D, N*N*sizeof(float));
+        w.write_at(0, &c, sizeof(c));
+    }
+
+    if(std::rename(tmp.c_str(), fname.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Couldn't store distances into " + fname + ": " + std::strerror(errno));
+    }
+}
+
+double warco::cached_pdist(const std::vector<cv::Mat>& corrs, const Distance& d, float* D, std::string dir, unsigned nthreads)
+{
+    if(dir.empty())
+        return d.pdist(corrs, D, nthreads);
+
+    const std::size_t N = corrs.size();
+    const std::string dname = d.name();
+    std::vector<uint64_t> hashes(N);
+    for(std::size_t i = 0 ; i < N ; ++i)
+        hashes[i] = sample_hash(corrs[i]);
+
+    // The exact same samples first, or else the longest run of them, i.e.
+    // the same dataset before samples were appended to it.
+    const std::string fname = cache_fname(dir, dname, hashes);
+    MappedFile::Ptr best, f;
+    std::size_t nbest = cached_prefix(fname, dname, hashes, best);
+    if(nbest < N) {
+        if(DIR* dp = opendir(dir.c_str())) {
+            while(dirent* e = readdir(dp)) {
+                const std::string name = e->d_name;
+                if(name.size() < 6 || name.compare(name.size() - 6, 6, ".dists") != 0)
+                    continue;
+
+                std::size_t n = cached_prefix(dir + "/" + name, dname, hashes, f);
+                if(n > nbest) {
+                    nbest = n;
+                    best = f;
+                }
+            }
+            closedir(dp);
+        }
+    }
+
+    double sum = 0.0;
+    if(nbest > 0) {
+        const float* cached = best->at<float>(best->at<BinDistCache>(0)->dists_off, nbest*nbest);
+        for(std::size_t i = 0 ; i < nbest ; ++i) {
+            std::copy(cached + i*nbest, cached + (i+1)*nbest, D + i*N);
+            for(std::size_t j = 0 ; j <= i ; ++j)
+                sum += cached[i*nbest + j];
+        }
+        best.reset();
+        sum += extend_dists(corrs, nbest, d, D, nthreads);
+    } else {
+        sum = d.pdist(corrs, D, nthreads);
+    }
+
+    if(nbest < N) {
+        if(mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+            throw std::runtime_error("Couldn't create the distance cache " + dir + ": " + std::strerror(errno));
+        store(fname, dname, hashes, D);
+    }
+
+    return sum;
+}
+
+void warco::test_distcache()
+{
+    std::cout << "Distance cache... " << std::flush;
+
+    const char* tmp = getenv("TMPDIR");
+    const std::string dir = std::string(tmp ? tmp : "/tmp") + "/warco-utest-dists" + to_s(getpid());
+
+    const unsigned N = 20, Nold = 13;
+    auto d = Distance::create("cbh");
+    std::vector<cv::Mat> corrs(N);
+    for(auto& c : corrs) {
+        c = randspd(4,4);
+        d->prepare(c);
+    }
+    std::vector<cv::Mat> old(corrs.begin(), corrs.begin() + Nold);
+
+    cv::Mat expected(N, N, CV_32F), Dold(Nold, Nold, CV_32F), D(N, N, CV_32F);
+    double expected_sum = d->pdist(corrs, expected.ptr<float>(), 0);
+
+    // A miss, which fills the cache.
+    double sum_old = cached_pdist(old, *d, Dold.ptr<float>(), dir);
+    std::vector<uint64_t> hashes(Nold);
+    for(unsigned i = 0 ; i < Nold ; ++i)
+        hashes[i] = sample_hash(old[i]);
+    const std::string fold = cache_fname(dir, d->name(), hashes);
+
+    // Tamper with a cached distance, to see it being reused.
+    {
+        MappedFile f(fold);
+        const uint64_t off = f.at<BinDistCache>(0)->dists_off + Nold*sizeof(float);
+        std::fstream fs(fold, std::ios::binary | std::ios::in | std::ios::out);
+        fs.seekp(off);
+        const float marker = 1234.0f;
+        fs.write(reinterpret_cast<const char*>(&marker), sizeof(marker));
+    }
+
+    // A partial hit, appended samples.
+    const double tampered = cached_pdist(corrs, *d, D.ptr<float>(), dir);
+    const double sum = tampered - 1234.0f + expected.at<float>(1, 0);
+    bool ok = sum_old > 0.0 && D.at<float>(1, 0) == 1234.0f;
+    ok &= reldiff(sum, expected_sum) < 1e-5;
+
+    // An exact hit of the above.
+    cv::Mat D2(N, N, CV_32F);
+    ok &= reldiff(cached_pdist(corrs, *d, D2.ptr<float>(), dir), tampered) < 1e-6;
+    ok &= std::memcmp(D2.ptr(), D.ptr(), N*N*sizeof(float)) == 0;
+
+    D.at<float>(1, 0) = D.at<float>(0, 1) = expected.at<float>(1, 0);
+    assert_mat_almost_eq(D, expected, 1e-5);
+
+    if(DIR* dp = opendir(dir.c_str())) {
+        while(dirent* e = readdir(dp))
+            std::remove((dir + "/" + e->d_name).c_str());
+        closedir(dp);
+    }
+    rmdir(dir.c_str());
+
+    if(! ok) {
+        std::cerr << "Failed! (sum " << sum << " instead of " << expected_sum << ")" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
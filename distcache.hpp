@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cv {
+    class Mat;
+}
+
+namespace warco {
+
+    class Distance;
+
+    // A directory of raw distance matrices, content-addressed by the
+    // distance's name and the (prepared) descriptors they were computed on,
+    // which already depend on the images, the patch and the filterbank.
+    // Each "<hash>.dists" file is laid out like binary models (binmodel.hpp):
+    const uint32_t DIST_CACHE_VERSION = 1;
+
+    struct BinDistCache {
+        char magic[8];          // "WARCODST"
+        uint32_t version;
+        uint32_t n;
+        char dist[32];          // Distance::name()
+        uint64_t hashes_off;    // uint64_t[n], the samples' `sample_hash`
+        uint64_t dists_off;     // float[n*n]
+    };
+    extern const char DIST_CACHE_MAGIC[8];
+
+    uint64_t sample_hash(const cv::Mat& corr);
+
+    // Same as `d.pdist`, but looks for the distances of all samples, or else
+    // of the longest cached run of samples they start with, in `dir` first.
+    // Only the missing ones are computed, and the result is added to `dir`.
+    double cached_pdist(const std::vector<cv::Mat>& corrs, const Distance& d, float* D, std::string dir, unsigned nthreads = 0);
+
+    void test_distcache();
+
+} // namespace warco
@@ -4,6 +4,7 @@
 #include <opencv2/opencv.hpp>
 
 #include "cvutils.hpp"
+#include "gram.hpp"
 
 // Randomly generated, but computed using original matlab implementation.
 static const cv::Mat g_wA = (cv::Mat_<double>(4,4) <<
@@ -51,12 +52,27 @@ static float euc_sq(const cv::Mat& lA, const cv::Mat& lB)
     return trace(d*d)[0];
 }
 
-class Euclid : public warco::Distance {
+// Gives each distance a blocked, parallel `pdist` calling the concrete
+// class' operator() directly, i.e. without virtual dispatch per pair.
+template<class D>
+class DistanceBase : public warco::Distance {
+public:
+    virtual double pdist(const std::vector<cv::Mat>& corrs, float* out, unsigned nthreads) const
+    {
+        const D& self = static_cast<const D&>(*this);
+        return warco::fill_dists(corrs.size(), out, nthreads, [&self, &corrs](std::size_t i, std::size_t j) {
+            return self.D::operator()(corrs[i], corrs[j]);
+        });
+    }
+};
+
+class Euclid : public DistanceBase<Euclid> {
 public:
     virtual ~Euclid() {}
 
     virtual std::string name() const { return "euclid"; }
     virtual bool canprep() const { return true; }
+    virtual bool isfrob() const { return true; }
 
     virtual void prepare(cv::Mat& corr) const
     {
@@ -68,6 +84,11 @@ public:
         return sqrt(euc_sq(lA, lB));
     }
 
+    virtual double pdist(const std::vector<cv::Mat>& corrs, float* out, unsigned nthreads) const
+    {
+        return warco::pdist_frob(corrs, out, nthreads);
+    }
+
     static void test()
     {
         using warco::reldiff;
@@ -106,7 +127,7 @@ public:
     }
 };
 
-class Cbh : public warco::Distance {
+class Cbh : public DistanceBase<Cbh> {
 public:
     virtual ~Cbh() {}
 
@@ -171,7 +192,7 @@ public:
     }
 };
 
-class Geodesic : public warco::Distance {
+class Geodesic : public DistanceBase<Geodesic> {
 public:
     virtual ~Geodesic () {}
 
@@ -229,17 +250,23 @@ public:
     }
 };
 
-class MyEuclidean : public warco::Distance {
+class MyEuclidean : public DistanceBase<MyEuclidean> {
 public:
     virtual ~MyEuclidean () {}
 
     virtual std::string name() const { return "my euclid"; }
+    virtual bool isfrob() const { return true; }
 
     virtual float operator()(const cv::Mat& corrA, const cv::Mat& corrB) const
     {
         return sqrt(euc_sq(corrA, corrB));
     }
 
+    virtual double pdist(const std::vector<cv::Mat>& corrs, float* out, unsigned nthreads) const
+    {
+        return warco::pdist_frob(corrs, out, nthreads);
+    }
+
     static void test()
     {
         using warco::reldiff;
@@ -20,6 +20,12 @@ namespace warco {
         virtual bool canprep() const {return false;};
         virtual void prepare(cv::Mat& /*cov*/) const {};
         virtual float operator()(const cv::Mat& corrA, const cv::Mat& corrB) const = 0;
+        // Whether the distance is just the euclidean distance of the
+        // flattened (prepared) matrices, so flat kernels may compute it.
+        virtual bool isfrob() const {return false;};
+
+        // All pairwise distances of `corrs`, see `fill_dists` in gram.hpp.
+        virtual double pdist(const std::vector<cv::Mat>& corrs, float* D, unsigned nthreads) const = 0;
 
         virtual std::string name() const = 0;
 
@@ -0,0 +1,417 @@
+#include "featmap.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#include "cvutils.hpp"
+#include "dists.hpp"
+#include "to_s.hpp"
+
+// The log-euclidean distance between two log-matrices is the Frobenius norm
+// of their difference. Packing the upper triangle, with the off-diagonal
+// scaled by sqrt(2), turns it into the plain euclidean norm of vectors.
+static cv::Mat logeuclid_embed(const cv::Mat& l)
+{
+    const int n = l.rows;
+    cv::Mat nrvo(1, n*(n+1)/2, CV_32F);
+    float* out = nrvo.ptr<float>();
+
+    for(int y = 0 ; y < n ; ++y) {
+        const float* line = l.ptr<float>(y);
+        *out++ = line[y];
+        for(int x = y+1 ; x < n ; ++x)
+            *out++ = static_cast<float>(M_SQRT2) * line[x];
+    }
+
+    return nrvo;
+}
+
+// Random Fourier features (Rahimi & Recht 2007) for the kernel
+// `exp(-|a-b|/mean)` on the log-euclidean embedding. That kernel's spectral
+// density is a multivariate Cauchy, which we sample as gaussian/|gaussian|.
+class Rff : public warco::FeatureMap {
+public:
+    virtual ~Rff() {}
+
+    virtual std::string name() const { return "rff"; }
+    virtual unsigned dim() const { return _W.rows; }
+    virtual std::size_t bytes() const { return _W.total()*_W.elemSize() + _b.total()*_b.elemSize(); }
+
+    virtual void fit(const std::vector<cv::Mat>& corrs, const warco::Distance& d, double mean, unsigned dim)
+    {
+        if(d.name() != "euclid")
+            throw std::runtime_error("The 'rff' feature map only works with the 'euclid' distance, not '" + d.name() + "'");
+
+        if(corrs.empty())
+            throw std::runtime_error("Cannot fit a feature map without samples.");
+
+        const int p = corrs[0].rows*(corrs[0].rows+1)/2;
+
+        // Fixed seed so that re-training gives the same model.
+        cv::RNG rng(0x5eed);
+        _W.create(dim, p, CV_32F);
+        for(unsigned r = 0 ; r < dim ; ++r) {
+            double scale = 1.0 / (std::max(std::abs(rng.gaussian(1.0)), 1e-12) * mean);
+            float* line = _W.ptr<float>(r);
+            for(int c = 0 ; c < p ; ++c)
+                line[c] = static_cast<float>(rng.gaussian(1.0) * scale);
+        }
+
+        _b.create(1, dim, CV_32F);
+        for(unsigned i = 0 ; i < dim ; ++i)
+            _b.at<float>(i) = static_cast<float>(rng.uniform(0.0, 2*M_PI));
+    }
+
+    virtual cv::Mat operator()(const cv::Mat& corr, const warco::Distance&) const
+    {
+        cv::Mat z;
+        gemm(logeuclid_embed(corr), _W, 1.0, cv::Mat(), 0.0, z, cv::GEMM_2_T);
+
+        const float norm = static_cast<float>(std::sqrt(2.0 / _W.rows));
+        float* pz = z.ptr<float>();
+        const float* pb = _b.ptr<float>();
+        for(int i = 0 ; i < z.cols ; ++i)
+            pz[i] = norm * std::cos(pz[i] + pb[i]);
+
+        return z;
+    }
+
+    virtual void write(cv::FileStorage& fs) const
+    {
+        fs << "W" << _W;
+        fs << "b" << _b;
+    }
+
+    virtual void read(const cv::FileStorage& fs)
+    {
+        fs["W"] >> _W;
+        fs["b"] >> _b;
+    }
+
+protected:
+    cv::Mat _W;
+    cv::Mat _b;
+};
+
+// Nyström approximation (Williams & Seeger 2001) using `dim` randomly chosen
+// training samples as landmarks. Works with any distance.
+class Nystroem : public warco::FeatureMap {
+public:
+    virtual ~Nystroem() {}
+
+    virtual std::string name() const { return "nystroem"; }
+    virtual unsigned dim() const { return _P.cols; }
+    virtual std::size_t bytes() const
+    {
+        std::size_t nrvo = _P.total()*_P.elemSize();
+        for(const auto& l : _landmarks)
+            nrvo += l.total()*l.elemSize();
+        return nrvo;
+    }
+
+    virtual void fit(const std::vector<cv::Mat>& corrs, const warco::Distance& d, double mean, unsigned dim)
+    {
+        if(corrs.empty())
+            throw std::runtime_error("Cannot fit a feature map without samples.");
+
+        _mean = mean;
+
+        // Partial Fisher-Yates to pick the landmarks, with a fixed seed so
+        // that re-training gives the same model.
+        const unsigned N = corrs.size(), m = std::min<unsigned>(dim, N);
+        std::vector<unsigned> idx(N);
+        for(unsigned i = 0 ; i < N ; ++i)
+            idx[i] = i;
+
+        cv::RNG rng(0x5eed);
+        _landmarks.resize(m);
+        for(unsigned i = 0 ; i < m ; ++i) {
+            std::swap(idx[i], idx[i + rng.uniform(0, static_cast<int>(N-i))]);
+            _landmarks[i] = corrs[idx[i]].clone();
+        }
+
+        cv::Mat K(m, m, CV_64F);
+        for(unsigned i = 0 ; i < m ; ++i) {
+            for(unsigned j = 0 ; j < i ; ++j)
+                K.at<double>(i,j) = K.at<double>(j,i) = std::exp(-d(_landmarks[i], _landmarks[j]) / _mean);
+            K.at<double>(i,i) = std::exp(-d(_landmarks[i], _landmarks[i]) / _mean);
+        }
+
+        // phi(x) = k_m(x) U L^-1/2, dropping the numerically null directions.
+        cv::Mat vals, vecs;
+        if(! eigen(K, vals, vecs))
+            throw std::runtime_error("Cannot eigen-decompose the landmarks' kernel.");
+
+        const double lmax = vals.at<double>(0);
+        int r = 0;
+        while(r < vals.rows && vals.at<double>(r) > 1e-8*lmax)
+            ++r;
+
+        _P.create(m, r, CV_32F);
+        for(int k = 0 ; k < r ; ++k) {
+            double s = 1.0 / std::sqrt(vals.at<double>(k));
+            for(unsigned i = 0 ; i < m ; ++i)
+                _P.at<float>(i,k) = static_cast<float>(vecs.at<double>(k,i) * s);
+        }
+    }
+
+    virtual cv::Mat operator()(const cv::Mat& corr, const warco::Distance& d) const
+    {
+        cv::Mat k(1, _landmarks.size(), CV_32F);
+        for(unsigned i = 0 ; i < _landmarks.size() ; ++i)
+            k.at<float>(i) = static_cast<float>(std::exp(-d(_landmarks[i], corr) / _mean));
+
+        return k * _P;
+    }
+
+    virtual void write(cv::FileStorage& fs) const
+    {
+        fs << "mean" << _mean;
+        fs << "nlandmarks" << static_cast<int>(_landmarks.size());
+        for(unsigned i = 0 ; i < _landmarks.size() ; ++i)
+            fs << "landmark" + warco::to_s(i) << _landmarks[i];
+        fs << "P" << _P;
+    }
+
+    virtual void read(const cv::FileStorage& fs)
+    {
+        fs["mean"] >> _mean;
+        int m = 0;
+        fs["nlandmarks"] >> m;
+        _landmarks.resize(m);
+        for(int i = 0 ; i < m ; ++i)
+            fs["landmark" + warco::to_s(i)] >> _landmarks[i];
+        fs["P"] >> _P;
+    }
+
+protected:
+    double _mean;
+    std::vector<cv::Mat> _landmarks;
+    cv::Mat _P;
+};
+
+warco::FeatureMap::Ptr warco::FeatureMap::create(std::string name)
+{
+    if(name == "rff") {
+        return Ptr(new Rff());
+    } else if(name == "nystroem") {
+        return Ptr(new Nystroem());
+    } else {
+        throw std::runtime_error("Unknown feature map: '" + name + "'");
+    }
+}
+
+void warco::LinearSvm::train(const cv::Mat& X, const std::vector<double>& y, double C)
+{
+    const int N = X.rows;
+    dim = X.cols;
+
+    labels = y;
+    std::sort(labels.begin(), labels.end());
+    labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+
+    // Diagonal of the dual's Q matrix, the `+1` is the bias' constant feature.
+    std::vector<double> QD(N);
+    for(int i = 0 ; i < N ; ++i)
+        QD[i] = X.row(i).dot(X.row(i)) + 1.0;
+
+    w.assign(labels.size()*(dim+1), 0.0f);
+    std::vector<double> wk(dim+1), alpha(N);
+    std::vector<int> idx(N);
+    cv::RNG rng(0x5eed);
+
+    for(unsigned k = 0 ; k < labels.size() ; ++k) {
+        std::fill(wk.begin(), wk.end(), 0.0);
+        std::fill(alpha.begin(), alpha.end(), 0.0);
+        for(int i = 0 ; i < N ; ++i)
+            idx[i] = i;
+
+        for(unsigned iter = 0 ; iter < 1000 ; ++iter) {
+            for(int i = 0 ; i < N ; ++i)
+                std::swap(idx[i], idx[i + rng.uniform(0, N-i)]);
+
+            double PGmax = -HUGE_VAL, PGmin = HUGE_VAL;
+            for(int s = 0 ; s < N ; ++s) {
+                const int i = idx[s];
+                const double yi = y[i] == labels[k] ? 1.0 : -1.0;
+                const float* xi = X.ptr<float>(i);
+
+                double wx = wk[dim];
+                for(unsigned f = 0 ; f < dim ; ++f)
+                    wx += wk[f]*xi[f];
+
+                const double G = yi*wx - 1.0;
+                double PG = G;
+                if(alpha[i] == 0.0)
+                    PG = std::min(G, 0.0);
+                else if(alpha[i] == C)
+                    PG = std::max(G, 0.0);
+
+                PGmax = std::max(PGmax, PG);
+                PGmin = std::min(PGmin, PG);
+
+                if(std::abs(PG) > 1e-12) {
+                    const double old = alpha[i];
+                    alpha[i] = std::min(std::max(alpha[i] - G/QD[i], 0.0), C);
+                    const double delta = (alpha[i] - old)*yi;
+                    for(unsigned f = 0 ; f < dim ; ++f)
+                        wk[f] += delta*xi[f];
+                    wk[dim] += delta;
+                }
+            }
+
+            // Same stopping criterion (and tolerance) as liblinear.
+            if(PGmax - PGmin <= 0.1)
+                break;
+        }
+
+        std::copy(wk.begin(), wk.end(), w.begin() + k*(dim+1));
+    }
+}
+
+std::vector<double> warco::LinearSvm::decision_values(const cv::Mat& x) const
+{
+    std::vector<double> nrvo(labels.size());
+    const float* px = x.ptr<float>();
+
+    for(unsigned k = 0 ; k < labels.size() ; ++k) {
+        const float* wk = &w[k*(dim+1)];
+        double f = wk[dim];
+        for(unsigned i = 0 ; i < dim ; ++i)
+            f += wk[i]*px[i];
+        nrvo[k] = f;
+    }
+
+    return nrvo;
+}
+
+unsigned warco::LinearSvm::predict(const cv::Mat& x) const
+{
+    auto f = this->decision_values(x);
+    return static_cast<unsigned>(labels[std::max_element(f.begin(), f.end()) - f.begin()]);
+}
+
+std::vector<double> warco::LinearSvm::predict_probas(const cv::Mat& x) const
+{
+    // Normalized logistic of the one-vs-rest decision values.
+    auto nrvo = this->decision_values(x);
+
+    double tot = 0.0;
+    for(auto& p : nrvo)
+        tot += (p = 1.0/(1.0 + std::exp(-p)));
+    for(auto& p : nrvo)
+        p /= tot;
+
+    return nrvo;
+}
+
+void warco::LinearSvm::write(cv::FileStorage& fs) const
+{
+    cv::Mat lbls(labels, true), W(labels.size(), dim+1, CV_32F, const_cast<float*>(&w[0]));
+    fs << "labels" << lbls;
+    fs << "linear" << W;
+}
+
+void warco::LinearSvm::read(const cv::FileStorage& fs)
+{
+    cv::Mat lbls, W;
+    fs["labels"] >> lbls;
+    fs["linear"] >> W;
+
+    labels.assign(lbls.ptr<double>(), lbls.ptr<double>() + lbls.total());
+    dim = W.cols - 1;
+    w.assign(W.ptr<float>(), W.ptr<float>() + W.total());
+}
+
+static void test_nystroem()
+{
+    std::cout << "Nyström feature map... " << std::flush;
+
+    auto d = warco::Distance::create("euclid");
+    std::vector<cv::Mat> corrs(8);
+    for(auto& c : corrs) {
+        c = warco::randspd(4,4);
+        d->prepare(c);
+    }
+
+    // Using all samples as landmarks, the kernel is exact on them.
+    auto fm = warco::FeatureMap::create("nystroem");
+    fm->fit(corrs, *d, 1.0, corrs.size());
+
+    for(unsigned i = 0 ; i < corrs.size() ; ++i) {
+        for(unsigned j = 0 ; j < corrs.size() ; ++j) {
+            double k = std::exp(-(*d)(corrs[i], corrs[j]));
+            double phik = (*fm)(corrs[i], *d).dot((*fm)(corrs[j], *d));
+            if(std::abs(k - phik) > 1e-3) {
+                std::cerr << "Failed! (k=" << k << " but phi.phi=" << phik << ")" << std::endl;
+                throw std::runtime_error("Test assertion failed.");
+            }
+        }
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+static void test_rff()
+{
+    std::cout << "Random Fourier feature map... " << std::flush;
+
+    auto d = warco::Distance::create("euclid");
+    std::vector<cv::Mat> corrs(4);
+    for(auto& c : corrs) {
+        c = warco::randspd(4,4);
+        d->prepare(c);
+    }
+
+    auto fm = warco::FeatureMap::create("rff");
+    fm->fit(corrs, *d, 1.0, 20000);
+
+    for(unsigned i = 0 ; i < corrs.size() ; ++i) {
+        for(unsigned j = 0 ; j < corrs.size() ; ++j) {
+            double k = std::exp(-(*d)(corrs[i], corrs[j]));
+            double phik = (*fm)(corrs[i], *d).dot((*fm)(corrs[j], *d));
+            if(std::abs(k - phik) > 0.05) {
+                std::cerr << "Failed! (k=" << k << " but phi.phi=" << phik << ")" << std::endl;
+                throw std::runtime_error("Test assertion failed.");
+            }
+        }
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+static void test_linsvm()
+{
+    std::cout << "Linear SVM... " << std::flush;
+
+    // Three well-separated blobs.
+    cv::Mat X(60, 2, CV_32F);
+    std::vector<double> y(60);
+    for(int i = 0 ; i < 60 ; ++i) {
+        y[i] = i % 3;
+        X.at<float>(i, 0) = (i%3 == 1 ? 5.f : 0.f) + cv::theRNG().uniform(-1.0, 1.0);
+        X.at<float>(i, 1) = (i%3 == 2 ? 5.f : 0.f) + cv::theRNG().uniform(-1.0, 1.0);
+    }
+
+    warco::LinearSvm svm;
+    svm.train(X, y, 10.0);
+
+    for(int i = 0 ; i < 60 ; ++i) {
+        if(svm.predict(X.row(i)) != y[i]) {
+            std::cerr << "Failed! (sample " << i << " of class " << y[i] << " predicted as " << svm.predict(X.row(i)) << ")" << std::endl;
+            throw std::runtime_error("Test assertion failed.");
+        }
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+void warco::test_featmap()
+{
+    test_nystroem();
+    test_rff();
+    test_linsvm();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cv {
+    class Mat;
+    class FileStorage;
+}
+
+namespace warco {
+
+    class Distance;
+
+    // An explicit, finite-dimensional map `phi` such that the dot-product
+    // `phi(A).phi(B)` approximates the kernel `exp(-d(A,B)/mean)`.
+    // All descriptors passed in are expected to be `prepare`d already.
+    class FeatureMap {
+    public:
+        typedef std::unique_ptr<FeatureMap> Ptr;
+
+        virtual ~FeatureMap() {};
+
+        virtual void fit(const std::vector<cv::Mat>& corrs, const Distance& d, double mean, unsigned dim) = 0;
+        // Returns a 1xdim() CV_32F row.
+        virtual cv::Mat operator()(const cv::Mat& corr, const Distance& d) const = 0;
+        virtual unsigned dim() const = 0;
+        // Memory taken by the fitted map.
+        virtual std::size_t bytes() const = 0;
+
+        virtual void write(cv::FileStorage& fs) const = 0;
+        virtual void read(const cv::FileStorage& fs) = 0;
+
+        virtual std::string name() const = 0;
+
+        static Ptr create(std::string name);
+
+    protected:
+        FeatureMap() {};
+    };
+
+    // One-vs-rest linear SVM (L1-loss, L2-regularized) trained by dual
+    // coordinate descent, as in Hsieh et al. 2008 / liblinear.
+    struct LinearSvm {
+        void train(const cv::Mat& X, const std::vector<double>& y, double C);
+        unsigned predict(const cv::Mat& x) const;
+        std::vector<double> predict_probas(const cv::Mat& x) const;
+
+        void write(cv::FileStorage& fs) const;
+        void read(const cv::FileStorage& fs);
+
+        // Sorted distinct labels seen during training.
+        std::vector<double> labels;
+        // One row of (dim+1) weights per label, the last one being the bias.
+        std::vector<float> w;
+        unsigned dim;
+
+    protected:
+        std::vector<double> decision_values(const cv::Mat& x) const;
+    };
+
+    void test_featmap();
+
+} // namespace warco
@@ -19,6 +19,7 @@ namespace cv {
 
         void add_filter(Mat kernel);
         std::size_t size() const;
+        const std::vector<Mat>& kernels() const { return _kernels; }
 
         void filter(const Mat& in, Mat* out_begin) const;
         std::vector<Mat> filter(const Mat& in) const;
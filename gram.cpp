@@ -0,0 +1,275 @@
+#include "gram.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "cvutils.hpp"
+#include "dists.hpp"
+#include "samples.hpp"
+
+warco::GramBuffer::GramBuffer()
+    : _data(nullptr)
+    , _bytes(0)
+    , _mapped(false)
+{ }
+
+warco::GramBuffer::~GramBuffer()
+{
+    this->release();
+}
+
+float* warco::GramBuffer::alloc(std::size_t N, std::string scratch_dir)
+{
+    this->release();
+
+    if(scratch_dir.empty()) {
+        _heap.resize(N*N);
+        return _data = _heap.empty() ? nullptr : &_heap[0];
+    }
+
+    std::string path = scratch_dir + "/warco-gram-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if(fd < 0)
+        throw std::runtime_error("Can't create a Gram matrix file in " + scratch_dir + ": " + std::strerror(errno));
+
+    // Nobody else needs to see it, and it goes away with the mapping.
+    unlink(path.c_str());
+
+    // Reserve the disk space now, rather than SIGBUS-ing when it runs out.
+    _bytes = std::max<std::size_t>(1, N*N*sizeof(float));
+    if(int err = posix_fallocate(fd, 0, _bytes)) {
+        close(fd);
+        throw std::runtime_error("Can't allocate a Gram matrix file in " + scratch_dir + ": " + std::strerror(err));
+    }
+
+    void* p = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        throw std::runtime_error(std::string("Can't map a Gram matrix file: ") + std::strerror(errno));
+
+    _mapped = true;
+    return _data = static_cast<float*>(p);
+}
+
+void warco::GramBuffer::release()
+{
+    if(_mapped)
+        munmap(_data, _bytes);
+
+    // Actually release the memory.
+    std::vector<float>().swap(_heap);
+    _data = nullptr;
+    _bytes = 0;
+    _mapped = false;
+}
+
+double warco::pdist_frob(const std::vector<cv::Mat>& corrs, float* D, unsigned nthreads)
+{
+    if(corrs.empty())
+        return 0.0;
+
+    // All in one contiguous block is what makes it fast. A SampleStore's
+    // samples already are, as evenly spaced rows of floats. Anything else
+    // gets packed into one.
+    const std::size_t L = corrs[0].total();
+    const float* P = corrs[0].type() == CV_32F ? corrs[0].ptr<float>() : nullptr;
+    const std::ptrdiff_t S = corrs.size() > 1 && P ? corrs[1].ptr<float>() - P : L;
+    bool strided = P && S >= static_cast<std::ptrdiff_t>(L);
+    for(std::size_t i = 0 ; strided && i < corrs.size() ; ++i)
+        strided = corrs[i].type() == CV_32F && corrs[i].isContinuous() && corrs[i].ptr<float>() == P + i*S;
+
+    std::vector<float> packed;
+    std::size_t stride = S;
+    if(! strided) {
+        packed.resize(corrs.size()*L);
+        for(std::size_t i = 0 ; i < corrs.size() ; ++i) {
+            cv::Mat dst(corrs[i].rows, corrs[i].cols, CV_32F, &packed[i*L]);
+            corrs[i].convertTo(dst, CV_32F);
+        }
+        P = &packed[0];
+        stride = L;
+    }
+
+    return fill_dists(corrs.size(), D, nthreads, [P, L, stride](std::size_t i, std::size_t j) {
+        const float* a = P + i*stride;
+        const float* b = P + j*stride;
+        float acc = 0.0f;
+#if _OPENMP >= 201307
+        #pragma omp simd reduction(+:acc)
+#endif
+        for(std::size_t k = 0 ; k < L ; ++k) {
+            float d = a[k] - b[k];
+            acc += d*d;
+        }
+        return std::sqrt(acc);
+    });
+}
+
+double warco::build_gram(const std::vector<cv::Mat>& corrs, const Distance& d, float* K, unsigned nthreads)
+{
+    const std::size_t N = corrs.size();
+
+    // Compute the distance matrix first, but compute the mean in the same run,
+    // we'll need it to turn the matrix into a mercer kernel next.
+    const double mean = d.pdist(corrs, K, nthreads) / (N*(N+1)/2);
+    kernelize(K, N, mean, nthreads);
+    return mean;
+}
+
+void warco::kernelize(float* K, std::size_t N, double mean, unsigned nthreads)
+{
+    // A row at a time, with OpenCV's vectorized exp.
+    const int iN = N;
+    parallel_for(iN, nthreads, [=](int i) {
+        cv::Mat row(1, iN, CV_32F, K + i*N);
+        row.convertTo(row, CV_32F, -1.0/mean);
+        exp(row, row);
+    });
+}
+
+double warco::extend_dists(const std::vector<cv::Mat>& corrs, std::size_t Nold, const Distance& d, float* D, unsigned nthreads)
+{
+    const std::size_t N = corrs.size();
+    const int M = N - Nold;
+
+    // Row i of the new ones costs Nold+i distances, hence dynamic.
+    std::vector<double> sums(M, 0.0);
+    parallel_for(M, nthreads, [&](int m) {
+        const std::size_t i = Nold + m;
+        double sum = 0.0;
+        for(std::size_t j = 0 ; j <= i ; ++j) {
+            float dij = d(corrs[i], corrs[j]);
+            D[i*N+j] = D[j*N+i] = dij;
+            sum += dij;
+        }
+        sums[m] = sum;
+    });
+
+    double sum = 0.0;
+    for(double s : sums)
+        sum += s;
+    return sum;
+}
+
+static void test_build_gram(std::string dname)
+{
+    std::cout << "Gram matrix (" << dname << ")... " << std::flush;
+
+    // More than one tile, and not a multiple of it.
+    const unsigned N = warco::GRAM_TILE + 13;
+    auto d = warco::Distance::create(dname);
+    std::vector<cv::Mat> corrs(N);
+    for(auto& c : corrs) {
+        c = warco::randspd(4,4);
+        d->prepare(c);
+    }
+
+    // The good old serial double loop.
+    cv::Mat expected(N, N, CV_32F);
+    double mean = 0.0;
+    for(unsigned i = 0 ; i < N ; ++i) {
+        for(unsigned j = 0 ; j <= i ; ++j) {
+            double dij = (*d)(corrs[i], corrs[j]);
+            expected.at<float>(i,j) = expected.at<float>(j,i) = dij;
+            mean += dij;
+        }
+    }
+    mean /= N*(N+1)/2;
+    for(unsigned i = 0 ; i < N ; ++i)
+        for(unsigned j = 0 ; j < N ; ++j)
+            expected.at<float>(i,j) = std::exp(-expected.at<float>(i,j) / mean);
+
+    cv::Mat K(N, N, CV_32F);
+    double actual = warco::build_gram(corrs, *d, K.ptr<float>());
+
+    if(warco::reldiff(mean, actual) > 1e-5) {
+        std::cerr << "Failed! (mean " << actual << " instead of " << mean << ")" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+    warco::assert_mat_almost_eq(K, expected, 1e-5);
+
+    // The same, straight off a sample store's rows.
+    warco::SampleStore store;
+    for(const auto& c : corrs)
+        store.push_back(c, 0.0);
+    cv::Mat Ks(N, N, CV_32F);
+    warco::build_gram(store.mats(), *d, Ks.ptr<float>());
+    warco::assert_mat_almost_eq(Ks, K, 1e-6);
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+static void test_mapped_gram()
+{
+    std::cout << "Memory-mapped Gram matrix... " << std::flush;
+
+    const unsigned N = warco::GRAM_TILE + 13;
+    auto d = warco::Distance::create("cbh");
+    std::vector<cv::Mat> corrs(N);
+    for(auto& c : corrs) {
+        c = warco::randspd(4,4);
+        d->prepare(c);
+    }
+
+    const char* tmp = getenv("TMPDIR");
+    warco::GramBuffer heap, mapped;
+    double m1 = warco::build_gram(corrs, *d, heap.alloc(N));
+    double m2 = warco::build_gram(corrs, *d, mapped.alloc(N, tmp ? tmp : "/tmp"));
+
+    if(heap.mapped() || !mapped.mapped() || m1 != m2) {
+        std::cerr << "Failed! (mean " << m2 << " instead of " << m1 << ")" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+    warco::assert_mat_almost_eq(cv::Mat(N, N, CV_32F, mapped.data()), cv::Mat(N, N, CV_32F, heap.data()), 0.0);
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+static void test_extend_dists()
+{
+    std::cout << "Extending distances... " << std::flush;
+
+    const unsigned N = 20, Nold = 13;
+    auto d = warco::Distance::create("cbh");
+    std::vector<cv::Mat> corrs(N);
+    for(auto& c : corrs) {
+        c = warco::randspd(4,4);
+        d->prepare(c);
+    }
+
+    cv::Mat expected(N, N, CV_32F);
+    double expected_sum = d->pdist(corrs, expected.ptr<float>(), 0);
+
+    std::vector<cv::Mat> old(corrs.begin(), corrs.begin() + Nold);
+    cv::Mat Dold(Nold, Nold, CV_32F), D(N, N, CV_32F);
+    double sum = d->pdist(old, Dold.ptr<float>(), 0);
+    cv::Mat topleft = D(cv::Rect(0, 0, Nold, Nold));
+    Dold.copyTo(topleft);
+    sum += warco::extend_dists(corrs, Nold, *d, D.ptr<float>());
+
+    if(warco::reldiff(sum, expected_sum) > 1e-5) {
+        std::cerr << "Failed! (sum " << sum << " instead of " << expected_sum << ")" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+    warco::assert_mat_almost_eq(D, expected, 1e-5);
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+void warco::test_gram()
+{
+    test_build_gram("euclid");
+    test_build_gram("cbh");
+    test_build_gram("geodesic");
+    test_mapped_gram();
+    test_extend_dists();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+// For parallel_for
+#include "tasks.hpp"
+
+namespace cv {
+    class Mat;
+}
+
+namespace warco {
+
+    class Distance;
+
+    // Side, in samples, of the square tiles the Gram builders work on.
+    // 64 of our ~13x13 float descriptors fit comfortably in L2.
+    const unsigned GRAM_TILE = 64;
+
+    // Fills the row-major, NxN `D` with `dist(i, j)` for all j <= i, mirrored
+    // into the upper triangle, and returns the sum of those (N*(N+1)/2) values.
+    // The lower triangle is cut into tiles, which are tasks of the current
+    // TaskPool or else `nthreads` threads (0 means OpenMP's default) work
+    // through. `dist` is typically a lambda calling a concrete distance, so
+    // that it gets inlined.
+    template<typename Fn>
+    double fill_dists(std::size_t N, float* D, unsigned nthreads, Fn dist)
+    {
+        std::vector<std::pair<unsigned, unsigned>> tiles;
+        const unsigned nt = (N + GRAM_TILE - 1) / GRAM_TILE;
+        for(unsigned bi = 0 ; bi < nt ; ++bi)
+            for(unsigned bj = 0 ; bj <= bi ; ++bj)
+                tiles.push_back(std::make_pair(bi, bj));
+
+        // Summed per tile and then in order, which is also deterministic.
+        std::vector<double> sums(tiles.size(), 0.0);
+        parallel_for(tiles.size(), nthreads, [&](int t) {
+            double sum = 0.0;
+            const std::size_t i0 = tiles[t].first*GRAM_TILE, j0 = tiles[t].second*GRAM_TILE;
+            const std::size_t i1 = std::min<std::size_t>(N, i0 + GRAM_TILE);
+            for(std::size_t i = i0 ; i < i1 ; ++i) {
+                const std::size_t j1 = std::min<std::size_t>(i+1, j0 + GRAM_TILE);
+                for(std::size_t j = j0 ; j < j1 ; ++j) {
+                    float d = dist(i, j);
+                    D[i*N+j] = D[j*N+i] = d;
+                    sum += d;
+                }
+            }
+            sums[t] = sum;
+        });
+
+        double sum = 0.0;
+        for(double s : sums)
+            sum += s;
+        return sum;
+    }
+
+    // `fill_dists` for distances which are the euclidean distance between
+    // the flattened matrices (see Distance::isfrob), on a packed copy of them.
+    double pdist_frob(const std::vector<cv::Mat>& corrs, float* D, unsigned nthreads);
+
+    // Storage for a row-major NxN float Gram matrix: on the heap, or, given a
+    // scratch directory, in a memory-mapped file there (unlinked right away)
+    // which the OS can page out instead of running out of memory.
+    class GramBuffer {
+    public:
+        GramBuffer();
+        ~GramBuffer();
+
+        float* alloc(std::size_t N, std::string scratch_dir = "");
+        void release();
+
+        float* data() const { return _data; }
+        bool mapped() const { return _mapped; }
+
+    protected:
+        GramBuffer(const GramBuffer&) = delete;
+        GramBuffer& operator=(const GramBuffer&) = delete;
+
+        std::vector<float> _heap;
+        float* _data;
+        std::size_t _bytes;
+        bool _mapped;
+    };
+
+    // Computes the distances of the new samples corrs[Nold..N) to all
+    // others into rows and columns Nold.. of the row-major, NxN `D`, whose
+    // top-left NoldxNold block is already filled. Returns the sum of the new
+    // distances of the lower triangle, like `fill_dists`.
+    double extend_dists(const std::vector<cv::Mat>& corrs, std::size_t Nold, const Distance& d, float* D, unsigned nthreads = 0);
+
+    // Turns the row-major, NxN distances `K` into the kernel exp(-d/mean).
+    void kernelize(float* K, std::size_t N, double mean, unsigned nthreads = 0);
+
+    // Fills the row-major, NxN `K` with the kernel exp(-d(i,j)/mean) of all
+    // (prepared) samples and returns that mean distance.
+    double build_gram(const std::vector<cv::Mat>& corrs, const Distance& d, float* K, unsigned nthreads = 0);
+
+    void test_gram();
+
+} // namespace warco
@@ -0,0 +1,224 @@
+#include "knn.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#include "cvutils.hpp"
+#include "dists.hpp"
+#include "gram.hpp"
+#include "tasks.hpp"
+
+typedef std::pair<float, unsigned> Neighbour;
+
+warco::VpTree::VpTree(const std::vector<cv::Mat>& pts, const Distance& d)
+    : _pts(pts)
+    , _d(d)
+{
+    std::vector<unsigned> idx(pts.size());
+    for(unsigned i = 0 ; i < idx.size() ; ++i)
+        idx[i] = i;
+
+    // A fixed seed, such that re-training gives the same tree.
+    unsigned seed = 0x5eed;
+    _nodes.reserve(pts.size());
+    this->build(idx, 0, idx.size(), seed);
+}
+
+int warco::VpTree::build(std::vector<unsigned>& idx, std::size_t lo, std::size_t hi, unsigned& seed)
+{
+    if(lo >= hi)
+        return -1;
+
+    // A random vantage point, the others split at their median distance to it.
+    seed = seed*1103515245u + 12345u;
+    std::swap(idx[lo], idx[lo + (seed >> 8) % (hi - lo)]);
+
+    const int me = _nodes.size();
+    _nodes.push_back(Node{idx[lo], 0.0f, -1, -1});
+
+    if(hi - lo == 1)
+        return me;
+
+    std::vector<Neighbour> by_dist;
+    by_dist.reserve(hi - lo - 1);
+    for(std::size_t i = lo+1 ; i < hi ; ++i)
+        by_dist.emplace_back(_d(_pts[idx[lo]], _pts[idx[i]]), idx[i]);
+
+    const std::size_t mid = by_dist.size() / 2;
+    std::nth_element(by_dist.begin(), by_dist.begin() + mid, by_dist.end());
+    for(std::size_t i = 0 ; i < by_dist.size() ; ++i)
+        idx[lo+1+i] = by_dist[i].second;
+
+    _nodes[me].radius = by_dist[mid].first;
+    const int inside = this->build(idx, lo+1, lo+1+mid, seed);
+    const int outside = this->build(idx, lo+1+mid, hi, seed);
+    _nodes[me].inside = inside;
+    _nodes[me].outside = outside;
+    return me;
+}
+
+std::vector<Neighbour> warco::VpTree::knn(const cv::Mat& q, unsigned k, int skip) const
+{
+    // A max-heap of the closest ones so far, the farthest on top.
+    std::vector<Neighbour> heap;
+    heap.reserve(k+1);
+    if(k > 0 && ! _nodes.empty())
+        this->search(0, q, k, skip, heap);
+
+    std::sort_heap(heap.begin(), heap.end());
+    return heap;
+}
+
+void warco::VpTree::search(int node, const cv::Mat& q, unsigned k, int skip, std::vector<Neighbour>& heap) const
+{
+    if(node < 0)
+        return;
+
+    const Node& n = _nodes[node];
+    const float d = _d(q, _pts[n.idx]);
+    if(static_cast<int>(n.idx) != skip) {
+        heap.emplace_back(d, n.idx);
+        std::push_heap(heap.begin(), heap.end());
+        if(heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+    }
+
+    // Anything farther than the current k-th can't make it, which by the
+    // triangle inequality rules out one side when we're far from the radius.
+    auto tau = [&]() {
+        return heap.size() < k ? std::numeric_limits<float>::infinity() : heap.front().first;
+    };
+
+    if(d < n.radius) {
+        if(d - tau() <= n.radius)
+            this->search(n.inside, q, k, skip, heap);
+        if(d + tau() >= n.radius)
+            this->search(n.outside, q, k, skip, heap);
+    } else {
+        if(d + tau() >= n.radius)
+            this->search(n.outside, q, k, skip, heap);
+        if(d - tau() <= n.radius)
+            this->search(n.inside, q, k, skip, heap);
+    }
+}
+
+std::size_t warco::SparseGram::bytes() const
+{
+    return row.capacity()*sizeof(long) + col.capacity()*sizeof(int) + val.capacity()*sizeof(float);
+}
+
+void warco::SparseGram::clear()
+{
+    std::vector<long>().swap(row);
+    std::vector<int>().swap(col);
+    std::vector<float>().swap(val);
+}
+
+warco::SparseGram warco::knn_gram(const std::vector<cv::Mat>& corrs, const Distance& d, unsigned k, double mean, unsigned nthreads)
+{
+    const unsigned N = corrs.size();
+    VpTree tree(corrs, d);
+
+    std::vector<std::vector<Neighbour>> nn(N);
+    parallel_for(N, nthreads, [&](int i) {
+        nn[i] = tree.knn(corrs[i], k, i);
+    });
+
+    // Symmetrize: each neighbour relation goes into both rows, the diagonal
+    // into its own. Duplicates, from pairs which are each other's
+    // neighbours, get merged below into their closer distance, which keeps
+    // the kernel symmetric even if the distance isn't quite.
+    std::vector<std::vector<Neighbour>> rows(N);
+    for(unsigned i = 0 ; i < N ; ++i) {
+        rows[i].emplace_back(0.0f, i);
+        for(const auto& n : nn[i]) {
+            rows[i].emplace_back(n.first, n.second);
+            rows[n.second].emplace_back(n.first, i);
+        }
+        std::vector<Neighbour>().swap(nn[i]);
+    }
+
+    SparseGram g;
+    g.row.reserve(N+1);
+    g.row.push_back(0);
+    for(unsigned i = 0 ; i < N ; ++i) {
+        auto& r = rows[i];
+        std::sort(r.begin(), r.end(), [](const Neighbour& a, const Neighbour& b) { return a.second < b.second; });
+        for(std::size_t j = 0 ; j < r.size() ; ++j) {
+            const float v = static_cast<float>(std::exp(-r[j].first/mean));
+            if(j > 0 && r[j].second == r[j-1].second) {
+                g.val.back() = std::max(g.val.back(), v);
+                continue;
+            }
+            g.col.push_back(r[j].second);
+            g.val.push_back(v);
+        }
+        g.row.push_back(g.col.size());
+        std::vector<Neighbour>().swap(r);
+    }
+
+    return g;
+}
+
+void warco::test_knn()
+{
+    std::cout << "Nearest neighbours... " << std::flush;
+
+    auto d = Distance::create("euclid");
+    const unsigned N = 300, k = 7;
+    std::vector<cv::Mat> corrs(N);
+    for(auto& c : corrs)
+        c = randspd(5, 5);
+
+    // Exact for a metric, i.e. the same as brute force up to ties.
+    bool ok = true;
+    VpTree tree(corrs, *d);
+    for(unsigned i = 0 ; i < N ; i += 7) {
+        std::vector<float> brute;
+        for(unsigned j = 0 ; j < N ; ++j)
+            if(j != i)
+                brute.push_back((*d)(corrs[i], corrs[j]));
+        std::sort(brute.begin(), brute.end());
+
+        auto nn = tree.knn(corrs[i], k, i);
+        ok &= nn.size() == k;
+        for(unsigned j = 0 ; j < nn.size() ; ++j)
+            ok &= nn[j].second != i && nn[j].first == brute[j];
+    }
+
+    // With all others as neighbours, it's the dense kernel.
+    std::vector<float> K(N*N);
+    const double mean = build_gram(corrs, *d, &K[0]);
+    SparseGram full = knn_gram(corrs, *d, N-1, mean);
+    ok &= full.n() == N && full.col.size() == N*N;
+    for(unsigned i = 0 ; i < N ; ++i)
+        for(long e = full.row[i] ; e < full.row[i+1] ; ++e)
+            ok &= std::abs(full.val[e] - K[i*N + full.col[e]]) < 1e-5f;
+
+    // Otherwise symmetric, sorted, with the diagonal, and about N*k entries.
+    SparseGram g = knn_gram(corrs, *d, k, mean);
+    ok &= g.n() == N && g.col.size() >= N*(k+1) && g.col.size() <= N*(2*k+1);
+    for(unsigned i = 0 ; i < N ; ++i) {
+        ok &= std::binary_search(g.col.begin() + g.row[i], g.col.begin() + g.row[i+1], static_cast<int>(i));
+        for(long e = g.row[i] ; e < g.row[i+1] ; ++e) {
+            const int j = g.col[e];
+            ok &= e == g.row[i] || g.col[e-1] < j;
+            auto it = std::lower_bound(g.col.begin() + g.row[j], g.col.begin() + g.row[j+1], static_cast<int>(i));
+            ok &= it != g.col.begin() + g.row[j+1] && *it == static_cast<int>(i) && g.val[it - g.col.begin()] == g.val[e];
+        }
+    }
+
+    if(! ok) {
+        std::cerr << "Failed! (neighbours or sparse kernel differ from brute force)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace cv {
+    class Mat;
+}
+
+namespace warco {
+
+    class Distance;
+
+    // Vantage-point tree over (prepared) samples, for their nearest
+    // neighbours by a distance. Exact for metrics, which all of ours are up
+    // to rounding. Building it takes O(N log N) distances, and a query
+    // roughly O(log N) for small k on well-clustered data.
+    class VpTree {
+    public:
+        // Keeps references to both, which need to outlive it.
+        VpTree(const std::vector<cv::Mat>& pts, const Distance& d);
+
+        // The (at most) `k` nearest points to `q` other than `skip`, as
+        // (distance, index) pairs, nearest first.
+        std::vector<std::pair<float, unsigned>> knn(const cv::Mat& q, unsigned k, int skip = -1) const;
+
+    protected:
+        struct Node {
+            unsigned idx;
+            // Points closer to this node's than the radius go inside.
+            float radius;
+            int inside;
+            int outside;
+        };
+
+        const std::vector<cv::Mat>& _pts;
+        const Distance& _d;
+        std::vector<Node> _nodes;
+
+        int build(std::vector<unsigned>& idx, std::size_t lo, std::size_t hi, unsigned& seed);
+        void search(int node, const cv::Mat& q, unsigned k, int skip, std::vector<std::pair<float, unsigned>>& heap) const;
+    };
+
+    // A symmetric kernel matrix in compressed sparse rows, as taken by
+    // libsvm's `svm_parameter.gram_row` and friends.
+    struct SparseGram {
+        std::vector<long> row;
+        std::vector<int> col;
+        std::vector<float> val;
+
+        std::size_t n() const { return row.empty() ? 0 : row.size() - 1; }
+        std::size_t bytes() const;
+        void clear();
+    };
+
+    // The kernel exp(-d/mean) between each (prepared) sample and its `k`
+    // nearest others, symmetrized, i.e. kept if either one is among the
+    // other's nearest, and with ones on the diagonal. All other entries
+    // are taken to be 0. The neighbours are searched with `nthreads`
+    // threads, see `parallel_for`.
+    SparseGram knn_gram(const std::vector<cv::Mat>& corrs, const Distance& d, unsigned k, double mean, unsigned nthreads = 0);
+
+    void test_knn();
+
+} // namespace warco
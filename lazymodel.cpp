@@ -0,0 +1,191 @@
+#include "lazymodel.hpp"
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "model.hpp"
+
+// The process-wide LRU list of loaded lazy models, most recent first.
+// Lock order is a model's own mutex first, then this one, and only one
+// model's mutex is ever held at a time.
+static std::mutex g_lru_mutex;
+static std::list<std::pair<warco::LazyModel*, std::weak_ptr<warco::LazyModel>>> g_lru;
+static std::size_t g_total = 0;
+static std::size_t g_cap = 0;
+
+warco::LazyModel::LazyModel(std::shared_ptr<PatchModel> model)
+    : _model(model)
+    , _listed(false)
+    , _bytes(0)
+{ }
+
+warco::LazyModel::LazyModel(Loader loader)
+    : _loader(loader)
+    , _listed(false)
+    , _bytes(0)
+{ }
+
+warco::LazyModel::~LazyModel()
+{
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+    if(_listed) {
+        g_lru.erase(_pos);
+        g_total -= _bytes;
+    }
+}
+
+std::shared_ptr<warco::PatchModel> warco::LazyModel::get()
+{
+    std::shared_ptr<PatchModel> nrvo;
+    std::vector<Ptr> victims;
+    {
+        // Loading and listing it under the same lock, such that it can't
+        // get unloaded in between and then listed as if it was loaded.
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(! _model) {
+            auto model = std::make_shared<PatchModel>();
+            _loader(*model);
+            _model = model;
+        }
+        nrvo = _model;
+        if(_loader)
+            this->touch(*nrvo, victims);
+    }
+
+    // The victims' own locks are only taken once ours is released.
+    for(auto& victim : victims)
+        victim->unload();
+
+    return nrvo;
+}
+
+std::shared_ptr<warco::PatchModel> warco::LazyModel::own()
+{
+    auto nrvo = this->get();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _loader = nullptr;
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+    if(_listed) {
+        g_lru.erase(_pos);
+        g_total -= _bytes;
+        _listed = false;
+        _bytes = 0;
+    }
+
+    return nrvo;
+}
+
+void warco::LazyModel::touch(const PatchModel& model, std::vector<Ptr>& victims)
+{
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+    if(_listed) {
+        g_lru.splice(g_lru.begin(), g_lru, _pos);
+    } else {
+        g_lru.push_front(std::make_pair(this, shared_from_this()));
+        _pos = g_lru.begin();
+        _listed = true;
+        _bytes = model.footprint();
+        g_total += _bytes;
+    }
+
+    // Only pick the victims here, they're unloaded under their own lock.
+    while(g_cap && g_total > g_cap && g_lru.back().first != this) {
+        LazyModel* victim = g_lru.back().first;
+        victim->_listed = false;
+        g_total -= victim->_bytes;
+        victim->_bytes = 0;
+
+        // Unless it's already being destroyed, waiting for the lock.
+        if(Ptr p = g_lru.back().second.lock())
+            victims.push_back(p);
+        g_lru.pop_back();
+    }
+}
+
+void warco::LazyModel::unload()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+
+    // Unless it's been used again since it was picked.
+    if(! _listed && _loader)
+        _model.reset();
+}
+
+std::size_t warco::LazyModel::footprint() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _model ? _model->footprint() : 0;
+}
+
+void warco::LazyModel::set_cap(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+    g_cap = bytes;
+}
+
+std::size_t warco::LazyModel::total()
+{
+    std::lock_guard<std::mutex> lru(g_lru_mutex);
+    return g_total;
+}
+
+void warco::test_lazymodel()
+{
+    std::cout << "Lazy patch models... " << std::flush;
+
+    std::atomic<unsigned> nloads(0);
+    std::vector<LazyModel::Ptr> models;
+    for(unsigned i = 0 ; i < 4 ; ++i)
+        models.push_back(std::make_shared<LazyModel>([&nloads](PatchModel&) { ++nloads; }));
+
+    // Room for two (empty) models only.
+    const std::size_t one = PatchModel().footprint();
+    LazyModel::set_cap(2*one + one/2);
+
+    bool ok = nloads == 0 && LazyModel::total() == 0;
+    auto held = models[0]->get();
+    for(auto& m : models)
+        m->get();
+    ok &= nloads == 4 && LazyModel::total() == 2*one;
+    ok &= models[0]->footprint() == 0 && models[1]->footprint() == 0;
+    ok &= models[2]->footprint() == one && models[3]->footprint() == one;
+
+    // Loading it again evicts the least recently used one.
+    auto reloaded = models[0]->get();
+    ok &= nloads == 5 && reloaded != held;
+    ok &= models[2]->footprint() == 0 && models[3]->footprint() == one;
+
+    held.reset();
+    reloaded.reset();
+
+    // Used concurrently, the total still is exactly what's loaded.
+    std::vector<std::thread> threads;
+    for(unsigned t = 0 ; t < 4 ; ++t) {
+        threads.emplace_back([&models, t]() {
+            for(unsigned i = 0 ; i < 2000 ; ++i)
+                models[(t + i*(t+1)) % models.size()]->get();
+        });
+    }
+    for(auto& t : threads)
+        t.join();
+    std::size_t loaded = 0;
+    for(auto& m : models)
+        loaded += m->footprint();
+    ok &= LazyModel::total() == loaded && loaded <= 2*one;
+
+    models.clear();
+    LazyModel::set_cap(0);
+    ok &= LazyModel::total() == 0;
+
+    if(! ok) {
+        std::cerr << "Failed! (" << nloads.load() << " loads, " << LazyModel::total() << " bytes)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace warco {
+
+    struct PatchModel;
+
+    // Holds a PatchModel which, if given a loader, is only loaded when first
+    // used. Such lazy models are unloaded again, least recently used first,
+    // when the total footprint of all of them in the process exceeds the cap.
+    class LazyModel : public std::enable_shared_from_this<LazyModel> {
+    public:
+        typedef std::shared_ptr<LazyModel> Ptr;
+        typedef std::function<void(PatchModel&)> Loader;
+
+        // An eager one, which is never unloaded.
+        LazyModel(std::shared_ptr<PatchModel> model);
+        LazyModel(Loader loader);
+        ~LazyModel();
+
+        // The model, loaded if needed. It stays alive for as long as the
+        // returned pointer does, even if it's unloaded in the meantime.
+        std::shared_ptr<PatchModel> get();
+        // Same, but for modifying it: it won't ever be unloaded anymore.
+        std::shared_ptr<PatchModel> own();
+
+        // PatchModel::footprint, or 0 when it isn't loaded.
+        std::size_t footprint() const;
+
+        // Maximum sum of the footprints of all lazy models, 0 for no limit.
+        static void set_cap(std::size_t bytes);
+        static std::size_t total();
+
+    protected:
+        LazyModel(const LazyModel&) = delete;
+        LazyModel& operator=(const LazyModel&) = delete;
+
+        // Lists it as the most recently used one, picking the ones to evict
+        // to stay under the cap. Needs our own lock to be held.
+        void touch(const PatchModel& model, std::vector<Ptr>& victims);
+        void unload();
+
+        mutable std::mutex _mutex;
+        std::shared_ptr<PatchModel> _model;
+        Loader _loader;
+
+        // Protected by the global LRU lock.
+        bool _listed;
+        std::list<std::pair<LazyModel*, std::weak_ptr<LazyModel>>>::iterator _pos;
+        std::size_t _bytes;
+    };
+
+    void test_lazymodel();
+
+} // namespace warco
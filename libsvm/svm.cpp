@@ -38,6 +38,25 @@ static inline double powi(double base, int times)
 #define TAU 1e-12
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
 
+// warco: rand(), or a private xorshift generator when svm_parameter.seed is
+// set, so that concurrent trainings neither race on rand() nor depend on it.
+struct svm_rng
+{
+	explicit svm_rng(const svm_parameter *param) : state(param->seed) {}
+	int operator()()
+	{
+		if(!state)
+			return rand();
+		unsigned int x = state;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		state = x;
+		return (int)(x >> 1);
+	}
+	unsigned int state;
+};
+
 static void print_string_stdout(const char *s)
 {
 	fputs(s,stdout);
@@ -217,6 +236,14 @@ protected:
 
 	double (Kernel::*kernel_function)(int i, int j) const;
 
+	// warco: dense precomputed kernel, or NULL.
+	const float *gram;
+	const size_t gram_ld;
+	// warco: sparse precomputed kernel, or NULL.
+	const long *gram_row;
+	const int *gram_col;
+	const float *gram_val;
+
 private:
 	const svm_node **x;
 	double *x_square;
@@ -248,10 +275,38 @@ private:
 	{
 		return x[i][(int)(x[j][0].value)].value;
 	}
+	double kernel_dense(int i, int j) const
+	{
+		return gram[(size_t)((int)x[i][0].value-1)*gram_ld + (int)x[j][0].value-1];
+	}
+	double kernel_sparse(int i, int j) const;
 };
 
+// warco: entry (i,j), zero-based, of a sparse precomputed kernel.
+static double sparse_kernel(const long *row, const int *col, const float *val, int i, int j)
+{
+	const int *lo = col + row[i], *hi = col + row[i+1], *end = hi;
+	while(lo < hi)
+	{
+		const int *mid = lo + (hi-lo)/2;
+		if(*mid < j)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo != end && *lo == j ? val[lo-col] : 0.0;
+}
+
+double Kernel::kernel_sparse(int i, int j) const
+{
+	return sparse_kernel(gram_row, gram_col, gram_val, (int)x[i][0].value-1, (int)x[j][0].value-1);
+}
+
 Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
-:kernel_type(param.kernel_type), degree(param.degree),
+:gram(param.kernel_type == PRECOMPUTED ? param.gram : NULL), gram_ld(param.gram_ld),
+ gram_row(param.kernel_type == PRECOMPUTED ? param.gram_row : NULL),
+ gram_col(param.gram_col), gram_val(param.gram_val),
+ kernel_type(param.kernel_type), degree(param.degree),
  gamma(param.gamma), coef0(param.coef0)
 {
 	switch(kernel_type)
@@ -269,7 +324,8 @@ Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
 			kernel_function = &Kernel::kernel_sigmoid;
 			break;
 		case PRECOMPUTED:
-			kernel_function = &Kernel::kernel_precomputed;
+			kernel_function = gram ? &Kernel::kernel_dense :
+			                  gram_row ? &Kernel::kernel_sparse : &Kernel::kernel_precomputed;
 			break;
 	}
 
@@ -366,6 +422,10 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 		case SIGMOID:
 			return tanh(param.gamma*dot(x,y)+param.coef0);
 		case PRECOMPUTED:  //x: test (validation), y: SV
+			if(param.gram) // x is then a training sample too.
+				return param.gram[(size_t)((int)x->value-1)*param.gram_ld + (int)y->value-1];
+			if(param.gram_row)
+				return sparse_kernel(param.gram_row, param.gram_col, param.gram_val, (int)x->value-1, (int)y->value-1);
 			return x[(int)(y->value)].value;
 		default:
 			return 0;  // Unreachable 
@@ -691,6 +751,10 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 		double delta_alpha_i = alpha[i] - old_alpha_i;
 		double delta_alpha_j = alpha[j] - old_alpha_j;
 		
+		// warco: the bulk of the time with dense kernels, vectorized.
+#if _OPENMP >= 201307
+		#pragma omp simd
+#endif
 		for(int k=0;k<active_size;k++)
 		{
 			G[k] += Q_i[k]*delta_alpha_i + Q_j[k]*delta_alpha_j;
@@ -707,23 +771,23 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
 			if(ui != is_upper_bound(i))
 			{
 				Q_i = Q.get_Q(i,l);
-				if(ui)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_i * Q_i[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_i * Q_i[k];
+				double c = ui ? -C_i : C_i;
+#if _OPENMP >= 201307
+				#pragma omp simd
+#endif
+				for(k=0;k<l;k++)
+					G_bar[k] += c * Q_i[k];
 			}
 
 			if(uj != is_upper_bound(j))
 			{
 				Q_j = Q.get_Q(j,l);
-				if(uj)
-					for(k=0;k<l;k++)
-						G_bar[k] -= C_j * Q_j[k];
-				else
-					for(k=0;k<l;k++)
-						G_bar[k] += C_j * Q_j[k];
+				double c = uj ? -C_j : C_j;
+#if _OPENMP >= 201307
+				#pragma omp simd
+#endif
+				for(k=0;k<l;k++)
+					G_bar[k] += c * Q_j[k];
 			}
 		}
 	}
@@ -1270,7 +1334,57 @@ public:
 	:Kernel(prob.l, prob.x, param)
 	{
 		clone(y,y_,prob.l);
-		cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
+		l = prob.l;
+		dense = NULL;
+		dense_len = NULL;
+		pos = NULL;
+		if(gram && !param.gram_cache)
+		{
+			// warco: the dense kernel is already in memory, so rows are
+			// gathered straight out of it instead of going through the cache.
+			cache = NULL;
+			id = new int[prob.l];
+			for(int i=0;i<prob.l;i++)
+				id[i] = (int)prob.x[i][0].value-1;
+			if((double)l*l*sizeof(Qfloat) <= param.cache_size*(1<<20))
+			{
+				// When all of Q fits in cache_size, each row is gathered once
+				// into its place in a contiguous copy in the solver's order,
+				// so that long runs don't gather the same rows over and over.
+				// Pages of rows which are never used aren't even touched.
+				rows[0] = rows[1] = NULL;
+				dense = new Qfloat[(size_t)l*l];
+				dense_len = new int[l]();
+			}
+			else
+			{
+				// Otherwise the solver holds on to at most two rows at a time.
+				rows[0] = new Qfloat[prob.l];
+				rows[1] = new Qfloat[prob.l];
+				next_row = 0;
+			}
+		}
+		else
+		{
+			cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
+			id = NULL;
+			rows[0] = rows[1] = NULL;
+			if(gram_row)
+			{
+				// warco: the cached rows of a sparse kernel are filled by
+				// scattering its entries, which needs the position of each
+				// id in the solver's order (-1 for those of other folds).
+				id = new int[prob.l];
+				pos = new int[gram_ld];
+				for(size_t k=0;k<gram_ld;k++)
+					pos[k] = -1;
+				for(int i=0;i<prob.l;i++)
+				{
+					id[i] = (int)prob.x[i][0].value-1;
+					pos[id[i]] = i;
+				}
+			}
+		}
 		QD = new double[prob.l];
 		for(int i=0;i<prob.l;i++)
 			QD[i] = (this->*kernel_function)(i,i);
@@ -1280,10 +1394,46 @@ public:
 	{
 		Qfloat *data;
 		int start, j;
-		if((start = cache->get_data(i,&data,len)) < len)
+		if(dense)
 		{
-			for(j=start;j<len;j++)
-				data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+			data = dense + (size_t)i*l;
+			if(dense_len[i] < len)
+			{
+				const float *row = gram + (size_t)id[i]*gram_ld;
+				const schar yi = y[i];
+				for(j=dense_len[i];j<len;j++)
+					data[j] = (Qfloat)(yi*y[j]*row[id[j]]);
+				dense_len[i] = len;
+			}
+		}
+		else if(!cache)
+		{
+			data = rows[next_row];
+			next_row ^= 1;
+			const float *row = gram + (size_t)id[i]*gram_ld;
+			const schar yi = y[i];
+			for(j=0;j<len;j++)
+				data[j] = (Qfloat)(yi*y[j]*row[id[j]]);
+		}
+		else if((start = cache->get_data(i,&data,len)) < len)
+		{
+			if(pos)
+			{
+				for(j=start;j<len;j++)
+					data[j] = 0;
+				const schar yi = y[i];
+				for(long k=gram_row[id[i]];k<gram_row[id[i]+1];k++)
+				{
+					const int p = pos[gram_col[k]];
+					if(p >= start && p < len)
+						data[p] = (Qfloat)(yi*y[p]*gram_val[k]);
+				}
+			}
+			else
+			{
+				for(j=start;j<len;j++)
+					data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+			}
 		}
 		return data;
 	}
@@ -1295,7 +1445,31 @@ public:
 
 	void swap_index(int i, int j) const
 	{
-		cache->swap_index(i,j);
+		if(cache) cache->swap_index(i,j);
+		if(!cache || pos) swap(id[i],id[j]);
+		if(pos)
+		{
+			pos[id[i]] = i;
+			pos[id[j]] = j;
+		}
+		if(dense)
+		{
+			// Same as Cache::swap_index: rows, then the columns of the rows
+			// which have both, shortening those which only have one.
+			if(i > j) swap(i,j);
+			Qfloat *ri = dense + (size_t)i*l, *rj = dense + (size_t)j*l;
+			for(int k=0;k<max(dense_len[i],dense_len[j]);k++)
+				swap(ri[k],rj[k]);
+			swap(dense_len[i],dense_len[j]);
+			for(int k=0;k<l;k++)
+			{
+				Qfloat *rk = dense + (size_t)k*l;
+				if(dense_len[k] > j)
+					swap(rk[i],rk[j]);
+				else if(dense_len[k] > i)
+					dense_len[k] = i;
+			}
+		}
 		Kernel::swap_index(i,j);
 		swap(y[i],y[j]);
 		swap(QD[i],QD[j]);
@@ -1306,11 +1480,30 @@ public:
 		delete[] y;
 		delete cache;
 		delete[] QD;
+		delete[] id;
+		delete[] rows[0];
+		delete[] rows[1];
+		delete[] dense;
+		delete[] dense_len;
+		delete[] pos;
 	}
 private:
 	schar *y;
 	Cache *cache;
 	double *QD;
+	int l;
+
+	// warco: all of Q in the solver's order, of which the first
+	// dense_len[i] of row i are filled in.
+	Qfloat *dense;
+	int *dense_len;
+
+	// warco: ids into the dense or sparse precomputed kernel, and for the
+	// latter, the position of each id.
+	int *id;
+	int *pos;
+	Qfloat *rows[2];
+	mutable int next_row;
 };
 
 class ONE_CLASS_Q: public Kernel
@@ -1439,7 +1632,8 @@ private:
 //
 static void solve_c_svc(
 	const svm_problem *prob, const svm_parameter* param,
-	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn)
+	double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+	const double *alpha_init)
 {
 	int l = prob->l;
 	double *minus_ones = new double[l];
@@ -1449,7 +1643,8 @@ static void solve_c_svc(
 
 	for(i=0;i<l;i++)
 	{
-		alpha[i] = 0;
+		alpha[i] = alpha_init ? alpha_init[i] : 0; // warco: warm start
+
 		minus_ones[i] = -1;
 		if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
 	}
@@ -1646,14 +1841,14 @@ struct decision_function
 
 static decision_function svm_train_one(
 	const svm_problem *prob, const svm_parameter *param,
-	double Cp, double Cn)
+	double Cp, double Cn, const double *alpha_init = NULL)
 {
 	double *alpha = Malloc(double,prob->l);
 	Solver::SolutionInfo si;
 	switch(param->svm_type)
 	{
 		case C_SVC:
-			solve_c_svc(prob,param,alpha,&si,Cp,Cn);
+			solve_c_svc(prob,param,alpha,&si,Cp,Cn,alpha_init);
 			break;
 		case NU_SVC:
 			solve_nu_svc(prob,param,alpha,&si);
@@ -1898,12 +2093,13 @@ static void svm_binary_svc_probability(
 	int nr_fold = 5;
 	int *perm = Malloc(int,prob->l);
 	double *dec_values = Malloc(double,prob->l);
+	svm_rng rng(param);
 
 	// random shuffle
 	for(i=0;i<prob->l;i++) perm[i]=i;
 	for(i=0;i<prob->l;i++)
 	{
-		int j = i+rand()%(prob->l-i);
+		int j = i+rng()%(prob->l-i);
 		swap(perm[i],perm[j]);
 	}
 	for(i=0;i<nr_fold;i++)
@@ -2090,6 +2286,15 @@ static void svm_group_classes(const svm_problem *prob, int *nr_class_ret, int **
 // Interface functions
 //
 svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+{
+	return svm_train_warm(prob,param,NULL,NULL);
+}
+
+//
+// warco: svm_train, optionally warm-starting each of the C-SVC pairwise
+// subproblems. See svm.h for the layout of alpha_init and alpha_out.
+//
+svm_model *svm_train_warm(const svm_problem *prob, const svm_parameter *param, const double *alpha_init, double *alpha_out)
 {
 	svm_model *model = Malloc(svm_model,1);
 	model->param = *param;
@@ -2158,6 +2363,16 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 		for(i=0;i<l;i++)
 			x[i] = prob->x[perm[i]];
 
+		// warco: columns of alpha_init/alpha_out are in sorted label order.
+		int *rank = Malloc(int,nr_class);
+		for(i=0;i<nr_class;i++)
+		{
+			rank[i] = 0;
+			for(int j=0;j<nr_class;j++)
+				if(label[j] < label[i])
+					++rank[i];
+		}
+
 		// calculate weighted C
 
 		double *weighted_C = Malloc(double, nr_class);
@@ -2189,42 +2404,86 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 			probB=Malloc(double,nr_class*(nr_class-1)/2);
 		}
 
+		// warco: the pairs are independent and each writes only its own
+		// results, so they can be trained concurrently. Which alphas are
+		// nonzero is gathered afterwards, in the same order as before. Not
+		// when the probabilities' shuffles draw from the shared rand().
+		int nr_pair = nr_class*(nr_class-1)/2;
+		int *pair_i = Malloc(int,nr_pair);
+		int *pair_j = Malloc(int,nr_pair);
 		int p = 0;
 		for(i=0;i<nr_class;i++)
-			for(int j=i+1;j<nr_class;j++)
+			for(int j=i+1;j<nr_class;j++,p++)
 			{
-				svm_problem sub_prob;
-				int si = start[i], sj = start[j];
-				int ci = count[i], cj = count[j];
-				sub_prob.l = ci+cj;
-				sub_prob.x = Malloc(svm_node *,sub_prob.l);
-				sub_prob.y = Malloc(double,sub_prob.l);
-				int k;
+				pair_i[p] = i;
+				pair_j[p] = j;
+			}
+		int nr_thread = param->probability && !param->seed ? 1 : max(1,min(param->nr_thread,nr_pair));
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(nr_thread > 1) num_threads(nr_thread)
+#endif
+		for(p=0;p<nr_pair;p++)
+		{
+			int i = pair_i[p], j = pair_j[p];
+			svm_problem sub_prob;
+			int si = start[i], sj = start[j];
+			int ci = count[i], cj = count[j];
+			sub_prob.l = ci+cj;
+			sub_prob.x = Malloc(svm_node *,sub_prob.l);
+			sub_prob.y = Malloc(double,sub_prob.l);
+			int k;
+			for(k=0;k<ci;k++)
+			{
+				sub_prob.x[k] = x[si+k];
+				sub_prob.y[k] = +1;
+			}
+			for(k=0;k<cj;k++)
+			{
+				sub_prob.x[ci+k] = x[sj+k];
+				sub_prob.y[ci+k] = -1;
+			}
+
+			double *sub_alpha = NULL;
+			if(alpha_init && param->svm_type == C_SVC)
+			{
+				sub_alpha = Malloc(double,sub_prob.l);
 				for(k=0;k<ci;k++)
-				{
-					sub_prob.x[k] = x[si+k];
-					sub_prob.y[k] = +1;
-				}
+					sub_alpha[k] = alpha_init[perm[si+k]*nr_class+rank[j]];
 				for(k=0;k<cj;k++)
-				{
-					sub_prob.x[ci+k] = x[sj+k];
-					sub_prob.y[ci+k] = -1;
-				}
+					sub_alpha[ci+k] = alpha_init[perm[sj+k]*nr_class+rank[i]];
+			}
+
+			if(param->probability)
+				svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
 
-				if(param->probability)
-					svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
+			f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j],sub_alpha);
+			free(sub_alpha);
 
-				f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j]);
+			if(alpha_out)
+			{
 				for(k=0;k<ci;k++)
-					if(!nonzero[si+k] && fabs(f[p].alpha[k]) > 0)
-						nonzero[si+k] = true;
+					alpha_out[perm[si+k]*nr_class+rank[j]] = fabs(f[p].alpha[k]);
 				for(k=0;k<cj;k++)
-					if(!nonzero[sj+k] && fabs(f[p].alpha[ci+k]) > 0)
-						nonzero[sj+k] = true;
-				free(sub_prob.x);
-				free(sub_prob.y);
-				++p;
+					alpha_out[perm[sj+k]*nr_class+rank[i]] = fabs(f[p].alpha[ci+k]);
 			}
+			free(sub_prob.x);
+			free(sub_prob.y);
+		}
+
+		for(p=0;p<nr_pair;p++)
+		{
+			int si = start[pair_i[p]], sj = start[pair_j[p]];
+			int ci = count[pair_i[p]], cj = count[pair_j[p]];
+			for(int k=0;k<ci;k++)
+				if(!nonzero[si+k] && fabs(f[p].alpha[k]) > 0)
+					nonzero[si+k] = true;
+			for(int k=0;k<cj;k++)
+				if(!nonzero[sj+k] && fabs(f[p].alpha[ci+k]) > 0)
+					nonzero[sj+k] = true;
+		}
+		free(pair_i);
+		free(pair_j);
 
 		// build output
 
@@ -2318,6 +2577,7 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 			}
 		
 		free(label);
+		free(rank);
 		free(probA);
 		free(probB);
 		free(count);
@@ -2337,18 +2597,30 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
 
 // Stratified cross validation
 void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target)
+{
+	int *perm = Malloc(int,prob->l);
+	int *fold_start = Malloc(int,nr_fold+1);
+	nr_fold = svm_cross_validation_folds(prob,param,nr_fold,perm,fold_start);
+
+	for(int i=0;i<nr_fold;i++)
+		svm_cross_validation_path(prob,param,perm,fold_start,i,&param->C,1,0,target,NULL,NULL);
+
+	free(fold_start);
+	free(perm);
+}
+
+// warco: the folds of svm_cross_validation, split out of it.
+int svm_cross_validation_folds(const svm_problem *prob, const svm_parameter *param, int nr_fold, int *perm, int *fold_start)
 {
 	int i;
-	int *fold_start;
 	int l = prob->l;
-	int *perm = Malloc(int,l);
 	int nr_class;
+	svm_rng rng(param);
 	if (nr_fold > l)
 	{
 		nr_fold = l;
 		fprintf(stderr,"WARNING: # folds > # data. Will use # folds = # data instead (i.e., leave-one-out cross validation)\n");
 	}
-	fold_start = Malloc(int,nr_fold+1);
 	// stratified cv may not give leave-one-out rate
 	// Each class to l folds -> some folds may have zero elements
 	if((param->svm_type == C_SVC ||
@@ -2368,7 +2640,7 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		for (c=0; c<nr_class; c++) 
 			for(i=0;i<count[c];i++)
 			{
-				int j = i+rand()%(count[c]-i);
+				int j = i+rng()%(count[c]-i);
 				swap(index[start[c]+j],index[start[c]+i]);
 			}
 		for(i=0;i<nr_fold;i++)
@@ -2405,57 +2677,238 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
 		for(i=0;i<l;i++) perm[i]=i;
 		for(i=0;i<l;i++)
 		{
-			int j = i+rand()%(l-i);
+			int j = i+rng()%(l-i);
 			swap(perm[i],perm[j]);
 		}
 		for(i=0;i<=nr_fold;i++)
 			fold_start[i]=i*l/nr_fold;
 	}
 
-	for(i=0;i<nr_fold;i++)
+	return nr_fold;
+}
+
+static int svm_count_classes(const svm_problem *prob)
+{
+	int nr_class = 0;
+	for(int i=0;i<prob->l;i++)
 	{
-		int begin = fold_start[i];
-		int end = fold_start[i+1];
-		int j,k;
-		struct svm_problem subprob;
+		int j;
+		for(j=0;j<i;j++)
+			if((int)prob->y[j] == (int)prob->y[i])
+				break;
+		if(j == i)
+			++nr_class;
+	}
+	return nr_class;
+}
 
-		subprob.l = l-(end-begin);
-		subprob.x = Malloc(struct svm_node*,subprob.l);
-		subprob.y = Malloc(double,subprob.l);
-			
-		k=0;
-		for(j=0;j<begin;j++)
-		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
-		}
-		for(j=end;j<l;j++)
+// warco: the distinct labels of prob, sorted. Returns their number.
+static int svm_sorted_labels(const svm_problem *prob, int *labels)
+{
+	int n = 0;
+	for(int i=0;i<prob->l;i++)
+	{
+		int lbl = (int)prob->y[i], j = n;
+		while(j > 0 && labels[j-1] > lbl)
+			--j;
+		if(j > 0 && labels[j-1] == lbl)
+			continue;
+		for(int k=n;k>j;k--)
+			labels[k] = labels[k-1];
+		labels[j] = lbl;
+		++n;
+	}
+	return n;
+}
+
+// warco: one fold of the cross-validation, for all the C values in turn.
+void svm_cross_validation_path(const svm_problem *prob, const svm_parameter *param,
+	const int *perm, const int *fold_start, int fold,
+	const double *C, int nr_C, int warm_start, double *target, double *alpha_sum, double *dec_target)
+{
+	int l = prob->l;
+	int begin = fold_start[fold];
+	int end = fold_start[fold+1];
+	int j,k,c;
+	struct svm_problem subprob;
+
+	subprob.l = l-(end-begin);
+	subprob.x = Malloc(struct svm_node*,subprob.l);
+	subprob.y = Malloc(double,subprob.l);
+	int *orig = Malloc(int,subprob.l);
+		
+	k=0;
+	for(j=0;j<begin;j++)
+	{
+		subprob.x[k] = prob->x[perm[j]];
+		subprob.y[k] = prob->y[perm[j]];
+		orig[k] = perm[j];
+		++k;
+	}
+	for(j=end;j<l;j++)
+	{
+		subprob.x[k] = prob->x[perm[j]];
+		subprob.y[k] = prob->y[perm[j]];
+		orig[k] = perm[j];
+		++k;
+	}
+
+	// The previous C's solution is a feasible starting point for a larger C,
+	// and becomes one for a smaller C when scaled down.
+	int nr_class = svm_count_classes(&subprob);
+	double *alpha = NULL;
+	if(param->svm_type == C_SVC && (warm_start || alpha_sum))
+		alpha = (double *)calloc(subprob.l*nr_class,sizeof(double));
+	// A class may be missing from this fold's training set (if it has a
+	// single sample), in which case the columns don't match.
+	if(alpha_sum && nr_class != svm_count_classes(prob))
+		alpha_sum = NULL;
+
+	// The decision values go by the sorted labels of the whole problem.
+	int *labels = NULL, nr_all = 0, nr_pair = 0;
+	if(dec_target)
+	{
+		labels = Malloc(int,l);
+		nr_all = svm_sorted_labels(prob,labels);
+		nr_pair = nr_all*(nr_all-1)/2;
+	}
+
+	svm_parameter sub_param = *param;
+	for(c=0;c<nr_C;c++)
+	{
+		sub_param.C = C[c];
+
+		const double *alpha_init = NULL;
+		if(warm_start && alpha && c > 0)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
+			if(C[c] < C[c-1])
+			{
+				double ratio = C[c]/C[c-1];
+				for(j=0;j<subprob.l*nr_class;j++)
+					alpha[j] *= ratio;
+			}
+			alpha_init = alpha;
 		}
-		struct svm_model *submodel = svm_train(&subprob,param);
+
+		struct svm_model *submodel = svm_train_warm(&subprob,&sub_param,alpha_init,alpha);
+		double *fold_target = target + (size_t)c*l;
 		if(param->probability && 
 		   (param->svm_type == C_SVC || param->svm_type == NU_SVC))
 		{
 			double *prob_estimates=Malloc(double,svm_get_nr_class(submodel));
 			for(j=begin;j<end;j++)
-				target[perm[j]] = svm_predict_probability(submodel,prob->x[perm[j]],prob_estimates);
+				fold_target[perm[j]] = svm_predict_probability(submodel,prob->x[perm[j]],prob_estimates);
 			free(prob_estimates);			
 		}
 		else
 			for(j=begin;j<end;j++)
-				target[perm[j]] = svm_predict(submodel,prob->x[perm[j]]);
+				fold_target[perm[j]] = svm_predict(submodel,prob->x[perm[j]]);
+		if(dec_target)
+		{
+			// Pairs missing from the fold's training set stay undecided.
+			int sub_class = submodel->nr_class;
+			int *rank = Malloc(int,sub_class);
+			for(k=0;k<sub_class;k++)
+				for(rank[k]=0;labels[rank[k]]!=submodel->label[k];)
+					++rank[k];
+			double *dec = Malloc(double,sub_class*(sub_class-1)/2);
+			for(j=begin;j<end;j++)
+			{
+				double *out = dec_target + ((size_t)c*l + perm[j])*nr_pair;
+				for(k=0;k<nr_pair;k++)
+					out[k] = 0;
+				svm_predict_values(submodel,prob->x[perm[j]],dec);
+				int q = 0;
+				for(int a=0;a<sub_class;a++)
+					for(int b=a+1;b<sub_class;b++,q++)
+					{
+						int ra = min(rank[a],rank[b]), rb = max(rank[a],rank[b]);
+						out[ra*nr_all-ra*(ra+1)/2+rb-ra-1] = rank[a] < rank[b] ? dec[q] : -dec[q];
+					}
+			}
+			free(dec);
+			free(rank);
+		}
 		svm_free_and_destroy_model(&submodel);
-		free(subprob.x);
-		free(subprob.y);
-	}		
-	free(fold_start);
-	free(perm);	
+
+		if(alpha_sum)
+		{
+			double *sum = alpha_sum + (size_t)c*l*nr_class;
+			for(k=0;k<subprob.l;k++)
+				for(j=0;j<nr_class;j++)
+					sum[orig[k]*nr_class+j] += alpha[k*nr_class+j];
+		}
+	}
+
+	free(labels);
+	free(alpha);
+	free(orig);
+	free(subprob.x);
+	free(subprob.y);
 }
 
+// warco: Platt scaling on given decision values, see svm.h.
+void svm_fit_probability(svm_model *model, const svm_problem *prob, const double *dec_values)
+{
+	int nr_class = model->nr_class, nr_pair = nr_class*(nr_class-1)/2;
+	int *rank = Malloc(int,nr_class);
+	for(int i=0;i<nr_class;i++)
+	{
+		rank[i] = 0;
+		for(int j=0;j<nr_class;j++)
+			if(model->label[j] < model->label[i])
+				++rank[i];
+	}
+
+	free(model->probA);
+	free(model->probB);
+	model->probA = Malloc(double,nr_pair);
+	model->probB = Malloc(double,nr_pair);
+	model->param.probability = 1;
+
+	// The pairs' fits are independent, see svm_train_warm.
+	int *pair_i = Malloc(int,nr_pair);
+	int *pair_j = Malloc(int,nr_pair);
+	int p = 0;
+	for(int i=0;i<nr_class;i++)
+		for(int j=i+1;j<nr_class;j++,p++)
+		{
+			pair_i[p] = i;
+			pair_j[p] = j;
+		}
+	int nr_thread = max(1,min(model->param.nr_thread,nr_pair));
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) if(nr_thread > 1) num_threads(nr_thread)
+#endif
+	for(p=0;p<nr_pair;p++)
+	{
+		int i = pair_i[p], j = pair_j[p];
+		double *dec = Malloc(double,prob->l);
+		double *y = Malloc(double,prob->l);
+		// The model's pair (i,j) is positive for class i.
+		int ra = min(rank[i],rank[j]), rb = max(rank[i],rank[j]);
+		int q = ra*nr_class-ra*(ra+1)/2+rb-ra-1;
+		double sign = rank[i] < rank[j] ? 1 : -1;
+		int n = 0;
+		for(int s=0;s<prob->l;s++)
+		{
+			int lbl = (int)prob->y[s];
+			if(lbl != model->label[i] && lbl != model->label[j])
+				continue;
+			dec[n] = sign*dec_values[(size_t)s*nr_pair+q];
+			y[n] = lbl == model->label[i] ? +1 : -1;
+			++n;
+		}
+		sigmoid_train(n,dec,y,model->probA[p],model->probB[p]);
+		free(y);
+		free(dec);
+	}
+
+	free(pair_i);
+	free(pair_j);
+	free(rank);
+}
 
 int svm_get_svm_type(const svm_model *model)
 {
@@ -2765,6 +3218,14 @@ svm_model *svm_load_model(const char *model_file_name)
 
 	svm_model *model = Malloc(svm_model,1);
 	svm_parameter& param = model->param;
+	param.gram = NULL;
+	param.gram_ld = 0;
+	param.gram_cache = 0;
+	param.gram_row = NULL;
+	param.gram_col = NULL;
+	param.gram_val = NULL;
+	param.seed = 0;
+	param.nr_thread = 0;
 	model->rho = NULL;
 	model->probA = NULL;
 	model->probB = NULL;
@@ -44,6 +44,20 @@ struct svm_parameter
 	double p;	/* for EPSILON_SVR */
 	int shrinking;	/* use the shrinking heuristics */
 	int probability; /* do probability estimates */
+
+	/* warco: dense precomputed kernel */
+	const float *gram;	/* for PRECOMPUTED: if not NULL, kernel of ids i and j is gram[(i-1)*gram_ld+(j-1)] */
+	int gram_ld;		/* and each x only needs to hold its id as 0:id */
+	int gram_cache;		/* if set, its rows still go through the kernel cache (for a gram not in RAM) */
+	/* warco: sparse precomputed kernel, instead of gram, with gram_ld ids: the kernel of ids i and j
+	   is gram_val[k] for the k in [gram_row[i-1],gram_row[i]) with gram_col[k] == j-1, or 0 if there's
+	   none. Each row's columns are sorted. */
+	const long *gram_row;
+	const int *gram_col;
+	const float *gram_val;
+	unsigned int seed;	/* warco: if not 0, seeds a private generator used instead of rand() */
+	int nr_thread;		/* warco: if > 1, svm_train and svm_fit_probability handle the pairs of classes
+				   with up to this many OpenMP threads, giving the same model */
 };
 
 //
@@ -74,6 +88,30 @@ struct svm_model
 struct svm_model *svm_train(const struct svm_problem *prob, const struct svm_parameter *param);
 void svm_cross_validation(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
 
+/* warco: warm starts. alpha_init/alpha_out hold prob->l x nr_class values, the
+   alpha of sample s in its C-SVC pair against the class with the c-th smallest
+   label being at [s*nr_class+c]. alpha_init must be feasible for param->C, and
+   the entries of a sample's own class are neither read nor written. */
+struct svm_model *svm_train_warm(const struct svm_problem *prob, const struct svm_parameter *param, const double *alpha_init, double *alpha_out);
+/* warco: the stratified folds of svm_cross_validation: fold i is
+   perm[fold_start[i]..fold_start[i+1]). Returns the number of folds used. */
+int svm_cross_validation_folds(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, int *perm, int *fold_start);
+/* warco: trains on all but the given fold for each of the nr_C values C in
+   turn, writing the predictions of the fold into target[c*l..(c+1)*l).
+   With warm_start, each C starts off the previous one's solution, which works
+   best for increasing C. If not NULL, the training alphas (see svm_train_warm) are added
+   to alpha_sum[c*l*nr_class..], and the fold's decision values are written
+   into dec_target[c*l*nr_pair..] (see svm_fit_probability). */
+void svm_cross_validation_path(const struct svm_problem *prob, const struct svm_parameter *param,
+	const int *perm, const int *fold_start, int fold,
+	const double *C, int nr_C, int warm_start, double *target, double *alpha_sum, double *dec_target);
+/* warco: fits the C-SVC model's probA/probB to out-of-sample decision values of
+   prob's samples instead of by svm_train's internal cross-validation. Those
+   of sample s in the pair of the classes with the a-th and b-th (a < b)
+   smallest labels are at dec_values[s*nr_pair+a*nr_class-a*(a+1)/2+b-a-1],
+   positive meaning the a-th one, and nr_pair = nr_class*(nr_class-1)/2. */
+void svm_fit_probability(struct svm_model *model, const struct svm_problem *prob, const double *dec_values);
+
 int svm_save_model(const char *model_file_name, const struct svm_model *model);
 struct svm_model *svm_load_model(const char *model_file_name);
 
@@ -1,11 +1,18 @@
 #include "mainutils.hpp"
 
+#include <algorithm>
+#include <condition_variable>
 #include <fstream>
+#include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <utility>
 
 #include <opencv2/opencv.hpp>
 #include "json/json.h"
 
+#include "model.hpp"
 #include "warco.hpp"
 
 void warco::foreach_img(const Json::Value& dataset, const char* traintest, std::function<void (unsigned, const cv::Mat&, std::string)> fn)
@@ -13,20 +20,112 @@ void warco::foreach_img(const Json::Value& dataset, const char* traintest, std::
     auto files = getFilelist(dataset, traintest);
     auto lbls = dataset["classes"];
 
+    std::vector<std::pair<unsigned, std::string>> todo;
     for(auto ilbl = lbls.begin() ; ilbl != lbls.end() ; ++ilbl) {
         auto lbl = ilbl.index();
         auto lblname = (*ilbl).asString();
 
-        for(Json::Value fname : files[lblname]) {
-            cv::Mat image = cv::imread(fname.asString());
+        for(Json::Value fname : files[lblname])
+            todo.push_back(std::make_pair(lbl, fname.asString()));
+    }
+
+    // Decoding threads read the images ahead, in whatever order they finish,
+    // into a window of slots which this thread hands to `fn` in order. The
+    // window is large enough to keep them busy while `fn` works on a batch.
+    unsigned nthreads = dataset.get("load_threads", 0).asUInt();
+    if(nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t window = 1024;
+
+    std::vector<cv::Mat> slots(window);
+    std::vector<char> ready(window, 0);
+    std::size_t next = 0, consumed = 0;
+    bool stop = false;
+    std::mutex m;
+    std::condition_variable cv_free, cv_ready;
+
+    auto decode = [&]() {
+        while(true) {
+            std::size_t i;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv_free.wait(lock, [&]() { return stop || next >= todo.size() || next < consumed + window; });
+                if(stop || next >= todo.size())
+                    return;
+                i = next++;
+            }
+
+            cv::Mat image = cv::imread(todo[i].second);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                slots[i % window] = image;
+                ready[i % window] = 1;
+            }
+            cv_ready.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(unsigned t = 0 ; t < std::min<std::size_t>(nthreads, todo.size()) ; ++t)
+        threads.emplace_back(decode);
+
+    auto join = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv_free.notify_all();
+        for(auto& t : threads)
+            t.join();
+    };
+
+    try {
+        for(std::size_t i = 0 ; i < todo.size() ; ++i) {
+            cv::Mat image;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv_ready.wait(lock, [&]() { return ready[i % window] != 0; });
+                image = slots[i % window];
+                slots[i % window].release();
+                ready[i % window] = 0;
+                ++consumed;
+            }
+            cv_free.notify_all();
+
             if(! image.data) {
-                std::cerr << "Skipping unreadable image " << fname << std::endl;
+                std::cerr << "Skipping unreadable image " << todo[i].second << std::endl;
                 continue;
             }
 
-            fn(lbl, image, fname.asString());
+            fn(todo[i].first, image, todo[i].second);
         }
+    } catch(...) {
+        join();
+        throw;
     }
+    join();
+}
+
+void warco::addSamples(Warco& model, const Json::Value& dataset, const char* traintest)
+{
+    // In batches, such that the descriptors are computed in parallel while
+    // `foreach_img` keeps loading the next images.
+    const std::size_t batch = 256;
+    std::vector<cv::Mat> imgs;
+    std::vector<unsigned> lbls;
+    auto flush = [&]() {
+        model.add_samples(imgs, lbls);
+        imgs.clear();
+        lbls.clear();
+    };
+
+    foreach_img(dataset, traintest, [&](unsigned lbl, const cv::Mat& image, std::string) {
+        imgs.push_back(image);
+        lbls.push_back(lbl);
+        if(imgs.size() == batch)
+            flush();
+    });
+    flush();
 }
 
 Json::Value warco::readJson(const char* fname)
@@ -82,6 +181,44 @@ std::vector<double> warco::readCrossvalCs(const Json::Value& conf)
     return C;
 }
 
+warco::TrainOpts warco::readTrainOpts(const Json::Value& conf)
+{
+    warco::TrainOpts nrvo;
+
+    nrvo.model = conf.get("model", nrvo.model).asString();
+    nrvo.model_dim = conf.get("model_dim", nrvo.model_dim).asUInt();
+    nrvo.warm_start = conf.get("warm_start", nrvo.warm_start).asBool();
+    nrvo.scratch_dir = conf.get("scratch_dir", nrvo.scratch_dir).asString();
+    nrvo.scratch_cache_mb = conf.get("scratch_cache_mb", nrvo.scratch_cache_mb).asUInt();
+    nrvo.dist_cache = conf.get("dist_cache", nrvo.dist_cache).asString();
+    nrvo.sv_budget = conf.get("sv_budget", nrvo.sv_budget).asUInt();
+    nrvo.sv_tolerance = conf.get("sv_tolerance", nrvo.sv_tolerance).asDouble();
+    nrvo.max_patches = conf.get("max_patches", nrvo.max_patches).asUInt();
+    nrvo.max_predict_us = conf.get("max_predict_us", nrvo.max_predict_us).asDouble();
+    nrvo.max_train_mb = conf.get("max_train_mb", nrvo.max_train_mb).asUInt();
+    nrvo.keep_dists = conf.get("keep_dists", nrvo.keep_dists).asBool();
+    nrvo.knn = conf.get("knn", nrvo.knn).asUInt();
+    nrvo.knn_check = conf.get("knn_check", nrvo.knn_check).asUInt();
+
+    return nrvo;
+}
+
+warco::CascadeOpts warco::readCascadeOpts(const Json::Value& conf)
+{
+    warco::CascadeOpts nrvo;
+
+    nrvo.probas = conf.get("probas", nrvo.probas).asBool();
+    nrvo.margin = conf.get("margin", nrvo.margin).asDouble();
+    nrvo.deadline_us = conf.get("deadline_us", nrvo.deadline_us).asDouble();
+
+    return nrvo;
+}
+
+std::size_t warco::readModelCache(const Json::Value& conf)
+{
+    return static_cast<std::size_t>(conf.get("model_cache_mb", 0).asUInt()) << 20;
+}
+
 Json::Value warco::getOrLoadArray(const Json::Value& conf, std::string name)
 {
     if(!conf.isMember(name))
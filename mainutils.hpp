@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <functional>
 #include <string>
 #include <vector>
@@ -15,13 +16,22 @@ namespace Json {
 namespace warco {
 
     class Patch;
+    struct Warco;
+    struct CascadeOpts;
+    struct TrainOpts;
 
     void foreach_img(const Json::Value& dataset, const char* traintest,
                      std::function<void (unsigned, const cv::Mat&, std::string)> fn);
+    // Adds all of the dataset's `traintest` images to `model`, in order.
+    void addSamples(Warco& model, const Json::Value& dataset, const char* traintest);
     Json::Value readJson(const char* filename);
     Json::Value getFilelist(const Json::Value& conf, const char* traintest);
     std::vector<warco::Patch> readPatches(const Json::Value& conf);
     std::vector<double> readCrossvalCs(const Json::Value& conf);
+    TrainOpts readTrainOpts(const Json::Value& conf);
+    CascadeOpts readCascadeOpts(const Json::Value& conf);
+    // The config's "model_cache_mb" in bytes, 0 for loading models eagerly.
+    std::size_t readModelCache(const Json::Value& conf);
     Json::Value getOrLoadArray(const Json::Value& conf, std::string name);
     Json::Value getOrLoadObject(const Json::Value& conf, std::string name);
 
@@ -1,22 +1,198 @@
 #include "model.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <limits>
 #include <stdexcept>
 
-#ifndef NDEBUG
-#  include <iostream>
-#endif
-
 #include <opencv2/opencv.hpp>
 
+#include "distcache.hpp"
+#include "gram.hpp"
 #include "libsvm/svm.h"
+#include "tasks.hpp"
 #include "to_s.hpp"
 
+// A precomputed-kernel problem of five classes of points in the plane.
+struct ToyProblem {
+    std::vector<float> K;
+    std::vector<double> y;
+    std::vector<svm_node> xes;
+    std::vector<svm_node*> x;
+    svm_problem prob;
+
+    explicit ToyProblem(unsigned N)
+        : K(N*N), y(N), xes(2*N), x(N)
+    {
+        cv::RNG& rng = cv::theRNG();
+        std::vector<double> px(N), py(N);
+        for(unsigned i = 0 ; i < N ; ++i) {
+            px[i] = rng.uniform(0.0, 1.0);
+            py[i] = rng.uniform(0.0, 1.0);
+            y[i] = 1 + static_cast<int>(px[i]*3.3 + py[i]*1.7 + rng.gaussian(0.3) + 5) % 5;
+            x[i] = &xes[2*i];
+            x[i][0].index = 0;
+            x[i][0].value = 1+i;
+            x[i][1].index = -1;
+        }
+        for(unsigned i = 0 ; i < N ; ++i)
+            for(unsigned j = 0 ; j < N ; ++j)
+                K[i*N + j] = std::exp(-4.0*std::hypot(px[i] - px[j], py[i] - py[j]));
+
+        prob.l = N;
+        prob.y = y.data();
+        prob.x = x.data();
+    }
+
+    svm_parameter param(double C) const
+    {
+        svm_parameter nrvo = svm_parameter();
+        nrvo.svm_type = C_SVC;
+        nrvo.kernel_type = PRECOMPUTED;
+        nrvo.cache_size = 100;
+        nrvo.eps = 0.001;
+        nrvo.shrinking = int(true);
+        nrvo.C = C;
+        nrvo.gram = K.data();
+        nrvo.gram_ld = prob.l;
+        nrvo.seed = 0x5eed;
+        return nrvo;
+    }
+};
+
+// The largest difference between the two models' coefficients and rhos, or
+// infinity if they don't have the same SVs.
+static double svm_diff(const svm_model* a, const svm_model* b)
+{
+    if(a->nr_class != b->nr_class || a->l != b->l)
+        return std::numeric_limits<double>::infinity();
+
+    double nrvo = 0.0;
+    const int k = a->nr_class;
+    for(int p = 0 ; p < k*(k-1)/2 ; ++p)
+        nrvo = std::max(nrvo, std::abs(a->rho[p] - b->rho[p]));
+    for(int s = 0 ; s < a->l ; ++s) {
+        if(a->SV[s][0].value != b->SV[s][0].value)
+            return std::numeric_limits<double>::infinity();
+        for(int c = 0 ; c < k-1 ; ++c)
+            nrvo = std::max(nrvo, std::abs(a->sv_coef[c][s] - b->sv_coef[c][s]));
+    }
+    return nrvo;
+}
+
 void warco::test_model()
 {
-    // TODO - how can I actually test this !?
-    // Anyways, already tested in prototype^^
+    std::cout << "libsvm solver... " << std::flush;
+
+    ToyProblem toy(300);
+    bool ok = true;
+
+    // The kernel rows the solver works with: copied once into a contiguous
+    // Q when it fits in cache_size, else gathered two rows at a time, or
+    // through libsvm's own cache. They all take the same decisions.
+    svm_parameter dense = toy.param(10.0);
+    svm_parameter tworow = dense, cached = dense;
+    tworow.cache_size = 0.1;
+    cached.gram_cache = int(true);
+    svm_model* m_dense = svm_train(&toy.prob, &dense);
+    svm_model* m_tworow = svm_train(&toy.prob, &tworow);
+    svm_model* m_cached = svm_train(&toy.prob, &cached);
+    ok &= svm_diff(m_dense, m_tworow) < 1e-9 && svm_diff(m_dense, m_cached) < 1e-6;
+
+    // The pairs trained in parallel give the very same model.
+    svm_parameter threaded = dense;
+    threaded.nr_thread = 4;
+    svm_model* m_threaded = svm_train(&toy.prob, &threaded);
+    ok &= svm_diff(m_dense, m_threaded) == 0.0;
+
+    for(svm_model* m : {m_dense, m_tworow, m_cached, m_threaded})
+        svm_free_and_destroy_model(&m);
+
+    // Cross-validating a path of Cs, each one's folds starting off the
+    // previous C's solution, is about as accurate as each C on its own.
+    const unsigned N = toy.prob.l, nclass = 5;
+    const double Cs[] = {0.1, 1.0, 10.0, 100.0};
+    const unsigned nC = sizeof(Cs)/sizeof(Cs[0]);
+    svm_parameter param = toy.param(Cs[0]);
+    std::vector<int> perm(N), fold_start(5+1);
+    const int nfolds = svm_cross_validation_folds(&toy.prob, &param, 5, &perm[0], &fold_start[0]);
+    std::vector<double> path(nC*N), single(N);
+    for(int fold = 0 ; fold < nfolds ; ++fold)
+        svm_cross_validation_path(&toy.prob, &param, &perm[0], &fold_start[0], fold, Cs, nC, int(true), &path[0], nullptr, nullptr);
+    for(unsigned c = 0 ; c < nC ; ++c) {
+        param.C = Cs[c];
+        svm_cross_validation(&toy.prob, &param, 5, &single[0]);
+        int diff = 0;
+        for(unsigned i = 0 ; i < N ; ++i)
+            diff += (path[c*N + i] == toy.y[i]) - (single[i] == toy.y[i]);
+        ok &= std::abs(diff) <= static_cast<int>(N/100);
+    }
+
+    // A warm start off a smaller C's alphas converges to the same model.
+    svm_parameter lo = toy.param(1.0), hi = toy.param(10.0);
+    std::vector<double> alpha(N*nclass);
+    svm_model* m_lo = svm_train_warm(&toy.prob, &lo, nullptr, &alpha[0]);
+    svm_model* m_cold = svm_train(&toy.prob, &hi);
+    svm_model* m_warm = svm_train_warm(&toy.prob, &hi, &alpha[0], nullptr);
+    for(int p = 0 ; p < m_cold->nr_class*(m_cold->nr_class-1)/2 ; ++p)
+        ok &= std::abs(m_cold->rho[p] - m_warm->rho[p]) < 5e-3;
+
+    for(svm_model* m : {m_lo, m_cold, m_warm})
+        svm_free_and_destroy_model(&m);
+
+    // Platt scaling fitted on out-of-fold decision values only adds the
+    // probabilities to the model, which then predict like the compiled one.
+    const unsigned npairs = nclass*(nclass-1)/2;
+    std::vector<double> dec(N*npairs);
+    param.C = 10.0;
+    for(int fold = 0 ; fold < nfolds ; ++fold)
+        svm_cross_validation_path(&toy.prob, &param, &perm[0], &fold_start[0], fold, &param.C, 1, int(false), &path[0], nullptr, &dec[0]);
+    svm_model* m_plain = svm_train(&toy.prob, &param);
+    svm_model* m_platt = svm_train(&toy.prob, &param);
+    svm_fit_probability(m_platt, &toy.prob, &dec[0]);
+    ok &= svm_check_probability_model(m_platt) && svm_diff(m_plain, m_platt) == 0.0;
+
+    m_platt->param.gram = nullptr;
+    CompiledSvm compiled;
+    compiled.compile(m_platt);
+    std::vector<svm_node> nodes(N+2);
+    std::vector<double> p1(nclass), p2(nclass);
+    for(unsigned q = 0 ; q < N ; q += 7) {
+        nodes[0].index = 0;
+        for(unsigned i = 0 ; i < N ; ++i) {
+            nodes[1+i].index = 1+i;
+            nodes[1+i].value = toy.K[q*N + i];
+        }
+        nodes[N+1].index = -1;
+        svm_predict_probability(m_platt, &nodes[0], &p1[0]);
+        std::vector<double> row(toy.K.begin() + q*N, toy.K.begin() + (q+1)*N);
+        compiled.predict_probas(&row[0], &p2[0]);
+        for(unsigned c = 0 ; c < nclass ; ++c)
+            ok &= std::abs(p1[c] - p2[c]) < 0.01;
+    }
+
+    for(svm_model* m : {m_plain, m_platt})
+        svm_free_and_destroy_model(&m);
+
+    if(! ok) {
+        std::cerr << "Failed! (the solver disagrees between its kernel paths, threads, C paths, warm starts or probabilities)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
+
+// Sorted distinct labels, the order libsvm's warm-start alphas use.
+static std::vector<double> distinct(std::vector<double> lbls)
+{
+    std::sort(lbls.begin(), lbls.end());
+    lbls.erase(std::unique(lbls.begin(), lbls.end()), lbls.end());
+    return lbls;
 }
 
 warco::PatchModel::PatchModel(std::string dname)
@@ -24,6 +200,10 @@ warco::PatchModel::PatchModel(std::string dname)
     , _prob(nullptr)
     , _mean(0.0)
     , _d(dname.empty() ? nullptr : Distance::create(dname))
+    , _cost_us(0.0)
+    , _knn_acc(0.0, 0.0)
+    , _train_C(0.0)
+    , _train_acc(0.0)
     // Note: the above assumes `load` is called ASAP.
 { }
 
@@ -35,115 +215,254 @@ warco::PatchModel::~PatchModel()
 void warco::PatchModel::free_svm()
 {
     if(_svm) svm_free_and_destroy_model(&_svm);
+    _engine.clear();
+    _fmap.reset();
+    _q.clear();
+
+    this->free_prob();
+}
 
+void warco::PatchModel::free_prob()
+{
     if(_prob) {
         delete[] _prob->x[0];
         delete[] _prob->x;
         delete _prob;
         _prob = nullptr;
     }
+
+    _gram.release();
+    _sparse.clear();
 }
 
 void warco::PatchModel::add_sample(const cv::Mat& corr, unsigned label)
 {
-    _corrs.push_back(corr);
-    _lbls.push_back(static_cast<double>(label));
+    // A model keeping its training set collects samples for `train_incremental`.
+    if(! _train_dists.empty()) {
+        _new_samples.push_back(corr, label);
+        return;
+    }
+
+    _samples.push_back(corr, label);
 }
 
 bool warco::PatchModel::prepare()
 {
+    // Also trims the store's spare room, now that all samples are in.
     if(_d->canprep()) {
-        for(auto& corr : _corrs)
-            _d->prepare(corr);
+        _samples.transform([this](cv::Mat& corr) { _d->prepare(corr); });
         return true;
     }
 
+    _samples.shrink_to_fit();
     return false;
 }
 
-double warco::PatchModel::train(const std::vector<double>& C_crossval)
+// Mean of the distances over (at most) `npairs` random pairs, drawn with a
+// fixed seed so that re-training gives the same model.
+static double estimate_mean(const std::vector<cv::Mat>& corrs, const warco::Distance& d, unsigned npairs)
 {
-    this->free_svm();
+    // The number of pairs overflows 32 bits from about 92k samples on.
+    const std::size_t N = corrs.size(), Npairs = N*(N+1)/2;
+    double mean = 0.0;
 
-    // 1. Compute distance matrix
-    // 2. train SVM
+    if(Npairs <= npairs) {
+        for(std::size_t i = 0 ; i < N ; ++i)
+            for(std::size_t j = 0 ; j <= i ; ++j)
+                mean += d(corrs[i], corrs[j]);
+        return mean / static_cast<double>(Npairs);
+    }
 
-    auto N = _corrs.size();
+    cv::RNG rng(0x5eed);
+    for(unsigned p = 0 ; p < npairs ; ++p) {
+        unsigned i = rng.uniform(0, static_cast<int>(N)),
+                 j = rng.uniform(0, static_cast<int>(N));
+        mean += d(corrs[std::max(i, j)], corrs[std::min(i, j)]);
+    }
+    return mean / npairs;
+}
 
-    _prob = new svm_problem;
-    _prob->l = N;
-    _prob->y = &_lbls[0];
+// Threads for the pairs of classes of a final SVM, see `svm_parameter.nr_thread`.
+// Within a TaskPool, the other patches' tasks already keep the cores busy.
+static int pair_threads(const warco::TrainOpts& opts)
+{
+    if(warco::TaskPool::current())
+        return 1;
+#ifdef _OPENMP
+    return opts.nthreads ? opts.nthreads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
 
-    // Construct what will hold the distance/kernel "matrix"
-    _prob->x = new svm_node*[N];
-    auto* xes = new svm_node[N*(N+2)]; // TODO: Could halve this, but meh!
-    for(unsigned i = 0 ; i < N ; ++i) {
-        _prob->x[i] = xes + i*(N+2);
+double warco::PatchModel::train_featmap(const std::vector<double>& C_crossval, const TrainOpts& opts)
+{
+    // 1. Fit the explicit feature map
+    // 2. Map all samples through it
+    // 3. train a linear SVM on those features
 
-        // Make the first entry be the "sample id" as requested in
-        // the "precomputed kernel" section of the readme.
-        _prob->x[i][0].index = 0;
-        _prob->x[i][0].value = 1+i;
+    auto N = _samples.size();
+    const std::vector<double>& lbls = _samples.labels();
 
-        // Make the last of each row be -1 as requested by the API.
-        _prob->x[i][N+1].index = -1;
-    }
+    // Computing all pairwise distances is exactly what we want to avoid here.
+    _mean = estimate_mean(_samples.mats(), *_d, 10000);
 
-    // Compute the Gram matrix first, but compute the mean in the same run,
-    // we'll need it to turn the matrix into a mercer kernel next.
-    _mean = 0.0;
+    _fmap = FeatureMap::create(opts.model);
+    _fmap->fit(_samples.mats(), *_d, _mean, opts.model_dim);
+
+    cv::Mat X(N, _fmap->dim(), CV_32F);
     for(unsigned i = 0 ; i < N ; ++i) {
-        for(unsigned j = 0 ; j < i ; ++j) {
-            double d = (*_d)(_corrs[i], _corrs[j]);
-            _prob->x[i][1+j].index = 1+j;
-            _prob->x[j][1+i].index = 1+i;
-            _prob->x[i][1+j].value = d;
-            _prob->x[j][1+i].value = d;
-            _mean += d;
+        cv::Mat row = X.row(i);
+        (*_fmap)(_samples[i], *_d).copyTo(row);
+    }
+
+    // Same 8-fold cross-validation of C as the kernel SVM gets.
+    const unsigned nfold = 8;
+    std::vector<unsigned> fold(N);
+    for(unsigned i = 0 ; i < N ; ++i)
+        fold[i] = i % nfold;
+    cv::RNG rng(0x5eed);
+    for(unsigned i = 0 ; i < N ; ++i)
+        std::swap(fold[i], fold[i + rng.uniform(0, static_cast<int>(N-i))]);
+
+    double best = 0.0;
+    double best_c = C_crossval.empty() ? 1.0 : C_crossval.front();
+    _cv_lbls = lbls;
+    _cv_pred.assign(N, 0.0);
+    for(auto c : C_crossval) {
+        unsigned N_correct = 0;
+        std::vector<double> pred(N);
+        for(unsigned f = 0 ; f < nfold ; ++f) {
+            cv::Mat Xtr;
+            std::vector<double> ytr;
+            for(unsigned i = 0 ; i < N ; ++i) {
+                if(fold[i] != f) {
+                    Xtr.push_back(X.row(i));
+                    ytr.push_back(lbls[i]);
+                }
+            }
+
+            LinearSvm svm;
+            svm.train(Xtr, ytr, c);
+
+            for(unsigned i = 0 ; i < N ; ++i) {
+                if(fold[i] == f) {
+                    pred[i] = svm.predict(X.row(i));
+                    if(pred[i] == lbls[i])
+                        ++N_correct;
+                }
+            }
+        }
+        double accuracy = N_correct/static_cast<double>(N);
+
+#ifndef NDEBUG
+        if(getenv("WARCO_DEBUG")) {
+            std::cout << "Cross-validation: C=" << c << " => " << 100.*accuracy << "%" << std::endl;
+        }
+#endif
+
+        if(accuracy > best) {
+            best = accuracy;
+            best_c = c;
+            _cv_pred.swap(pred);
         }
-        // The diagonal is outside of above loop to avoid
-        // counting it twice (in the mean, mainly).
-        double d = (*_d)(_corrs[i], _corrs[i]);
-        _prob->x[i][1+i].index = 1+i;
-        _prob->x[i][1+i].value = d;
-        _mean += d;
     }
 
-    _mean /= (N*(N+1)/2);
+    _lin.train(X, lbls, best_c);
+    if(N > 0)
+        this->measure_cost(_samples[0]);
 
-    // Turn it into a mercer kernel next.
-    for(unsigned i = 0 ; i < N ; ++i) {
-        for(unsigned j = 0 ; j < i ; ++j) {
-            double k = std::exp(-_prob->x[i][1+j].value / _mean);
-            _prob->x[i][1+j].value = k;
-            _prob->x[j][1+i].value = k;
+    // The feature map keeps whatever it needs (e.g. landmarks) by itself.
+    _samples.clear();
+
+    return best;
+}
+
+std::size_t warco::PatchModel::train_peak(const std::vector<double>& C_crossval, const TrainOpts& opts, unsigned nthreads) const
+{
+    const std::size_t N = _samples.size(), nC = std::max<std::size_t>(1, C_crossval.size());
+    const std::size_t nclass = std::max<std::size_t>(2, distinct(_samples.labels()).size());
+    const std::size_t npairs = nclass*(nclass-1)/2;
+    const std::size_t cache = std::size_t(opts.scratch_cache_mb) << 20;
+
+    if(opts.model != "kernel") {
+        // The mapped features, and one fold's copy of most of them.
+        return 2*N*opts.model_dim*sizeof(float);
+    }
+
+    // The problem's nodes, and the cross-validation's predictions, decision
+    // values and, when warm-starting, each fold's alphas.
+    std::size_t nrvo = N*(sizeof(svm_node*) + 2*sizeof(svm_node));
+    nrvo += nC*N*(1 + npairs)*sizeof(double);
+    if(opts.warm_start)
+        nrvo += 8*nC*N*nclass*sizeof(double);
+
+    if(opts.knn) {
+        // The symmetrized neighbours, a column and a value each, plus the
+        // lists they're built from.
+        const std::size_t nnz = N*(2*opts.knn + 1);
+        nrvo += nnz*(sizeof(int) + sizeof(float)) + (N+1)*sizeof(long);
+        nrvo += (N*opts.knn + nnz)*(sizeof(float) + sizeof(unsigned));
+        if(opts.knn_check) {
+            const std::size_t n = std::min<std::size_t>(N, opts.knn_check);
+            nrvo += n*n*sizeof(float);
         }
-        // Same story about the diagonal here.
-        _prob->x[i][1+i].value = std::exp(-_prob->x[i][1+i].value / _mean);
+    } else if(opts.scratch_dir.empty()) {
+        nrvo += N*N*sizeof(float);
     }
+    if(opts.keep_dists)
+        nrvo += N*N*sizeof(float);
 
-    // Now setup the SVM's parameters to use above kernel.
+    // Each concurrent solver's kernel rows (its contiguous copy or cache,
+    // at most its whole problem's) and its own O(N) vectors. The folds (and
+    // C values, without warm starts) each get a solver.
+    const std::size_t nsolvers = std::max<std::size_t>(1, std::min<std::size_t>(nthreads, opts.warm_start ? 8 : 8*nC));
+    nrvo += nsolvers*(std::min(N*N*sizeof(float), cache) + 16*N*sizeof(double));
 
-    svm_parameter param = svm_parameter();
-    param.svm_type = C_SVC;
-    param.kernel_type = PRECOMPUTED;
-    // degree, gamma, coef0 unused. C cross-validated
+    return nrvo;
+}
 
-    // Training settings
-    param.cache_size = 1; // MB (for kernels, needs to be >= 0 even if unused.)
-    param.eps = 0.001; // "(we usually use 0.00001 in nu-SVC, 0.001 in others)."
-    // C_SVC only `nr_weight`, `weight_label` and `weight` unused.
-    // NU_SV? only `nu`
-    // EPSILON_SVR: `p`
-    param.shrinking = int(true);
-    param.probability = int(true);
+double warco::PatchModel::train(const std::vector<double>& C_crossval, const TrainOpts& opts)
+{
+    this->free_svm();
+    _train_samples.clear();
+    std::vector<float>().swap(_train_dists);
+    _train_svs.clear();
+
+    if(opts.model != "kernel")
+        return this->train_featmap(C_crossval, opts);
+
+    // 1. Compute distance matrix
+    // 2. train SVM
+
+    auto N = _samples.size();
+
+    float* K = nullptr;
+    if(opts.knn) {
+        if(opts.keep_dists || ! opts.dist_cache.empty() || opts.sv_budget || opts.sv_tolerance > 0.0)
+            throw std::runtime_error("The \"knn\" kernel can't be combined with \"keep_dists\", \"dist_cache\" or an SV budget, which all need the dense one.");
+
+        // Computing all pairwise distances is exactly what we want to avoid here.
+        _mean = estimate_mean(_samples.mats(), *_d, 10000);
+        _sparse = knn_gram(_samples.mats(), *_d, opts.knn, _mean, opts.nthreads);
+    } else if(opts.keep_dists || ! opts.dist_cache.empty()) {
+        K = _gram.alloc(N, opts.scratch_dir);
+        // Same as `build_gram`, but keeping the raw distances around.
+        _mean = cached_pdist(_samples.mats(), *_d, K, opts.dist_cache, opts.nthreads) / (N*(N+1)/2);
+        if(opts.keep_dists)
+            _train_dists.assign(K, K + N*N);
+        kernelize(K, N, _mean, opts.nthreads);
+    } else {
+        K = _gram.alloc(N, opts.scratch_dir);
+        _mean = build_gram(_samples.mats(), *_d, K, opts.nthreads);
+    }
+
+    svm_parameter param = this->kernel_problem(K, opts);
 
     // *NOTE* Because svm_model contains pointers to svm_problem, you can
     // not free the memory used by svm_problem if you are still using the
     // svm_model produced by svm_train().
 
-    double best = 0.0;
-    double best_c = 0.0;
     for(auto c : C_crossval) {
         param.C = c;
 
@@ -151,14 +470,55 @@ double warco::PatchModel::train(const std::vector<double>& C_crossval)
         if(const char* err = svm_check_parameter(_prob, &param)) {
             throw std::runtime_error(err);
         }
+    }
 
-        std::vector<double> pred(N);
-        svm_cross_validation(_prob, &param, 8, &pred[0]);
+    // All C values are cross-validated on the same folds, in increasing
+    // order such that each one can start off the previous one's solution.
+    std::vector<double> Cs(C_crossval);
+    std::sort(Cs.begin(), Cs.end());
+
+    std::vector<int> perm(N), fold_start(8+1);
+    int nfolds = svm_cross_validation_folds(_prob, &param, 8, &perm[0], &fold_start[0]);
+
+    // The folds, and also the C values when they don't warm-start each
+    // other, are independent tasks sharing the read-only Gram matrix. Each
+    // task writes its own predictions, decision values and alphas, the
+    // latter being summed in fold order afterwards to keep the result
+    // deterministic.
+    const std::vector<double>& lbls = _samples.labels();
+    const unsigned nclass = distinct(lbls).size();
+    const unsigned npairs = nclass*(nclass-1)/2;
+    const int nC = Cs.size();
+    const int ntasks = opts.warm_start ? nfolds : nfolds*nC;
+    std::vector<double> pred(nC*N), dec(nC*N*npairs);
+    std::vector<std::vector<double>> alphas(opts.warm_start ? nfolds : 0, std::vector<double>(nC*N*nclass));
+    parallel_for(ntasks, opts.nthreads, [&](int t) {
+        if(opts.warm_start) {
+            svm_cross_validation_path(_prob, &param, &perm[0], &fold_start[0], t,
+                                      &Cs[0], nC, 1, &pred[0], &alphas[t][0], &dec[0]);
+        } else {
+            const int fold = t / nC, ic = t % nC;
+            svm_cross_validation_path(_prob, &param, &perm[0], &fold_start[0], fold,
+                                      &Cs[ic], 1, 0, &pred[ic*N], nullptr, &dec[ic*N*npairs]);
+        }
+    });
+
+    std::vector<double> alpha_sum(opts.warm_start ? nC*N*nclass : 0);
+    for(const auto& a : alphas)
+        for(std::size_t i = 0 ; i < alpha_sum.size() ; ++i)
+            alpha_sum[i] += a[i];
+
+    // Still pick the first best C in the order they were given.
+    double best = 0.0;
+    double best_c = 0.0;
+    unsigned best_i = 0;
+    for(auto c : C_crossval) {
+        const unsigned ic = std::lower_bound(Cs.begin(), Cs.end(), c) - Cs.begin();
 
         // Compute accuracy;
         unsigned N_correct = 0;
         for(unsigned i = 0 ; i < N ; ++i)
-            if(pred[i] == _lbls[i])
+            if(pred[ic*N + i] == lbls[i])
                 ++N_correct;
         double accuracy = N_correct/static_cast<double>(N);
 
@@ -172,12 +532,50 @@ double warco::PatchModel::train(const std::vector<double>& C_crossval)
         if(accuracy > best) {
             best = accuracy;
             best_c = c;
+            best_i = ic;
         }
     }
+    _cv_pred.assign(pred.begin() + best_i*N, pred.begin() + (best_i+1)*N);
+    _cv_lbls = lbls;
 
     // Now train an SVM on the full dataset with the optimal C.
     param.C = best_c;
-    _svm = svm_train(_prob, &param);
+    if(opts.knn && opts.knn_check)
+        this->check_knn(param, opts);
+    param.nr_thread = pair_threads(opts);
+    if(opts.warm_start) {
+        // Each sample was trained on in all folds but its own, the average
+        // of its alphas there is a good guess of its alphas on all samples.
+        std::vector<double> alpha(alpha_sum.begin() + best_i*N*nclass, alpha_sum.begin() + (best_i+1)*N*nclass);
+        for(auto& a : alpha)
+            a /= std::max(1, nfolds-1);
+        this->make_feasible(alpha);
+        _svm = svm_train_warm(_prob, &param, &alpha[0], nullptr);
+    } else {
+        _svm = svm_train(_prob, &param);
+    }
+    // Platt scaling on the out-of-fold decision values of that C, which is
+    // what libsvm's `probability` does too, with 5 more trainings per pair.
+    svm_fit_probability(_svm, _prob, &dec[best_i*N*npairs]);
+
+    if(opts.sv_budget || opts.sv_tolerance > 0.0) {
+        const int nsv = _svm->l;
+        const double delta = this->reduce_svs(opts);
+        best = std::max(0.0, best + delta);
+
+#ifndef NDEBUG
+        if(getenv("WARCO_DEBUG")) {
+            std::cout << "SV reduction: " << nsv << " => " << _svm->l << " SVs, "
+                      << 100.*delta << "% accuracy => " << 100.*best << "%" << std::endl;
+        }
+#endif
+    }
+
+    if(opts.keep_dists) {
+        _train_samples = _samples;
+        _train_C = best_c;
+        _train_acc = best;
+    }
 
 #ifndef NDEBUG
     if(getenv("WARCO_DEBUG")) {
@@ -186,21 +584,556 @@ double warco::PatchModel::train(const std::vector<double>& C_crossval)
     }
 #endif
 
+    this->keep_svs();
+    if(! _samples.empty())
+        this->measure_cost(_samples[0]);
+
     return best;
 }
 
+void warco::PatchModel::measure_cost(const cv::Mat& probe)
+{
+    // Like `predict` on an already prepared sample, the best of a few runs.
+    _cost_us = std::numeric_limits<double>::max();
+    cv::Mat scratch;
+    for(unsigned run = 0 ; run < 3 ; ++run) {
+        volatile double sink = 0.0;
+        auto t0 = std::chrono::steady_clock::now();
+        if(_fmap) {
+            sink = _lin.predict((*_fmap)(probe, *_d));
+        } else {
+            for(unsigned i = 0 ; i < this->nsamples() ; ++i)
+                sink = sink + std::exp(-this->dist(i, probe, scratch) / _mean);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        _cost_us = std::min(_cost_us, std::chrono::duration<double, std::micro>(t1 - t0).count());
+    }
+}
+
+void warco::PatchModel::check_knn(const svm_parameter& param, const TrainOpts& opts)
+{
+    // The same random subsample every time, in the original order.
+    const unsigned N = _samples.size(), n = std::min(N, opts.knn_check);
+    std::vector<int> idx(N);
+    for(unsigned i = 0 ; i < N ; ++i)
+        idx[i] = i;
+    cv::RNG rng(0x5eed);
+    for(unsigned i = 0 ; i < n ; ++i)
+        std::swap(idx[i], idx[rng.uniform(static_cast<int>(i), static_cast<int>(N))]);
+    idx.resize(n);
+    std::sort(idx.begin(), idx.end());
+
+    SampleStore sub = _samples;
+    sub.select(idx);
+
+    // Both kernels with the scale of the full training set's.
+    std::vector<float> K(std::size_t(n)*n);
+    _d->pdist(sub.mats(), &K[0], opts.nthreads);
+    kernelize(&K[0], n, _mean, opts.nthreads);
+    SparseGram S = knn_gram(sub.mats(), *_d, opts.knn, _mean, opts.nthreads);
+
+    svm_problem prob;
+    prob.l = n;
+    prob.y = const_cast<double*>(sub.labels().data());
+    std::vector<svm_node> xes(2*n);
+    std::vector<svm_node*> x(n);
+    for(unsigned i = 0 ; i < n ; ++i) {
+        x[i] = &xes[2*i];
+        x[i][0].index = 0;
+        x[i][0].value = 1+i;
+        x[i][1].index = -1;
+    }
+    prob.x = x.data();
+
+    svm_parameter dense = param, sparse = param;
+    dense.gram = K.data();
+    dense.gram_ld = n;
+    dense.gram_cache = int(false);
+    dense.gram_row = nullptr;
+    dense.gram_col = nullptr;
+    dense.gram_val = nullptr;
+    sparse.gram = nullptr;
+    sparse.gram_ld = n;
+    sparse.gram_row = S.row.data();
+    sparse.gram_col = S.col.data();
+    sparse.gram_val = S.val.data();
+
+    std::vector<double> pred(2*n);
+    const svm_parameter* params[] = {&dense, &sparse};
+    parallel_for(2, opts.nthreads, [&](int k) {
+        svm_cross_validation(&prob, params[k], 8, &pred[k*n]);
+    });
+
+    unsigned correct[2] = {0, 0};
+    for(unsigned k = 0 ; k < 2 ; ++k)
+        for(unsigned i = 0 ; i < n ; ++i)
+            if(pred[k*n + i] == prob.y[i])
+                ++correct[k];
+    _knn_acc = std::make_pair(correct[0] / std::max(1.0, double(n)), correct[1] / std::max(1.0, double(n)));
+
+#ifndef NDEBUG
+    if(getenv("WARCO_DEBUG")) {
+        std::cout << "kNN kernel on " << n << " samples: " << 100.*_knn_acc.second
+                  << "% vs. " << 100.*_knn_acc.first << "% dense" << std::endl;
+    }
+#endif
+}
+
+double warco::PatchModel::train_incremental(const TrainOpts& opts)
+{
+    if(_train_dists.empty() || ! _svm)
+        throw std::runtime_error("Incremental training needs a kernel model trained or saved with `keep_dists`.");
+
+    // Samples are only prepared by `prepare`, which works on `_samples`.
+    if(_d->canprep())
+        _new_samples.transform([this](cv::Mat& corr) { _d->prepare(corr); });
+
+    const std::size_t Nold = _train_samples.size();
+    const std::size_t N = Nold + _new_samples.size();
+
+    // The SVs' alphas, while the previous model is still around.
+    std::vector<double> alpha = this->previous_alphas(N);
+    const unsigned nclass = distinct(_train_samples.labels()).size();
+    _train_samples.append(_new_samples);
+    _new_samples.clear();
+
+    // A new class makes the previous solution meaningless.
+    if(distinct(_train_samples.labels()).size() != nclass)
+        alpha.clear();
+
+    // Only the distances to the new samples need computing. The previous
+    // ones' sum is needed as the kernel's mean changes with the new ones.
+    std::vector<float> D(N*N);
+    double sum = 0.0;
+    for(std::size_t i = 0 ; i < Nold ; ++i) {
+        std::copy(&_train_dists[i*Nold], &_train_dists[i*Nold] + Nold, &D[i*N]);
+        for(std::size_t j = 0 ; j <= i ; ++j)
+            sum += _train_dists[i*Nold + j];
+    }
+    sum += extend_dists(_train_samples.mats(), Nold, *_d, &D[0], opts.nthreads);
+    _train_dists.swap(D);
+    std::vector<float>().swap(D);
+
+    this->free_svm();
+    _samples = _train_samples;
+
+    // The coefficients of a reduced model (see `reduce_svs`) aren't a
+    // feasible solution anymore, but not far from one.
+    if(! alpha.empty()) {
+        for(auto& a : alpha)
+            a = std::min(a, _train_C);
+        this->make_feasible(alpha);
+    }
+    _mean = sum / (N*(N+1)/2);
+
+    float* K = _gram.alloc(N, opts.scratch_dir);
+    std::copy(_train_dists.begin(), _train_dists.end(), K);
+    kernelize(K, N, _mean, opts.nthreads);
+
+    svm_parameter param = this->kernel_problem(K, opts);
+    param.C = _train_C;
+    if(const char* err = svm_check_parameter(_prob, &param)) {
+        throw std::runtime_error(err);
+    }
+
+    // The C is kept, but its accuracy and the probabilities still need
+    // out-of-fold predictions on the grown training set. Five folds cost
+    // about what libsvm's `probability` would, which has 5 per pair.
+    std::vector<int> perm(N), fold_start(5+1);
+    const int nfolds = svm_cross_validation_folds(_prob, &param, 5, &perm[0], &fold_start[0]);
+    const std::vector<double>& lbls = _train_samples.labels();
+    const unsigned nclass_now = distinct(lbls).size();
+    const unsigned npairs = nclass_now*(nclass_now-1)/2;
+    std::vector<double> pred(N), dec(N*npairs);
+    parallel_for(nfolds, opts.nthreads, [&](int fold) {
+        svm_cross_validation_path(_prob, &param, &perm[0], &fold_start[0], fold,
+                                  &param.C, 1, 0, &pred[0], nullptr, &dec[0]);
+    });
+
+    unsigned N_correct = 0;
+    for(std::size_t i = 0 ; i < N ; ++i)
+        if(pred[i] == lbls[i])
+            ++N_correct;
+    _train_acc = N_correct/static_cast<double>(N);
+    _cv_pred.swap(pred);
+    _cv_lbls = lbls;
+
+    param.nr_thread = pair_threads(opts);
+
+    // The new samples start off at zero, which keeps the previous solution
+    // feasible for the same C.
+    if(opts.warm_start && ! alpha.empty())
+        _svm = svm_train_warm(_prob, &param, &alpha[0], nullptr);
+    else
+        _svm = svm_train(_prob, &param);
+    svm_fit_probability(_svm, _prob, &dec[0]);
+
+    if(opts.sv_budget || opts.sv_tolerance > 0.0)
+        _train_acc = std::max(0.0, _train_acc + this->reduce_svs(opts));
+
+#ifndef NDEBUG
+    if(getenv("WARCO_DEBUG")) {
+        std::cout << "#data: " << _prob->l << " (" << N-Nold << " new)" << std::endl;
+        std::cout << "#SV: " << _svm->l << " (" << 100.0*_svm->l/_prob->l << "%)" << std::endl;
+    }
+#endif
+
+    this->keep_svs();
+
+    return _train_acc;
+}
+
+std::vector<double> warco::PatchModel::previous_alphas(unsigned N) const
+{
+    // libsvm keeps y*alpha of an SV of (its) class a against class b in
+    // sv_coef[b-1] if b > a, in sv_coef[b] otherwise, classes being in the
+    // order of `label`; the warm start wants them in sorted label order.
+    const int k = _svm->nr_class;
+    const std::vector<double> lbls = distinct(_train_samples.labels());
+    std::vector<unsigned> rank(k);
+    for(int c = 0 ; c < k ; ++c)
+        rank[c] = std::lower_bound(lbls.begin(), lbls.end(), static_cast<double>(_svm->label[c])) - lbls.begin();
+
+    std::vector<double> alpha(N*k, 0.0);
+    int sv = 0;
+    for(int a = 0 ; a < k ; ++a) {
+        for(int n = 0 ; n < _svm->nSV[a] ; ++n, ++sv) {
+            const std::size_t i = _train_svs[sv];
+            for(int b = 0 ; b < k ; ++b) {
+                if(b != a)
+                    alpha[i*k + rank[b]] = std::abs(_svm->sv_coef[b > a ? b-1 : b][sv]);
+            }
+        }
+    }
+
+    return alpha;
+}
+
+svm_parameter warco::PatchModel::kernel_problem(float* K, const TrainOpts& opts)
+{
+    const std::size_t N = _samples.size();
+
+    // libsvm only ever reads the labels.
+    _prob = new svm_problem;
+    _prob->l = N;
+    _prob->y = const_cast<double*>(_samples.labels().data());
+
+    // The samples only carry their "sample id" as requested in the
+    // "precomputed kernel" section of the readme, the kernel itself is
+    // handed to libsvm as a dense float matrix through `param.gram`, or
+    // without one, as the sparse `_sparse` through `param.gram_row` & co.
+    _prob->x = new svm_node*[N];
+    auto* xes = new svm_node[2*N];
+    for(unsigned i = 0 ; i < N ; ++i) {
+        _prob->x[i] = xes + 2*i;
+        _prob->x[i][0].index = 0;
+        _prob->x[i][0].value = 1+i;
+
+        // Make the last of each row be -1 as requested by the API.
+        _prob->x[i][1].index = -1;
+    }
+
+    // Now setup the SVM's parameters to use above kernel.
+
+    svm_parameter param = svm_parameter();
+    param.svm_type = C_SVC;
+    param.kernel_type = PRECOMPUTED;
+    // degree, gamma, coef0 unused. C cross-validated
+
+    // Training settings
+    // MB. With the in-memory Gram, the solvers keep a contiguous copy of
+    // their (sub)problem's kernel rows if it fits.
+    param.cache_size = opts.scratch_cache_mb;
+    param.eps = 0.001; // "(we usually use 0.00001 in nu-SVC, 0.001 in others)."
+    // C_SVC only `nr_weight`, `weight_label` and `weight` unused.
+    // NU_SV? only `nu`
+    // EPSILON_SVR: `p`
+    param.shrinking = int(true);
+    // The probabilities are fitted on the cross-validation's decision values
+    // (see `train`) rather than by libsvm's own nested cross-validation.
+    param.probability = int(false);
+    param.gram = K;
+    param.gram_ld = N;
+    if(! K) {
+        param.gram_row = _sparse.row.data();
+        param.gram_col = _sparse.col.data();
+        param.gram_val = _sparse.val.data();
+    }
+    if(_gram.mapped()) {
+        // Reading rows straight out of the file would page them in and out
+        // all the time, cache them instead.
+        param.gram_cache = int(true);
+    }
+    // Its own random generator, as patches and folds train concurrently.
+    param.seed = 0x5eed;
+
+    return param;
+}
+
+void warco::PatchModel::make_feasible(std::vector<double>& alpha) const
+{
+    // The averaged alphas are within [0,C] but break each class pair's
+    // equality constraint sum(alpha of a vs. b) == sum(alpha of b vs. a),
+    // which scaling down the larger side restores.
+    const std::vector<double> lbls = distinct(_samples.labels());
+    const unsigned nclass = lbls.size();
+
+    std::vector<unsigned> cls(_samples.size());
+    for(unsigned i = 0 ; i < cls.size() ; ++i)
+        cls[i] = std::lower_bound(lbls.begin(), lbls.end(), _samples.label(i)) - lbls.begin();
+
+    for(unsigned a = 0 ; a < nclass ; ++a) {
+        for(unsigned b = a+1 ; b < nclass ; ++b) {
+            double sa = 0.0, sb = 0.0;
+            for(unsigned i = 0 ; i < cls.size() ; ++i) {
+                if(cls[i] == a) sa += alpha[i*nclass + b];
+                if(cls[i] == b) sb += alpha[i*nclass + a];
+            }
+
+            const unsigned big = sa > sb ? a : b, other = sa > sb ? b : a;
+            const double scale = sa > sb ? sb/sa : (sb > 0.0 ? sa/sb : 1.0);
+            for(unsigned i = 0 ; i < cls.size() ; ++i)
+                if(cls[i] == big)
+                    alpha[i*nclass + other] *= scale;
+        }
+    }
+}
+
+// Accuracy on the training set of the one-vs-one `m` with only the `kept`
+// SVs, the decision values coming out of the training set's Gram matrix.
+static double train_accuracy(const svm_model* m, const std::vector<bool>& kept, const float* K, std::size_t N, const std::vector<double>& lbls)
+{
+    const int k = m->nr_class;
+    std::vector<int> start(k, 0);
+    for(int c = 1 ; c < k ; ++c)
+        start[c] = start[c-1] + m->nSV[c-1];
+
+    unsigned correct = 0;
+    std::vector<double> kx(m->l);
+    std::vector<int> votes(k);
+    for(std::size_t n = 0 ; n < N ; ++n) {
+        const float* row = K + n*N;
+        for(int s = 0 ; s < m->l ; ++s)
+            kx[s] = kept[s] ? row[m->sv_indices[s]-1] : 0.0;
+
+        std::fill(votes.begin(), votes.end(), 0);
+        for(int a = 0, p = 0 ; a < k ; ++a) {
+            for(int b = a+1 ; b < k ; ++b, ++p) {
+                double f = -m->rho[p];
+                for(int s = start[a] ; s < start[a] + m->nSV[a] ; ++s)
+                    f += m->sv_coef[b-1][s]*kx[s];
+                for(int s = start[b] ; s < start[b] + m->nSV[b] ; ++s)
+                    f += m->sv_coef[a][s]*kx[s];
+                ++votes[f > 0 ? a : b];
+            }
+        }
+
+        // The first one wins ties, like in svm_predict.
+        const int best = std::max_element(votes.begin(), votes.end()) - votes.begin();
+        correct += m->label[best] == static_cast<int>(lbls[n]);
+    }
+
+    return correct / static_cast<double>(N);
+}
+
+double warco::PatchModel::reduce_svs(const TrainOpts& opts)
+{
+    // Greedy removal of the SVs with the smallest coefficients, a tenth at a
+    // time, each time refitting the remaining coefficients of each pair's
+    // decision function to its original values on that pair's original SVs,
+    // by (ridge) least squares on the Gram matrix.
+    svm_model* m = _svm;
+    const std::size_t N = _prob->l;
+    const float* K = _gram.data();
+    const int k = m->nr_class, l = m->l;
+
+    std::vector<int> start(k, 0), cls(l), count(m->nSV, m->nSV + k);
+    for(int c = 1 ; c < k ; ++c)
+        start[c] = start[c-1] + m->nSV[c-1];
+    for(int c = 0 ; c < k ; ++c)
+        std::fill(cls.begin() + start[c], cls.begin() + start[c] + m->nSV[c], c);
+
+    // For each pair, its SVs and the kernel part of its decision values
+    // there, which is what the reduced ones should reproduce.
+    auto pair_svs = [&](int a, int b) {
+        std::vector<int> svs;
+        for(int s = 0 ; s < l ; ++s)
+            if(cls[s] == a || cls[s] == b)
+                svs.push_back(s);
+        return svs;
+    };
+    auto coef = [m](int s, int a, int b, int cs) -> double& {
+        return cs == a ? m->sv_coef[b-1][s] : m->sv_coef[a][s];
+    };
+    std::vector<cv::Mat> targets;
+    for(int a = 0 ; a < k ; ++a) {
+        for(int b = a+1 ; b < k ; ++b) {
+            const std::vector<int> svs = pair_svs(a, b);
+            cv::Mat t(svs.size(), 1, CV_64F, cv::Scalar(0.0));
+            for(unsigned i = 0 ; i < svs.size() ; ++i)
+                for(int s : svs)
+                    t.at<double>(i) += coef(s, a, b, cls[s]) * K[(m->sv_indices[svs[i]]-1)*N + m->sv_indices[s]-1];
+            targets.push_back(t);
+        }
+    }
+
+    std::vector<bool> kept(l, true);
+    const double acc0 = train_accuracy(m, kept, K, N, _samples.labels());
+    double acc = acc0;
+    unsigned n = l;
+
+    while(true) {
+        const bool over = opts.sv_budget && n > opts.sv_budget;
+        if(! over && opts.sv_tolerance <= 0.0)
+            break;
+
+        // To go back to if this step costs too much.
+        std::vector<bool> kept_before = kept;
+        std::vector<int> count_before = count;
+        std::vector<std::vector<double>> coef_before(k-1);
+        for(int c = 0 ; c < k-1 ; ++c)
+            coef_before[c].assign(m->sv_coef[c], m->sv_coef[c] + l);
+
+        unsigned nremove = std::max(1u, n/10);
+        if(over)
+            nremove = std::min(nremove, n - opts.sv_budget);
+
+        std::vector<std::pair<double, int>> scores;
+        for(int s = 0 ; s < l ; ++s) {
+            if(! kept[s])
+                continue;
+            double score = 0.0;
+            for(int c = 0 ; c < k-1 ; ++c)
+                score += std::abs(m->sv_coef[c][s]);
+            scores.push_back(std::make_pair(score, s));
+        }
+        std::sort(scores.begin(), scores.end());
+
+        // Each class keeps at least one SV.
+        unsigned removed = 0;
+        for(unsigned i = 0 ; i < scores.size() && removed < nremove ; ++i) {
+            const int s = scores[i].second;
+            if(count[cls[s]] > 1) {
+                kept[s] = false;
+                --count[cls[s]];
+                for(int c = 0 ; c < k-1 ; ++c)
+                    m->sv_coef[c][s] = 0.0;
+                ++removed;
+            }
+        }
+        if(removed == 0)
+            break;
+
+        for(int a = 0, p = 0 ; a < k ; ++a) {
+            for(int b = a+1 ; b < k ; ++b, ++p) {
+                const std::vector<int> svs = pair_svs(a, b);
+                std::vector<int> sub;
+                for(int s : svs)
+                    if(kept[s])
+                        sub.push_back(s);
+
+                cv::Mat A(svs.size(), sub.size(), CV_64F);
+                for(unsigned i = 0 ; i < svs.size() ; ++i)
+                    for(unsigned j = 0 ; j < sub.size() ; ++j)
+                        A.at<double>(i, j) = K[(m->sv_indices[svs[i]]-1)*N + m->sv_indices[sub[j]]-1];
+
+                cv::Mat AtA, Atb, c;
+                cv::gemm(A, A, 1.0, cv::Mat(), 0.0, AtA, cv::GEMM_1_T);
+                cv::gemm(A, targets[p], 1.0, cv::Mat(), 0.0, Atb, cv::GEMM_1_T);
+                double trace = 0.0;
+                for(unsigned j = 0 ; j < sub.size() ; ++j)
+                    trace += AtA.at<double>(j, j);
+                for(unsigned j = 0 ; j < sub.size() ; ++j)
+                    AtA.at<double>(j, j) += 1e-8*trace/sub.size() + 1e-12;
+                cv::solve(AtA, Atb, c, cv::DECOMP_CHOLESKY);
+
+                for(unsigned j = 0 ; j < sub.size() ; ++j)
+                    coef(sub[j], a, b, cls[sub[j]]) = c.at<double>(j);
+            }
+        }
+
+        const double acc_new = train_accuracy(m, kept, K, N, _samples.labels());
+        if(! over && acc0 - acc_new > opts.sv_tolerance) {
+            kept.swap(kept_before);
+            count.swap(count_before);
+            for(int c = 0 ; c < k-1 ; ++c)
+                std::copy(coef_before[c].begin(), coef_before[c].end(), m->sv_coef[c]);
+            break;
+        }
+
+        acc = acc_new;
+        n -= removed;
+    }
+
+    // Drop the removed ones from the model, keeping the classes' order.
+    int j = 0;
+    for(int s = 0 ; s < l ; ++s) {
+        if(! kept[s])
+            continue;
+        m->SV[j] = m->SV[s];
+        m->sv_indices[j] = m->sv_indices[s];
+        for(int c = 0 ; c < k-1 ; ++c)
+            m->sv_coef[c][j] = m->sv_coef[c][s];
+        ++j;
+    }
+    m->l = j;
+    std::copy(count.begin(), count.end(), m->nSV);
+
+    return acc - acc0;
+}
+
+void warco::PatchModel::keep_svs()
+{
+    // With a precomputed kernel, the SVM only knows its SVs by their id
+    // (the `0:id` node) which indexes into the kernel row at predict time.
+    // Renumber them 1..l and keep only their descriptors, in that order.
+    // The SVs get their own two-node rows, so that the model no longer
+    // points into `_prob` and the full kernel matrix can be freed.
+    const int l = _svm->l;
+    svm_node* x_space = l > 0 ? static_cast<svm_node*>(malloc(2*l*sizeof(svm_node))) : nullptr;
+
+    std::vector<int> svs(l);
+    if(! _train_dists.empty())
+        _train_svs.resize(l);
+    for(int i = 0 ; i < l ; ++i) {
+        if(! _train_dists.empty())
+            _train_svs[i] = _svm->sv_indices[i]-1;
+        svs[i] = _svm->sv_indices[i]-1;
+
+        x_space[2*i].index = 0;
+        x_space[2*i].value = 1+i;
+        x_space[2*i+1].index = -1;
+        _svm->SV[i] = x_space + 2*i;
+        _svm->sv_indices[i] = 1+i;
+    }
+    // Makes `svm_free_and_destroy_model` free x_space.
+    _svm->free_sv = 1;
+    // And predict with kernel rows from now on.
+    _svm->param.gram = nullptr;
+    _svm->param.gram_row = nullptr;
+    _svm->param.gram_col = nullptr;
+    _svm->param.gram_val = nullptr;
+
+    this->free_prob();
+    _samples.select(svs);
+    this->compile_svm();
+}
+
+void warco::PatchModel::compile_svm()
+{
+    // Models saved before `keep_svs` renumbered the SVs know them by their
+    // index into the whole training set, all of which is in `_samples`.
+    _engine.compile(_svm);
+    if(_engine.nrow() > this->nsamples())
+        throw std::runtime_error("The SVM refers to sample " + to_s(_engine.nrow()) + " of only " + to_s(this->nsamples()) + ".");
+}
+
 void warco::PatchModel::save(std::string name) const
 {
-    //Json::Value model;
-    //int svm_get_nr_sv(const struct svm_model *model)
-    //   This function gives the number of total support vector.
-    //void svm_get_sv_indices(const struct svm_model *model, int *sv_indices)
-    //   This function outputs indices of support vectors into an array called sv_indices.
-    //   The size of sv_indices is the number of support vectors and can be obtained by calling svm_get_nr_sv.
-    //   Each sv_indices[i] is in the range of [1, ..., num_traning_data].
-    //
-    // TODO.
-    svm_save_model((name + ".svm").c_str(), _svm);
+    // After training, `_samples` only holds the support vectors, whose ids in
+    // the SVM have been remapped accordingly by `keep_svs`.
+    if(_svm)
+        svm_save_model((name + ".svm").c_str(), _svm);
 
     std::ofstream of(name + ".model");
     if(! of)
@@ -208,16 +1141,37 @@ void warco::PatchModel::save(std::string name) const
 
     of << _d->name() << std::endl;
     of << _mean << std::endl;
-    of << _corrs.size() << std::endl;
+    of << this->nsamples() << std::endl;
+    of << (_fmap ? _fmap->name() : "kernel") << std::endl;
+    of << QuantCorrs::name(_q.empty() ? QuantCorrs::FP32 : _q.precision()) << std::endl;
     cv::FileStorage f(name + "corrs.yaml", cv::FileStorage::WRITE);
-    for(unsigned i = 0 ; i < _corrs.size() ; ++i) {
-        f << "corr" + to_s(i) << _corrs[i];
+    if(! _q.empty()) {
+        f << "rows" << static_cast<int>(_q.rows());
+        f << "scale" << _q.scale();
+        f << "quantized" << _q.packed();
+    }
+    if(! _samples.empty()) {
+        // All in one block, a sample per row.
+        f << "corr_rows" << _samples[0].rows;
+        f << "corrs" << _samples.block().clone();
     }
+
+    if(_fmap) {
+        cv::FileStorage fm(name + "fmap.yaml", cv::FileStorage::WRITE);
+        _fmap->write(fm);
+        _lin.write(fm);
+    }
+
+    if(! _train_dists.empty())
+        this->save_train(name);
 }
 
 void warco::PatchModel::load(std::string name)
 {
-    _svm = svm_load_model((name + ".svm").c_str());
+    this->free_svm();
+    _samples.clear();
+    _file.reset();
+    this->load_train("");
 
     std::ifstream f(name + ".model");
     if(! f)
@@ -230,84 +1184,435 @@ void warco::PatchModel::load(std::string name)
     f >> _mean;
     unsigned ncorrs = 0;
     f >> ncorrs;
-    _corrs.resize(ncorrs);
+
+    // Models saved before feature maps and quantization existed
+    // don't have these lines.
+    std::string kind, prec;
+    if(! (f >> kind))
+        kind = "kernel";
+    if(! (f >> prec))
+        prec = "fp32";
+
     cv::FileStorage fs(name + "corrs.yaml", cv::FileStorage::READ);
-    for(unsigned i = 0 ; i < ncorrs ; ++i) {
-        fs["corr" + to_s(i)] >> _corrs[i];
+    if(QuantCorrs::parse(prec) == QuantCorrs::FP32 && ! fs["corrs"].empty()) {
+        int rows = 0;
+        cv::Mat block;
+        fs["corr_rows"] >> rows;
+        fs["corrs"] >> block;
+        _samples.wrap(block, rows);
+    } else if(QuantCorrs::parse(prec) == QuantCorrs::FP32) {
+        // Models saved before the sample store have one entry per sample.
+        for(unsigned i = 0 ; i < ncorrs ; ++i) {
+            cv::Mat corr;
+            fs["corr" + to_s(i)] >> corr;
+            _samples.push_back(corr, 0.0);
+        }
+        _samples.shrink_to_fit();
+    } else {
+        int rows = 0;
+        float scale = 1.0f;
+        cv::Mat packed;
+        fs["rows"] >> rows;
+        fs["scale"] >> scale;
+        fs["quantized"] >> packed;
+        _q.unpack(packed, rows, scale);
+    }
+
+    if(kind == "kernel") {
+        _svm = svm_load_model((name + ".svm").c_str());
+        if(! _svm)
+            throw std::runtime_error("Error loading the SVM file " + name + ".svm");
+        this->compile_svm();
+
+        // Only there for models trained with `keep_dists`.
+        if(std::ifstream(name + ".train"))
+            this->load_train(name);
+    } else {
+        _fmap = FeatureMap::create(kind);
+        cv::FileStorage fm(name + "fmap.yaml", cv::FileStorage::READ);
+        _fmap->read(fm);
+        _lin.read(fm);
     }
 }
 
-unsigned warco::PatchModel::predict(cv::Mat& corr) const
+void warco::PatchModel::save_train(std::string name) const
 {
-    if(! _svm)
-        throw std::runtime_error("Load model before predicting plx!");
+    const std::size_t N = _train_samples.size();
+    const cv::Mat& first = _train_samples[0];
 
-    _d->prepare(corr);
+    BinTrainSet t = BinTrainSet();
+    std::memcpy(t.magic, BIN_TRAIN_MAGIC, sizeof(t.magic));
+    t.version = BIN_TRAIN_VERSION;
+    t.n = N;
+    t.rows = first.rows;
+    t.cols = first.cols;
+    t.type = first.type();
+    t.nsv = _train_svs.size();
+    t.C = _train_C;
+    t.accuracy = _train_acc;
 
-    // We only need to have the kernel evaluation with support vectors.
-    // TODO: Not always reallocate, but keep between calls.
-#if 0
-    // TODO: This doesn't work with saving/loading yet,
-    //       simply because we'd need to store each corr's id
-    //       in addition and add dummy ones in between.
-    auto N = _svm->l;
-    svm_node* nodes = new svm_node[N + 2];
-    for(int i = 0 ; i < N ; ++i) {
-        int iSV = _svm->sv_indices[i];
-        // -1 because in the case of a kernel they start at 1!
-        double d = (*_d)(this->_corrs[iSV-1], corr);
-        nodes[1+i].index = iSV;
-        nodes[1+i].value = std::exp(-d / _mean);
-    }
-    nodes[0].index = 0;
-    nodes[N+1].index = -1;
-#else
-    auto N = _corrs.size();
-    svm_node* nodes = new svm_node[N+2];
-    for(unsigned i = 0 ; i < N ; ++i) {
-        double d = (*_d)(this->_corrs[i], corr);
-        nodes[1+i].index = 1+i;
-        nodes[1+i].value = std::exp(-d / _mean);
+    // The header goes first, its offsets are filled in at the end.
+    BinWriter w(name + ".train");
+    w.append(&t, sizeof(t));
+
+    t.lbls_off = w.append(_train_samples.labels().data(), N*sizeof(double));
+    const cv::Mat packed = _train_samples.block().clone();
+    t.corrs_off = w.append(packed.ptr(), packed.total()*packed.elemSize());
+    std::vector<int32_t> svs(_train_svs.begin(), _train_svs.end());
+    t.svs_off = w.append(svs.data(), svs.size()*sizeof(int32_t));
+    t.dists_off = w.append(_train_dists.data(), _train_dists.size()*sizeof(float));
+
+    w.write_at(0, &t, sizeof(t));
+}
+
+void warco::PatchModel::load_train(std::string name)
+{
+    _train_samples.clear();
+    std::vector<float>().swap(_train_dists);
+    _train_svs.clear();
+    _train_C = _train_acc = 0.0;
+    _new_samples.clear();
+
+    if(name.empty())
+        return;
+
+    // Everything is copied out, the file isn't needed afterwards.
+    MappedFile f(name + ".train");
+    const BinTrainSet& t = *f.at<BinTrainSet>(0);
+    if(std::memcmp(t.magic, BIN_TRAIN_MAGIC, sizeof(t.magic)) != 0 || t.version != BIN_TRAIN_VERSION)
+        throw std::runtime_error("Not a training set file or unsupported version: " + name + ".train");
+    if(! _svm || t.nsv != static_cast<uint32_t>(_svm->l))
+        throw std::runtime_error("The training set " + name + ".train doesn't match its SVM.");
+
+    const std::size_t N = t.n;
+    const double* lbls = f.at<double>(t.lbls_off, N);
+    const int32_t* svs = f.at<int32_t>(t.svs_off, t.nsv);
+    const float* dists = f.at<float>(t.dists_off, N*N);
+    const std::size_t bytes = static_cast<std::size_t>(t.rows)*t.cols*cv::Mat(1, 1, t.type).elemSize();
+    const uint8_t* corrs = f.at<uint8_t>(t.corrs_off, N*bytes);
+
+    _train_samples.wrap(cv::Mat(N, t.rows*t.cols, t.type, const_cast<uint8_t*>(corrs)).clone(), t.rows,
+                        std::vector<double>(lbls, lbls + N));
+    _train_svs.assign(svs, svs + t.nsv);
+    _train_dists.assign(dists, dists + N*N);
+    _train_C = t.C;
+    _train_acc = t.accuracy;
+}
+
+void warco::PatchModel::save_binary(BinWriter& w, BinPatch& p) const
+{
+    const std::string kind = _fmap ? _fmap->name() : "kernel";
+    if(_d->name().size() >= sizeof(p.dist) || kind.size() >= sizeof(p.kind))
+        throw std::runtime_error("Distance or model name too long for a binary model.");
+    std::strncpy(p.dist, _d->name().c_str(), sizeof(p.dist));
+    std::strncpy(p.kind, kind.c_str(), sizeof(p.kind));
+
+    p.mean = _mean;
+    p.nsamples = this->nsamples();
+    p.precision = _q.empty() ? QuantCorrs::FP32 : _q.precision();
+
+    // All descriptors in one block, one per row.
+    cv::Mat packed;
+    if(! _q.empty()) {
+        packed = _q.packed();
+        p.rows = _q.rows();
+        p.scale = _q.scale();
+    } else if(! _samples.empty()) {
+        packed = _samples.block().clone();
+        p.rows = _samples[0].rows;
+        p.scale = 1.0f;
+    }
+    p.cols = p.rows ? packed.cols / p.rows : 0;
+    p.type = packed.type();
+    p.corrs_off = w.append(packed.ptr(), packed.total()*packed.elemSize());
+
+    if(_svm) {
+        p.model_off = write_svm(w, _svm);
+        p.model_size = sizeof(BinSvm);
+    } else if(_fmap) {
+        cv::FileStorage fm(".yaml", cv::FileStorage::WRITE | cv::FileStorage::MEMORY);
+        _fmap->write(fm);
+        _lin.write(fm);
+        const std::string yaml = fm.releaseAndGetString();
+        p.model_off = w.append(yaml.data(), yaml.size());
+        p.model_size = yaml.size();
+    } else {
+        throw std::runtime_error("Can't save an untrained model.");
+    }
+}
+
+void warco::PatchModel::load_binary(const MappedFile::Ptr& f, const BinPatch& p)
+{
+    this->free_svm();
+    _samples.clear();
+    _file = f;
+    // Binary models are for prediction only, they don't carry training sets.
+    this->load_train("");
+
+    _d = Distance::create(std::string(p.dist, strnlen(p.dist, sizeof(p.dist))));
+    _mean = p.mean;
+
+    // The fp32 descriptors are used right where they are in the file.
+    const std::size_t len = static_cast<std::size_t>(p.rows)*p.cols;
+    const auto* data = f->at<uint8_t>(p.corrs_off, p.nsamples*len*cv::Mat(1, 1, p.type).elemSize());
+    if(p.precision == QuantCorrs::FP32) {
+        if(p.nsamples > 0)
+            _samples.wrap(cv::Mat(p.nsamples, len, p.type, const_cast<uint8_t*>(data)), p.rows);
+    } else {
+        _q.unpack(cv::Mat(p.nsamples, len, p.type, const_cast<uint8_t*>(data)), p.rows, p.scale);
     }
-    nodes[0].index = 0; // And .value is arbitrary at test-time.
-    nodes[N+1].index = -1;
-#endif
 
-    unsigned label = static_cast<unsigned>(svm_predict(_svm, nodes));
+    const std::string kind(p.kind, strnlen(p.kind, sizeof(p.kind)));
+    if(kind == "kernel") {
+        _svm = read_svm(*f, p.model_off);
+        this->compile_svm();
+    } else {
+        const char* yaml = f->at<char>(p.model_off, p.model_size);
+        cv::FileStorage fm(std::string(yaml, p.model_size), cv::FileStorage::READ | cv::FileStorage::MEMORY);
+        _fmap = FeatureMap::create(kind);
+        _fmap->read(fm);
+        _lin.read(fm);
+    }
+}
 
-    delete[] nodes;
+unsigned warco::PatchModel::predict(cv::Mat& corr) const
+{
+    if(_fmap) {
+        _d->prepare(corr);
+        return _lin.predict((*_fmap)(corr, *_d));
+    }
 
-    return label;
+    if(! _svm)
+        throw std::runtime_error("Load model before predicting plx!");
+
+    _d->prepare(corr);
+
+    // We only need to have the kernel evaluation with support vectors,
+    // which is all that's left in `_samples` after `keep_svs`, in the same
+    // order as the compiled SVM's.
+    std::vector<double> k;
+    this->kernel_row(corr, k);
+    return static_cast<unsigned>(_engine.predict(k.data()));
 }
 
 std::vector<double> warco::PatchModel::predict_probas(cv::Mat& corr) const
 {
+    if(_fmap) {
+        _d->prepare(corr);
+        return _lin.predict_probas((*_fmap)(corr, *_d));
+    }
+
+    if(! _svm)
+        throw std::runtime_error("Load model before predicting plx!");
+
     // TODO: might want to get that one as an output argument
     //       such that if used in an inner loop doesn't get perma-reallocated.
-    std::vector<double> nrvo(svm_get_nr_class(_svm), 0.0);
+    std::vector<double> nrvo(_engine.nclass(), 0.0);
 
     _d->prepare(corr);
 
-    // TODO also see comments in predict
-    auto N = _corrs.size();
-    svm_node* nodes = new svm_node[N+2];
-    for(unsigned i = 0 ; i < N ; ++i) {
-        double d = (*_d)(this->_corrs[i], corr);
-        nodes[1+i].index = 1+i;
-        nodes[1+i].value = std::exp(-d / _mean);
+    std::vector<double> k;
+    this->kernel_row(corr, k);
+    _engine.predict_probas(k.data(), &nrvo[0]);
+
+    return nrvo;
+}
+
+void warco::PatchModel::kernel_row(const cv::Mat& corr, std::vector<double>& k) const
+{
+    const auto N = this->nsamples();
+    cv::Mat scratch;
+    k.resize(N);
+    for(unsigned i = 0 ; i < N ; ++i)
+        k[i] = std::exp(-this->dist(i, corr, scratch) / _mean);
+}
+
+std::vector<unsigned> warco::PatchModel::predict_batch(std::vector<cv::Mat>& corrs) const
+{
+    std::vector<unsigned> nrvo(corrs.size());
+
+    if(_fmap) {
+        for(unsigned q = 0 ; q < corrs.size() ; ++q)
+            nrvo[q] = this->predict(corrs[q]);
+        return nrvo;
     }
-    nodes[0].index = 0; // And .value is arbitrary at test-time.
-    nodes[N+1].index = -1;
 
-    svm_predict_probability(_svm, nodes, &nrvo[0]);
+    if(! _svm)
+        throw std::runtime_error("Load model before predicting plx!");
 
-    delete[] nodes;
+    cv::Mat D;
+    this->dist_block(corrs, D);
+
+    // One kernel row for all of them, see `predict`.
+    const unsigned N = D.cols;
+    std::vector<double> k(N);
+    for(unsigned q = 0 ; q < corrs.size() ; ++q) {
+        const float* d = D.ptr<float>(q);
+        for(unsigned i = 0 ; i < N ; ++i)
+            k[i] = std::exp(-d[i] / _mean);
+        nrvo[q] = static_cast<unsigned>(_engine.predict(k.data()));
+    }
+
+    return nrvo;
+}
+
+std::vector<std::vector<double>> warco::PatchModel::predict_probas_batch(std::vector<cv::Mat>& corrs) const
+{
+    std::vector<std::vector<double>> nrvo(corrs.size());
+
+    if(_fmap) {
+        for(unsigned q = 0 ; q < corrs.size() ; ++q)
+            nrvo[q] = this->predict_probas(corrs[q]);
+        return nrvo;
+    }
+
+    if(! _svm)
+        throw std::runtime_error("Load model before predicting plx!");
+
+    cv::Mat D;
+    this->dist_block(corrs, D);
+
+    const unsigned N = D.cols;
+    std::vector<double> k(N);
+    for(unsigned q = 0 ; q < corrs.size() ; ++q) {
+        const float* d = D.ptr<float>(q);
+        for(unsigned i = 0 ; i < N ; ++i)
+            k[i] = std::exp(-d[i] / _mean);
+        nrvo[q].resize(_engine.nclass());
+        _engine.predict_probas(k.data(), &nrvo[q][0]);
+    }
+
+    return nrvo;
+}
+
+// Flattens `corrs` into the rows of one CV_64F matrix.
+static cv::Mat pack_rows(const std::vector<cv::Mat>& corrs)
+{
+    cv::Mat nrvo(corrs.size(), corrs[0].total(), CV_64F);
+    for(unsigned i = 0 ; i < corrs.size() ; ++i) {
+        cv::Mat row = nrvo.row(i);
+        corrs[i].reshape(1, 1).convertTo(row, CV_64F);
+    }
+    return nrvo;
+}
+
+void warco::PatchModel::dist_block(std::vector<cv::Mat>& corrs, cv::Mat& D) const
+{
+    for(auto& corr : corrs)
+        _d->prepare(corr);
+
+    const unsigned Q = corrs.size(), N = this->nsamples();
+    D.create(Q, N, CV_32F);
+    if(Q == 0 || N == 0)
+        return;
+
+    if(_d->isfrob() && _q.empty()) {
+        // |a-b|^2 = |a|^2 + |b|^2 - 2a.b, where the last term for all pairs
+        // is a single (blocked, vectorized) matrix product. In double, as
+        // the difference of the large terms loses precision otherwise.
+        const cv::Mat A = pack_rows(corrs);
+        cv::Mat B;
+        _samples.block().convertTo(B, CV_64F);
+        cv::Mat AB;
+        cv::gemm(A, B, -2.0, cv::Mat(), 0.0, AB, cv::GEMM_2_T);
+
+        std::vector<double> nb(N);
+        for(unsigned i = 0 ; i < N ; ++i)
+            nb[i] = B.row(i).dot(B.row(i));
+        for(unsigned q = 0 ; q < Q ; ++q) {
+            const double na = A.row(q).dot(A.row(q));
+            const double* ab = AB.ptr<double>(q);
+            float* d = D.ptr<float>(q);
+            for(unsigned i = 0 ; i < N ; ++i)
+                d[i] = static_cast<float>(std::sqrt(std::max(0.0, na + nb[i] + ab[i])));
+        }
+    } else {
+        cv::Mat scratch;
+        for(unsigned q = 0 ; q < Q ; ++q) {
+            float* d = D.ptr<float>(q);
+            for(unsigned i = 0 ; i < N ; ++i)
+                d[i] = this->dist(i, corrs[q], scratch);
+        }
+    }
+}
+
+std::size_t warco::PatchModel::nsamples() const
+{
+    return _q.empty() ? _samples.size() : _q.size();
+}
+
+float warco::PatchModel::dist(unsigned i, const cv::Mat& corr, cv::Mat& scratch) const
+{
+    if(_q.empty())
+        return (*_d)(_samples[i], corr);
+
+    if(_d->isfrob())
+        return _q.frob(i, corr);
+
+    // The others, which need eigenvalues and the like, get the descriptor
+    // back in fp32 first. That still saves the memory, but not the time.
+    _q.dequantize(i, scratch);
+    return (*_d)(scratch, corr);
+}
+
+void warco::PatchModel::quantize(std::string precision)
+{
+    auto prec = QuantCorrs::parse(precision);
+
+    // Go back to full precision first, so that re-quantizing works.
+    if(! _q.empty()) {
+        cv::Mat corr;
+        for(unsigned i = 0 ; i < _q.size() ; ++i) {
+            _q.dequantize(i, corr);
+            _samples.push_back(corr, 0.0);
+        }
+        _samples.shrink_to_fit();
+        _q.clear();
+    }
+
+    if(prec == QuantCorrs::FP32 || _samples.empty())
+        return;
+
+    _q.assign(_samples.mats(), prec);
+    _samples.clear();
+}
+
+std::size_t warco::PatchModel::descr_bytes() const
+{
+    std::size_t nrvo = _q.bytes();
+    for(const auto& c : _samples.mats())
+        nrvo += c.total() * c.elemSize();
+    return nrvo;
+}
+
+std::size_t warco::PatchModel::footprint() const
+{
+    std::size_t nrvo = sizeof(*this) + _q.bytes() + _samples.bytes() + _new_samples.bytes();
+
+    if(_svm) {
+        // As allocated by `keep_svs` or `read_svm`.
+        const std::size_t k = _svm->nr_class, l = _svm->l;
+        nrvo += sizeof(svm_model);
+        nrvo += l*(sizeof(svm_node*) + 2*sizeof(svm_node));
+        nrvo += (k-1)*(sizeof(double*) + l*sizeof(double));
+        nrvo += 3*k*(k-1)/2*sizeof(double) + 2*k*sizeof(int);
+        nrvo += _engine.bytes();
+    }
+
+    if(_fmap)
+        nrvo += _fmap->bytes() + _lin.w.size()*sizeof(float);
+
+    // The training set kept for `train_incremental`.
+    nrvo += _train_dists.size()*sizeof(float) + _train_samples.bytes();
 
     return nrvo;
 }
 
 unsigned warco::PatchModel::nlbls() const
 {
+    if(_fmap)
+        return _lin.labels.size();
+
     if(!_svm)
         throw std::runtime_error("Calling PatchModel::nlbls before training!");
 
@@ -1,46 +1,208 @@
 #pragma once
 
 #include <string>
+#include <utility>
 #include <vector>
 
+// For BinPatch, BinWriter and MappedFile
+#include "binmodel.hpp"
+// For CompiledSvm
+#include "compiled.hpp"
 // For Distance
 #include "dists.hpp"
+// For FeatureMap and LinearSvm
+#include "featmap.hpp"
+// For GramBuffer
+#include "gram.hpp"
+// For SparseGram
+#include "knn.hpp"
+// For QuantCorrs
+#include "quant.hpp"
+// For SampleStore
+#include "samples.hpp"
 
 namespace cv {
     class Mat;
 }
 
 struct svm_model;
+struct svm_parameter;
 struct svm_problem;
 
 namespace warco {
 
     void test_model();
 
+    struct TrainOpts {
+        // "kernel" for the exact kernel SVM, or the name of a FeatureMap
+        // whose features are fed to a LinearSvm.
+        std::string model = "kernel";
+        // Dimension of the explicit feature map, if any.
+        unsigned model_dim = 1000;
+        // Whether the cross-validation of C and the final kernel SVM start
+        // off previous solutions instead of from scratch.
+        bool warm_start = true;
+
+        // If not empty, the Gram matrices live in memory-mapped files in this
+        // directory, and the solvers keep their recently used rows in a cache
+        // of `scratch_cache_mb` megabytes each. Otherwise, solvers whose
+        // whole kernel fits in that keep a contiguous copy of it.
+        std::string scratch_dir;
+        unsigned scratch_cache_mb = 256;
+
+        // If not empty, a directory of raw distance matrices shared by all
+        // trainings, see `cached_pdist`. Only used by the kernel model.
+        std::string dist_cache;
+
+        // Shrink each kernel model to at most `sv_budget` SVs (0 for no limit)
+        // and then further as long as its training accuracy drops by at most
+        // `sv_tolerance`, refitting the remaining SVs' coefficients. The
+        // patch's weight is its cross-validated accuracy plus that drop.
+        unsigned sv_budget = 0;
+        double sv_tolerance = 0.0;
+
+        // Only keep the subset of patches, greedily chosen for the accuracy
+        // of their ensemble on the cross-validation's predictions, which fits
+        // in at most `max_patches` patches and/or `max_predict_us` measured
+        // microseconds per prediction (0 for no limit), their weights then
+        // re-fitted to that ensemble. Used by Warco::train.
+        unsigned max_patches = 0;
+        double max_predict_us = 0.0;
+
+        // Only train as many patches at once as fit in this many megabytes
+        // by their estimated peak, see PatchModel::train_peak (0 for no
+        // limit). A patch larger than that alone still trains, by itself.
+        // Used by Warco::train.
+        unsigned max_train_mb = 0;
+
+        // Keep the whole training set and its raw distance matrix with the
+        // kernel model (and save them), for `train_incremental`.
+        bool keep_dists = false;
+
+        // If not 0, approximate the kernel model's Gram matrix by keeping
+        // only each sample's `knn` nearest neighbours (either way), and zero
+        // otherwise, taking O(N*knn) memory and distances instead of O(N*N).
+        // Can't be combined with `keep_dists`, `dist_cache` or an SV budget.
+        // Predictions still use the exact kernel to the SVs.
+        unsigned knn = 0;
+        // With `knn`, also cross-validate both the sparse and the dense kernel
+        // on a subsample of at most this many samples, see `knn_accuracy`.
+        unsigned knn_check = 0;
+
+        // Threads each patch may use for its own parallel work (the Gram
+        // matrix, the cross-validation folds and the final SVM's pairs of
+        // classes), 0 meaning OpenMP's
+        // default. Unused when it runs as a task of a TaskPool, like in
+        // Warco::train, whose workers share that work instead.
+        unsigned nthreads = 0;
+    };
+
     struct PatchModel {
         PatchModel(std::string distname = "");
         ~PatchModel();
 
         void add_sample(const cv::Mat& corr, unsigned label);
         bool prepare();
-        double train(const std::vector<double>& C_crossval = {0.1, 1., 10.});
+        double train(const std::vector<double>& C_crossval = {0.1, 1., 10.}, const TrainOpts& opts = TrainOpts());
+        // Estimated peak bytes that `train` allocates on top of the samples
+        // themselves, with at most `nthreads` of its solvers at a time.
+        std::size_t train_peak(const std::vector<double>& C_crossval, const TrainOpts& opts, unsigned nthreads) const;
+        // Retrains a kernel model which was trained (or saved) with
+        // `keep_dists` on its training set plus the samples added since,
+        // computing only their distances and starting off the previous
+        // solution. Keeps the previous C and returns its accuracy, which is
+        // cross-validated anew on the grown training set.
+        double train_incremental(const TrainOpts& opts = TrainOpts());
         unsigned predict(cv::Mat& corr) const;
         std::vector<double> predict_probas(cv::Mat& corr) const;
+        // Same as the above for many samples at once, computing all their
+        // kernel rows in one go. Prepares `corrs` in place.
+        std::vector<unsigned> predict_batch(std::vector<cv::Mat>& corrs) const;
+        std::vector<std::vector<double>> predict_probas_batch(std::vector<cv::Mat>& corrs) const;
 
         void save(std::string name) const;
         void load(std::string name);
+        // Parts of the single-file binary model, see binmodel.hpp.
+        void save_binary(BinWriter& w, BinPatch& p) const;
+        void load_binary(const MappedFile::Ptr& f, const BinPatch& p);
+
+        // Switches the stored descriptors to "fp32", "fp16" or "int8".
+        void quantize(std::string precision);
+        std::size_t descr_bytes() const;
+        // Approximate memory taken by the trained or loaded model, counting
+        // descriptors memory-mapped from a binary model file as resident.
+        std::size_t footprint() const;
 
         unsigned nlbls() const;
 
+        // The cross-validation's out-of-fold prediction of each training
+        // sample and its actual label, only after `train`.
+        const std::vector<double>& cv_predictions() const { return _cv_pred; }
+        const std::vector<double>& cv_labels() const { return _cv_lbls; }
+        // Measured microseconds a prediction takes, only after `train`.
+        double predict_cost() const { return _cost_us; }
+        // The cross-validated accuracy of the dense and of the sparse kernel
+        // on the `knn_check` subsample, only after `train` with it.
+        const std::pair<double, double>& knn_accuracy() const { return _knn_acc; }
+
     protected:
-        std::vector<cv::Mat> _corrs;
-        std::vector<double> _lbls;
+        SampleStore _samples;
         svm_model* _svm;
+        // `_svm` laid out for prediction, what all predictions go through.
+        CompiledSvm _engine;
         svm_problem* _prob;
+        // Dense or, with `knn`, sparse kernel matrix of `_prob`, only alive
+        // during training.
+        GramBuffer _gram;
+        SparseGram _sparse;
         double _mean;
         Distance::Ptr _d;
 
+        // Only used by explicit feature map models, in which case `_svm` is null.
+        FeatureMap::Ptr _fmap;
+        LinearSvm _lin;
+
+        // When non-empty, replaces `_samples` for prediction.
+        QuantCorrs _q;
+
+        // The binary model file `_samples` point into, if loaded from one.
+        MappedFile::Ptr _file;
+
+        std::vector<double> _cv_pred;
+        std::vector<double> _cv_lbls;
+        double _cost_us;
+        std::pair<double, double> _knn_acc;
+
+        // With `keep_dists`, the whole (prepared) training set, the raw
+        // distances between its samples, the SVs' indices into it, and the
+        // chosen C and its accuracy. Samples added to such a model go to
+        // `_new_samples` until `train_incremental`.
+        SampleStore _train_samples;
+        std::vector<float> _train_dists;
+        std::vector<int> _train_svs;
+        double _train_C;
+        double _train_acc;
+        SampleStore _new_samples;
+
         void free_svm();
+        void free_prob();
+        void keep_svs();
+        void compile_svm();
+        std::size_t nsamples() const;
+        float dist(unsigned i, const cv::Mat& corr, cv::Mat& scratch) const;
+        // The kernel values of a prepared sample with each of `_samples`,
+        // out of which `_engine` picks its SVs'.
+        void kernel_row(const cv::Mat& corr, std::vector<double>& k) const;
+        void dist_block(std::vector<cv::Mat>& corrs, cv::Mat& D) const;
+        void make_feasible(std::vector<double>& alpha) const;
+        double reduce_svs(const TrainOpts& opts);
+        svm_parameter kernel_problem(float* K, const TrainOpts& opts);
+        std::vector<double> previous_alphas(unsigned N) const;
+        void save_train(std::string name) const;
+        void load_train(std::string name);
+        double train_featmap(const std::vector<double>& C_crossval, const TrainOpts& opts);
+        void measure_cost(const cv::Mat& probe);
+        void check_knn(const svm_parameter& param, const TrainOpts& opts);
     };
 
 } // namespace warco
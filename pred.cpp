@@ -1,7 +1,12 @@
 #include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
 
 #include "json/json.h"
 
+#include "lazymodel.hpp"
 #include "mainutils.hpp"
 #include "warco.hpp"
 
@@ -11,33 +16,79 @@ int main(int argc, char** argv)
         std::cout << "Usage: " << argv[0] << " CONF_FILE MODEL_NAME" << std::endl;
         std::cout << std::endl;
         std::cout << "CONF_FILE  Path to the JSON config file describing the dataset." << std::endl;
-        std::cout << "MODEL_NAME Name of the model which should be loaded. Is a directory." << std::endl;
+        std::cout << "MODEL_NAME Name of the model which should be loaded. Is a directory or a binary model file." << std::endl;
         return 0;
     }
 
     std::cout << "Hey there again! Loading the model... " << std::flush;
     Json::Value dataset = warco::readJson(argv[1]);
-    warco::Warco model(argv[2]);
+    const std::size_t cache = warco::readModelCache(dataset);
+    warco::LazyModel::set_cap(cache);
+    warco::Warco model(argv[2], cache > 0);
     std::cout << "Done." << std::endl;
 
     std::cout << "Testing" << std::flush;
     std::cerr << "test,predicted,actual" << std::endl;
 
+    // The images are predicted in batches, which is a lot faster.
+    const unsigned batch = 256;
+    std::vector<cv::Mat> imgs;
+    std::vector<unsigned> truth;
+    std::vector<std::string> fnames;
+
+    // Or one at a time, stopping early, see CascadeOpts.
+    const bool cascade = dataset.isMember("cascade");
+    const auto cascade_opts = cascade ? warco::readCascadeOpts(dataset["cascade"]) : warco::CascadeOpts();
+    unsigned nevaluated = 0;
+    std::vector<unsigned> exits(4, 0);
+
     Json::Value lbls = dataset["classes"];
     unsigned correct = 0, total = 0;
-    warco::foreach_img(dataset, "test", [&model, &lbls, &correct, &total](unsigned lbl, const cv::Mat& image, std::string fname) {
-        std::cout << "." << std::flush;
+    auto flush = [&]() {
+        std::vector<unsigned> preds;
+        if(cascade) {
+            for(const auto& img : imgs) {
+                warco::CascadeInfo info;
+                preds.push_back(model.predict_cascade(img, cascade_opts, &info));
+                nevaluated += info.nevaluated;
+                ++exits[info.exit];
+            }
+        } else {
+            //preds = model.predict_batch(imgs);
+            preds = model.predict_proba_batch(imgs);
+        }
 
-        //unsigned pred = model.predict(image);
-        unsigned pred = model.predict_proba(image);
+        for(unsigned i = 0 ; i < preds.size() ; ++i) {
+            std::cerr << fnames[i] << "," << lbls[preds[i]].asString() << "," << lbls[truth[i]].asString() << std::endl;
 
-        std::cerr << fname << "," << lbls[pred].asString() << "," << lbls[lbl].asString() << std::endl;
+            correct += preds[i] == truth[i];
+            ++total;
+        }
 
-        correct += pred == lbl;
-        ++total;
+        imgs.clear();
+        truth.clear();
+        fnames.clear();
+    };
+
+    warco::foreach_img(dataset, "test", [&](unsigned lbl, const cv::Mat& image, std::string fname) {
+        std::cout << "." << std::flush;
+
+        imgs.push_back(image);
+        truth.push_back(lbl);
+        fnames.push_back(fname);
+        if(imgs.size() == batch)
+            flush();
     });
+    flush();
 
     std::cout << std::endl << "score: " << 100.0*correct/total << "%" << std::endl;
+    if(cascade) {
+        std::cout << "patches evaluated: " << nevaluated/static_cast<double>(total) << " of " << model.npatches() << " on average" << std::endl;
+        std::cout << "exits: " << exits[warco::CascadeInfo::ALL] << " all, "
+                  << exits[warco::CascadeInfo::DECIDED] << " decided, "
+                  << exits[warco::CascadeInfo::MARGIN] << " margin, "
+                  << exits[warco::CascadeInfo::DEADLINE] << " deadline" << std::endl;
+    }
 
     return 0;
 }
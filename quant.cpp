@@ -0,0 +1,337 @@
+#include "quant.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __F16C__
+#  include <immintrin.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+#include "cvutils.hpp"
+
+// IEEE half-floats, round-to-nearest-even, by hand. These are the portable
+// conversions: used for quantizing, for what the F16C loop of `frob_fp16`
+// leaves over, and for everything without F16C (see WARCO_F16C in
+// CMakeLists.txt). They're also the reference the F16C instructions are
+// tested against.
+static uint16_t float2half(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    const uint16_t sign = (x >> 16) & 0x8000;
+    const int exp = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+
+    if(exp >= 31) // Overflow, inf and NaN (which we don't care about).
+        return sign | 0x7c00;
+
+    if(exp <= 0) { // Subnormal or zero.
+        if(exp < -10)
+            return sign;
+        mant |= 0x800000;
+        const int shift = 14 - exp;
+        uint16_t h = static_cast<uint16_t>(mant >> shift);
+        const uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    uint16_t h = static_cast<uint16_t>((exp << 10) | (mant >> 13));
+    const uint32_t rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h; // May carry into the exponent, which is what we want.
+    return sign | h;
+}
+
+static float half2float(uint16_t h)
+{
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+
+    if(exp == 0) {
+        if(mant == 0) {
+            x = sign;
+        } else { // Subnormal, normalize it.
+            exp = 1;
+            while(!(mant & 0x400)) {
+                mant <<= 1;
+                --exp;
+            }
+            mant &= 0x3ff;
+            x = sign | static_cast<uint32_t>(exp + 127 - 15) << 23 | mant << 13;
+        }
+    } else if(exp == 31) {
+        x = sign | 0x7f800000 | mant << 13;
+    } else {
+        x = sign | static_cast<uint32_t>(exp + 127 - 15) << 23 | mant << 13;
+    }
+
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static float frob_fp32(const float* a, const float* x, unsigned n)
+{
+    float acc = 0.0f;
+#if _OPENMP >= 201307
+    #pragma omp simd reduction(+:acc)
+#endif
+    for(unsigned i = 0 ; i < n ; ++i) {
+        float d = a[i] - x[i];
+        acc += d*d;
+    }
+    return acc;
+}
+
+static float frob_fp16(const uint16_t* a, const float* x, unsigned n)
+{
+    float acc = 0.0f;
+    unsigned i = 0;
+
+#ifdef __F16C__
+    __m256 vacc = _mm256_setzero_ps();
+    for( ; i + 8 <= n ; i += 8) {
+        __m256 va = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256 d = _mm256_sub_ps(va, _mm256_loadu_ps(x + i));
+        vacc = _mm256_add_ps(vacc, _mm256_mul_ps(d, d));
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vacc);
+    for(float l : lanes)
+        acc += l;
+#endif
+
+    for( ; i < n ; ++i) {
+        float d = half2float(a[i]) - x[i];
+        acc += d*d;
+    }
+    return acc;
+}
+
+static float frob_int8(const int8_t* a, float scale, const float* x, unsigned n)
+{
+    float acc = 0.0f;
+#if _OPENMP >= 201307
+    #pragma omp simd reduction(+:acc)
+#endif
+    for(unsigned i = 0 ; i < n ; ++i) {
+        float d = scale*a[i] - x[i];
+        acc += d*d;
+    }
+    return acc;
+}
+
+warco::QuantCorrs::QuantCorrs()
+    : _prec(FP32)
+    , _n(0)
+    , _rows(0)
+    , _len(0)
+    , _scale(1.0f)
+{ }
+
+void warco::QuantCorrs::clear()
+{
+    _n = _rows = _len = 0;
+    _scale = 1.0f;
+    _data.clear();
+}
+
+static std::size_t elemsize(warco::QuantCorrs::Precision prec)
+{
+    switch(prec) {
+    case warco::QuantCorrs::FP32: return sizeof(float);
+    case warco::QuantCorrs::FP16: return sizeof(uint16_t);
+    case warco::QuantCorrs::INT8: return sizeof(int8_t);
+    }
+    return 0;
+}
+
+void warco::QuantCorrs::assign(const std::vector<cv::Mat>& corrs, Precision prec)
+{
+    this->clear();
+    if(corrs.empty())
+        return;
+
+    _prec = prec;
+    _n = corrs.size();
+    _rows = corrs[0].rows;
+    _len = corrs[0].rows * corrs[0].cols;
+    _data.resize(_n * _len * elemsize(prec));
+
+    // Symmetric int8 quantization with one scale for the whole patch.
+    if(prec == INT8) {
+        double amax = 0.0;
+        for(const auto& c : corrs)
+            amax = std::max(amax, norm(c, cv::NORM_INF));
+        _scale = amax > 0.0 ? static_cast<float>(amax / 127.0) : 1.0f;
+    }
+
+    for(std::size_t i = 0 ; i < _n ; ++i) {
+        cv::Mat c;
+        corrs[i].convertTo(c, CV_32F);
+        if(! c.isContinuous())
+            c = c.clone();
+        const float* src = c.ptr<float>();
+
+        switch(prec) {
+        case FP32:
+            std::memcpy(&_data[i*_len*sizeof(float)], src, _len*sizeof(float));
+            break;
+        case FP16: {
+            uint16_t* dst = reinterpret_cast<uint16_t*>(&_data[0]) + i*_len;
+            for(unsigned j = 0 ; j < _len ; ++j)
+                dst[j] = float2half(src[j]);
+            break;
+        }
+        case INT8: {
+            int8_t* dst = reinterpret_cast<int8_t*>(&_data[0]) + i*_len;
+            for(unsigned j = 0 ; j < _len ; ++j)
+                dst[j] = static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, std::round(src[j] / _scale))));
+            break;
+        }
+        }
+    }
+}
+
+float warco::QuantCorrs::frob(std::size_t i, const cv::Mat& x) const
+{
+    const float* px = x.ptr<float>();
+
+    float sq = 0.0f;
+    switch(_prec) {
+    case FP32: sq = frob_fp32(reinterpret_cast<const float*>(&_data[0]) + i*_len, px, _len); break;
+    case FP16: sq = frob_fp16(reinterpret_cast<const uint16_t*>(&_data[0]) + i*_len, px, _len); break;
+    case INT8: sq = frob_int8(reinterpret_cast<const int8_t*>(&_data[0]) + i*_len, _scale, px, _len); break;
+    }
+
+    return std::sqrt(sq);
+}
+
+void warco::QuantCorrs::dequantize(std::size_t i, cv::Mat& out) const
+{
+    out.create(_rows, _len/_rows, CV_32F);
+    float* dst = out.ptr<float>();
+
+    switch(_prec) {
+    case FP32:
+        std::memcpy(dst, &_data[i*_len*sizeof(float)], _len*sizeof(float));
+        break;
+    case FP16: {
+        const uint16_t* src = reinterpret_cast<const uint16_t*>(&_data[0]) + i*_len;
+        for(unsigned j = 0 ; j < _len ; ++j)
+            dst[j] = half2float(src[j]);
+        break;
+    }
+    case INT8: {
+        const int8_t* src = reinterpret_cast<const int8_t*>(&_data[0]) + i*_len;
+        for(unsigned j = 0 ; j < _len ; ++j)
+            dst[j] = _scale*src[j];
+        break;
+    }
+    }
+}
+
+cv::Mat warco::QuantCorrs::packed() const
+{
+    static const int types[] = {CV_32F, CV_16U, CV_8S};
+    return cv::Mat(_n, _len, types[_prec], const_cast<uint8_t*>(&_data[0])).clone();
+}
+
+void warco::QuantCorrs::unpack(const cv::Mat& packed, unsigned rows, float scale)
+{
+    this->clear();
+
+    switch(packed.depth()) {
+    case CV_32F: _prec = FP32; break;
+    case CV_16U: _prec = FP16; break;
+    case CV_8S: _prec = INT8; break;
+    default: throw std::runtime_error("Unknown quantized descriptor type.");
+    }
+
+    _n = packed.rows;
+    _rows = rows;
+    _len = packed.cols;
+    _scale = scale;
+
+    cv::Mat c = packed.isContinuous() ? packed : packed.clone();
+    _data.assign(c.ptr(), c.ptr() + _n*_len*elemsize(_prec));
+}
+
+warco::QuantCorrs::Precision warco::QuantCorrs::parse(std::string name)
+{
+    if(name == "fp32") {
+        return FP32;
+    } else if(name == "fp16") {
+        return FP16;
+    } else if(name == "int8") {
+        return INT8;
+    } else {
+        throw std::runtime_error("Unknown precision: '" + name + "'");
+    }
+}
+
+std::string warco::QuantCorrs::name(Precision prec)
+{
+    static const char* names[] = {"fp32", "fp16", "int8"};
+    return names[prec];
+}
+
+void warco::test_quant()
+{
+    std::cout << "Quantized descriptors... " << std::flush;
+
+#ifdef __F16C__
+    // The instructions round like the portable conversions, NaNs aside.
+    for(uint32_t h = 0 ; h < 0x10000 ; ++h) {
+        const float f = half2float(static_cast<uint16_t>(h));
+        if(f == f && (_cvtsh_ss(static_cast<uint16_t>(h)) != f || _cvtss_sh(f, 0) != h)) {
+            std::cerr << "Failed! (F16C converts half " << h << " differently)" << std::endl;
+            throw std::runtime_error("Test assertion failed.");
+        }
+    }
+    for(uint32_t x = 0 ; x < 0xff800000u ; x += 4099) {
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        if(f == f && _cvtss_sh(f, 0) != float2half(f)) {
+            std::cerr << "Failed! (F16C converts " << f << " differently)" << std::endl;
+            throw std::runtime_error("Test assertion failed.");
+        }
+    }
+#endif
+
+    std::vector<cv::Mat> corrs(5);
+    for(auto& c : corrs)
+        c = warco::randspd(6,6);
+    cv::Mat x = warco::randspd(6,6);
+
+    // The relative tolerances are generous bounds of the rounding errors.
+    const double tols[] = {1e-6, 2e-3, 2e-2};
+    for(auto prec : {QuantCorrs::FP32, QuantCorrs::FP16, QuantCorrs::INT8}) {
+        QuantCorrs q;
+        q.assign(corrs, prec);
+
+        for(unsigned i = 0 ; i < corrs.size() ; ++i) {
+            double expected = norm(corrs[i], x);
+            double actual = q.frob(i, x);
+            if(std::abs(expected - actual) > tols[prec]*norm(corrs[i])) {
+                std::cerr << "Failed! (" << QuantCorrs::name(prec) << " distance " << actual << " instead of " << expected << ")" << std::endl;
+                throw std::runtime_error("Test assertion failed.");
+            }
+
+            cv::Mat deq;
+            q.dequantize(i, deq);
+            warco::assert_mat_almost_eq(deq, corrs[i], tols[prec]);
+        }
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
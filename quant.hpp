@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cv {
+    class Mat;
+}
+
+namespace warco {
+
+    // Reduced-precision, contiguous copy of a patch model's prepared
+    // descriptors for inference. Each descriptor is stored as a flat
+    // rows*cols array of either half-floats or bytes with one per-patch scale.
+    struct QuantCorrs {
+        enum Precision { FP32, FP16, INT8 };
+
+        QuantCorrs();
+
+        void assign(const std::vector<cv::Mat>& corrs, Precision prec);
+        void clear();
+
+        bool empty() const { return _n == 0; }
+        std::size_t size() const { return _n; }
+        std::size_t bytes() const { return _data.size(); }
+        Precision precision() const { return _prec; }
+
+        // Euclidean distance between the flattened i-th descriptor and `x`,
+        // which needs to be a continuous CV_32F matrix of the same size.
+        // Accumulates in fp32.
+        float frob(std::size_t i, const cv::Mat& x) const;
+        // Writes the i-th descriptor back into a CV_32F matrix, which is how
+        // all distances but the Frobenius one get to use it.
+        void dequantize(std::size_t i, cv::Mat& out) const;
+
+        // (De)serialization as a single n x (rows*cols) matrix plus the scale.
+        cv::Mat packed() const;
+        void unpack(const cv::Mat& packed, unsigned rows, float scale);
+        float scale() const { return _scale; }
+        unsigned rows() const { return _rows; }
+
+        static Precision parse(std::string name);
+        static std::string name(Precision prec);
+
+    protected:
+        Precision _prec;
+        std::size_t _n;
+        unsigned _rows;
+        unsigned _len;
+        float _scale;
+        std::vector<uint8_t> _data;
+    };
+
+    void test_quant();
+
+} // namespace warco
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <string>
+
+#include "json/json.h"
+
+#include "mainutils.hpp"
+#include "warco.hpp"
+
+int main(int argc, char** argv)
+{
+    if(argc != 5) {
+        std::cout << "Usage: " << argv[0] << " CONF_FILE MODEL_NAME PRECISION OUT_MODEL_NAME" << std::endl;
+        std::cout << std::endl;
+        std::cout << "CONF_FILE      Path to the JSON config file describing the dataset." << std::endl;
+        std::cout << "               Its test set is used to report the accuracy change." << std::endl;
+        std::cout << "MODEL_NAME     Name of the model which should be loaded. Is a directory." << std::endl;
+        std::cout << "PRECISION      One of fp32, fp16 or int8." << std::endl;
+        std::cout << "OUT_MODEL_NAME Name of the quantized model which should be saved. Is a directory." << std::endl;
+        return 0;
+    }
+
+    std::cout << "Loading the model... " << std::flush;
+    Json::Value dataset = warco::readJson(argv[1]);
+    warco::Warco orig(argv[2]);
+    warco::Warco quant(argv[2]);
+    quant.quantize(argv[3]);
+    std::cout << "Done." << std::endl;
+
+    std::cout << "Descriptors: " << orig.descr_bytes()/(1024.*1024.) << " MB -> "
+              << quant.descr_bytes()/(1024.*1024.) << " MB ("
+              << static_cast<double>(orig.descr_bytes())/quant.descr_bytes() << "x smaller)" << std::endl;
+
+    std::cout << "Testing" << std::flush;
+    unsigned correct_orig = 0, correct_quant = 0, total = 0;
+    warco::foreach_img(dataset, "test", [&](unsigned lbl, const cv::Mat& image, std::string) {
+        std::cout << "." << std::flush;
+
+        correct_orig += orig.predict_proba(image) == lbl;
+        correct_quant += quant.predict_proba(image) == lbl;
+        ++total;
+    });
+
+    double score_orig = 100.0*correct_orig/total, score_quant = 100.0*correct_quant/total;
+    std::cout << std::endl << "score: " << score_orig << "% -> " << score_quant << "% ("
+              << (score_quant >= score_orig ? "+" : "") << score_quant - score_orig << ")" << std::endl;
+
+    std::cout << "Saving the model... " << std::flush;
+    quant.save(argv[4]);
+    std::cout << "Done." << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "samples.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#include "cvutils.hpp"
+
+warco::SampleStore::SampleStore()
+    : _rows(0)
+    , _cols(0)
+    , _stride(0)
+{ }
+
+warco::SampleStore::SampleStore(const SampleStore& other)
+    : _rows(0)
+    , _cols(0)
+    , _stride(0)
+{
+    *this = other;
+}
+
+warco::SampleStore& warco::SampleStore::operator=(const SampleStore& other)
+{
+    // Only the rows it has, such that growing doesn't write into the ones
+    // `other` may still append.
+    _block = other._block.empty() ? cv::Mat() : other._block.rowRange(0, other.size());
+    _rows = other._rows;
+    _cols = other._cols;
+    _stride = other._stride;
+    _mats = other._mats;
+    _lbls = other._lbls;
+    return *this;
+}
+
+void warco::SampleStore::push_back(const cv::Mat& sample, double label)
+{
+    if(_block.empty()) {
+        _rows = sample.rows;
+        _cols = sample.cols;
+
+        // Rows padded to 64 bytes, if the element size allows.
+        const std::size_t elem = sample.elemSize(), len = sample.total();
+        _stride = 64 % elem == 0 ? (len*elem + 63) / 64 * 64 / elem : len;
+        this->reserve(SAMPLE_CHUNK, sample.type());
+    } else if(sample.rows != _rows || sample.cols != _cols || sample.type() != _block.type()) {
+        throw std::runtime_error("All samples of a patch need to be of the same size and type.");
+    }
+
+    const std::size_t n = this->size();
+    if(n == static_cast<std::size_t>(_block.rows))
+        this->reserve(n + std::max<std::size_t>(SAMPLE_CHUNK, n/2), _block.type());
+
+    cv::Mat dst(_rows, _cols, _block.type(), _block.ptr(n));
+    sample.copyTo(dst);
+    _mats.push_back(dst);
+    _lbls.push_back(label);
+}
+
+void warco::SampleStore::append(const SampleStore& other)
+{
+    for(std::size_t i = 0 ; i < other.size() ; ++i)
+        this->push_back(other[i], other.label(i));
+}
+
+void warco::SampleStore::select(const std::vector<int>& idx)
+{
+    SampleStore kept;
+    for(int i : idx)
+        kept.push_back(_mats[i], _lbls[i]);
+    kept.shrink_to_fit();
+    *this = kept;
+}
+
+void warco::SampleStore::transform(std::function<void(cv::Mat&)> fn)
+{
+    // Into a new block, as this one may be shared.
+    SampleStore out;
+    for(std::size_t i = 0 ; i < this->size() ; ++i) {
+        cv::Mat s = _mats[i].clone();
+        fn(s);
+        out.push_back(s, _lbls[i]);
+    }
+    out.shrink_to_fit();
+    *this = out;
+}
+
+void warco::SampleStore::wrap(const cv::Mat& block, int rows, const std::vector<double>& labels)
+{
+    this->clear();
+    if(block.rows == 0)
+        return;
+
+    _block = block;
+    _rows = rows;
+    _cols = block.cols / rows;
+    _stride = block.step[0] / block.elemSize();
+    _lbls = labels.empty() ? std::vector<double>(block.rows, 0.0) : labels;
+    this->rebuild_mats();
+}
+
+void warco::SampleStore::shrink_to_fit()
+{
+    if(this->empty())
+        this->clear();
+    else if(this->size() < static_cast<std::size_t>(_block.rows))
+        this->reserve(this->size(), _block.type());
+
+    std::vector<cv::Mat>(_mats).swap(_mats);
+    std::vector<double>(_lbls).swap(_lbls);
+}
+
+void warco::SampleStore::clear()
+{
+    _block.release();
+    _rows = _cols = _stride = 0;
+    _mats.clear();
+    _lbls.clear();
+}
+
+cv::Mat warco::SampleStore::block() const
+{
+    if(this->empty())
+        return cv::Mat();
+
+    return _block(cv::Range(0, this->size()), cv::Range(0, _rows*_cols));
+}
+
+std::size_t warco::SampleStore::bytes() const
+{
+    return _block.rows*_block.step[0] + _mats.capacity()*sizeof(cv::Mat) + _lbls.capacity()*sizeof(double);
+}
+
+void warco::SampleStore::reserve(std::size_t n, int type)
+{
+    cv::Mat grown(n, _stride, type);
+    if(! this->empty()) {
+        cv::Mat dst = grown(cv::Range(0, this->size()), cv::Range(0, _rows*_cols));
+        this->block().copyTo(dst);
+    }
+    _block = grown;
+    this->rebuild_mats();
+}
+
+void warco::SampleStore::rebuild_mats()
+{
+    _mats.resize(_lbls.size());
+    for(std::size_t i = 0 ; i < _mats.size() ; ++i)
+        _mats[i] = cv::Mat(_rows, _cols, _block.type(), _block.ptr(i));
+}
+
+void warco::test_samples()
+{
+    std::cout << "Sample store... " << std::flush;
+
+    // Enough to grow a few times.
+    const unsigned N = 2*SAMPLE_CHUNK + 123;
+    std::vector<cv::Mat> orig(N);
+    SampleStore s;
+    for(unsigned i = 0 ; i < N ; ++i) {
+        orig[i] = randspd(5, 5);
+        s.push_back(orig[i], i % 3);
+    }
+
+    // A copy, then both growing apart.
+    SampleStore c = s;
+    cv::Mat extra = randspd(5, 5);
+    s.push_back(extra, 7);
+    c.push_back(orig[0], 8);
+
+    bool ok = s.size() == N+1 && c.size() == N+1;
+    for(unsigned i = 0 ; i < N ; ++i) {
+        ok &= cv::norm(s[i], orig[i], cv::NORM_INF) == 0.0 && s.label(i) == i % 3;
+        ok &= cv::norm(c[i], orig[i], cv::NORM_INF) == 0.0 && c.label(i) == i % 3;
+        ok &= reinterpret_cast<std::size_t>(s[i].data) % 64 == reinterpret_cast<std::size_t>(s[0].data) % 64;
+    }
+    ok &= cv::norm(s[N], extra, cv::NORM_INF) == 0.0 && s.label(N) == 7;
+    ok &= cv::norm(c[N], orig[0], cv::NORM_INF) == 0.0 && c.label(N) == 8;
+
+    const cv::Mat b = s.block();
+    ok &= b.rows == static_cast<int>(N+1) && b.cols == 25;
+    ok &= cv::norm(b.row(3), orig[3].reshape(0, 1), cv::NORM_INF) == 0.0;
+
+    s.select({5, 2});
+    ok &= s.size() == 2 && s.label(0) == 5 % 3 && cv::norm(s[1], orig[2], cv::NORM_INF) == 0.0;
+
+    s.transform([](cv::Mat& m) { m = m.rowRange(0, 2) * 2.0; });
+    ok &= s[0].rows == 2 && cv::norm(s[0], 2.0*orig[5].rowRange(0, 2), cv::NORM_INF) == 0.0;
+
+    SampleStore w;
+    w.wrap(b, 5);
+    ok &= w.size() == N+1 && w[4].data == b.ptr(4) && cv::norm(w[4], orig[4], cv::NORM_INF) == 0.0;
+
+    if(! ok) {
+        std::cerr << "Failed! (samples got lost or mixed up)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
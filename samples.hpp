@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace warco {
+
+    // Minimum number of samples a SampleStore grows by.
+    const unsigned SAMPLE_CHUNK = 1024;
+
+    // A patch's samples, i.e. same-shaped descriptors, as the rows of one
+    // contiguous block whose rows are padded to 64 bytes, plus their
+    // labels. It grows by chunks of at least SAMPLE_CHUNK samples, or half
+    // its size. `mats()` are headers onto the rows for code taking lists of
+    // cv::Mat, which don't own anything and are invalidated by the next
+    // modification.
+    //
+    // Rows are only ever appended, never overwritten, such that copies can
+    // share the block. A copy only covers the rows it was made with and gets
+    // its own block once it grows.
+    class SampleStore {
+    public:
+        SampleStore();
+        SampleStore(const SampleStore& other);
+        SampleStore& operator=(const SampleStore& other);
+
+        void push_back(const cv::Mat& sample, double label);
+        void append(const SampleStore& other);
+        // Keeps only the samples `idx`, in that order.
+        void select(const std::vector<int>& idx);
+        // Replaces every sample by what `fn` makes of (a copy of) it. The
+        // results may be of another shape or type, but all the same one.
+        void transform(std::function<void(cv::Mat&)> fn);
+        // Uses the rows of the n x (rows*cols) `block` as they are, without
+        // copying them, e.g. from a memory-mapped file.
+        void wrap(const cv::Mat& block, int rows, const std::vector<double>& labels = {});
+        // Drops the capacity beyond the current samples.
+        void shrink_to_fit();
+        void clear();
+
+        std::size_t size() const { return _mats.size(); }
+        bool empty() const { return _mats.empty(); }
+        const cv::Mat& operator[](std::size_t i) const { return _mats[i]; }
+        const std::vector<cv::Mat>& mats() const { return _mats; }
+        const std::vector<double>& labels() const { return _lbls; }
+        double label(std::size_t i) const { return _lbls[i]; }
+
+        // The samples as the rows of a size() x (rows*cols) matrix, which
+        // isn't continuous if the rows are padded.
+        cv::Mat block() const;
+
+        // Allocated bytes, including headers and labels.
+        std::size_t bytes() const;
+
+    protected:
+        // The allocation, of rows*cols elements padded to `_stride` per row.
+        cv::Mat _block;
+        int _rows;
+        int _cols;
+        int _stride;
+        std::vector<cv::Mat> _mats;
+        std::vector<double> _lbls;
+
+        // Reallocates for `n` samples of `type`.
+        void reserve(std::size_t n, int type);
+        void rebuild_mats();
+    };
+
+    void test_samples();
+
+} // namespace warco
@@ -0,0 +1,319 @@
+#include "tasks.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+// What the calling thread works on: a pool, its deque there, and the depth of
+// the task it runs (-1 when it's not running one).
+static thread_local warco::TaskPool* t_pool = nullptr;
+static thread_local unsigned t_self = 0;
+static thread_local int t_depth = -1;
+
+warco::TaskPool::TaskPool(unsigned nthreads)
+    : _queued(0)
+    , _pending(0)
+    , _next(0)
+    , _events(0)
+    , _stop(false)
+    , _sleeps(0)
+{
+    if(nthreads == 0)
+        nthreads = default_nthreads();
+
+    for(unsigned i = 0 ; i < nthreads ; ++i)
+        _queues.emplace_back(new Queue);
+
+    // The first deque is the one of whoever calls `wait`.
+    for(unsigned i = 1 ; i < nthreads ; ++i)
+        _threads.emplace_back(&TaskPool::work, this, i);
+}
+
+warco::TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        _stop = true;
+    }
+    _cv.notify_all();
+
+    for(auto& t : _threads)
+        t.join();
+}
+
+unsigned warco::TaskPool::default_nthreads()
+{
+#ifdef _OPENMP
+    return std::max(1, omp_get_max_threads());
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+warco::TaskPool* warco::TaskPool::current()
+{
+    return t_pool;
+}
+
+void warco::TaskPool::push(unsigned q, Item item)
+{
+    {
+        std::lock_guard<std::mutex> lock(_queues[q]->m);
+        _queues[q]->items.push_back(std::move(item));
+    }
+    ++_queued;
+}
+
+void warco::TaskPool::notify()
+{
+    // Under the lock, or a sleeper could miss it between checking its
+    // condition and going to sleep. All of them, since e.g. a `fork_join`
+    // waiting for its own tasks can't run a new top-level one.
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        ++_events;
+    }
+    _cv.notify_all();
+}
+
+bool warco::TaskPool::pop(unsigned self, int mindepth, Item& item)
+{
+    // Our own newest task first, it's what we were just working on. Then the
+    // oldest one of the others, i.e. the biggest piece of work they have.
+    const unsigned n = _queues.size();
+    for(unsigned k = 0 ; k < n ; ++k) {
+        Queue& q = *_queues[(self + k) % n];
+        std::lock_guard<std::mutex> lock(q.m);
+
+        if(k == 0) {
+            for(auto it = q.items.rbegin() ; it != q.items.rend() ; ++it) {
+                if(it->depth >= mindepth) {
+                    item = std::move(*it);
+                    q.items.erase(std::next(it).base());
+                    --_queued;
+                    return true;
+                }
+            }
+        } else {
+            for(auto it = q.items.begin() ; it != q.items.end() ; ++it) {
+                if(it->depth >= mindepth) {
+                    item = std::move(*it);
+                    q.items.erase(it);
+                    --_queued;
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+bool warco::TaskPool::run_one(unsigned self, int mindepth)
+{
+    Item item;
+    if(! this->pop(self, mindepth, item))
+        return false;
+
+    const int depth = t_depth;
+    t_depth = item.depth;
+    item.fn();
+    t_depth = depth;
+    return true;
+}
+
+void warco::TaskPool::work(unsigned self)
+{
+    t_pool = this;
+    t_self = self;
+
+    while(true) {
+        if(this->run_one(self, 0))
+            continue;
+
+        std::unique_lock<std::mutex> lock(_m);
+        _cv.wait(lock, [this]() { return _stop || _queued > 0; });
+        if(_stop)
+            return;
+    }
+}
+
+void warco::TaskPool::spawn(Task task)
+{
+    ++_pending;
+    Item item;
+    item.depth = 0;
+    item.fn = [this, task]() {
+        try {
+            task();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(_err_m);
+            if(! _err)
+                _err = std::current_exception();
+        }
+        --_pending;
+        this->notify();
+    };
+
+    this->push(t_pool == this ? t_self : _next++ % _queues.size(), std::move(item));
+    this->notify();
+}
+
+void warco::TaskPool::wait()
+{
+    TaskPool* pool = t_pool;
+    const unsigned self = t_self;
+    const int depth = t_depth;
+    t_pool = this;
+    t_self = 0;
+    t_depth = -1;
+
+    while(_pending > 0) {
+        const unsigned long seen = _events;
+        if(this->run_one(0, 0))
+            continue;
+
+        ++_sleeps;
+        std::unique_lock<std::mutex> lock(_m);
+        _cv.wait(lock, [this, seen]() { return _pending == 0 || _events != seen; });
+    }
+
+    t_pool = pool;
+    t_self = self;
+    t_depth = depth;
+
+    std::exception_ptr err;
+    {
+        std::lock_guard<std::mutex> lock(_err_m);
+        std::swap(err, _err);
+    }
+    if(err)
+        std::rethrow_exception(err);
+}
+
+void warco::TaskPool::fork_join(int n, const std::function<void(int)>& body)
+{
+    if(n <= 0)
+        return;
+
+    // Everything below lives on this stack frame, which is fine since we
+    // don't leave it before the last task is done, exceptions or not.
+    std::atomic<int> left(n);
+    std::mutex err_m;
+    std::exception_ptr err;
+    auto run = [&](int i) {
+        try {
+            body(i);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(err_m);
+            if(! err)
+                err = std::current_exception();
+        }
+
+        // Once `left` is 0, this frame may be gone, along with `run`.
+        TaskPool* pool = this;
+        --left;
+        pool->notify();
+    };
+
+    // Pushed backwards, so we take them in order while thieves take the
+    // other end. The first one we run right away.
+    const int depth = t_depth + 1;
+    for(int i = n-1 ; i > 0 ; --i) {
+        Item item;
+        item.depth = depth;
+        item.fn = [&run, i]() { run(i); };
+        this->push(t_self, std::move(item));
+    }
+    if(n > 1)
+        this->notify();
+
+    const int outer = t_depth;
+    t_depth = depth;
+    run(0);
+    t_depth = outer;
+
+    // Only helping with tasks at least as nested as ours, because picking up
+    // e.g. another whole patch would keep us from returning until it's done.
+    while(left > 0) {
+        const unsigned long seen = _events;
+        if(this->run_one(t_self, depth))
+            continue;
+
+        ++_sleeps;
+        std::unique_lock<std::mutex> lock(_m);
+        _cv.wait(lock, [this, &left, seen]() { return left == 0 || _events != seen; });
+    }
+
+    if(err)
+        std::rethrow_exception(err);
+}
+
+void warco::test_tasks()
+{
+    std::cout << "Work-stealing tasks... " << std::flush;
+
+    bool ok = true;
+    {
+        TaskPool pool(4);
+        std::atomic<long> count(0);
+        std::vector<long> sums(16, 0);
+        for(int t = 0 ; t < 16 ; ++t) {
+            pool.spawn([&, t]() {
+                std::vector<long> part(50, 0);
+                parallel_for(50, 0, [&](int i) {
+                    parallel_for(10, 0, [&](int) { ++count; });
+                    part[i] = t + i;
+                });
+                for(long p : part)
+                    sums[t] += p;
+            });
+        }
+        pool.wait();
+
+        ok &= count == 16*50*10;
+        for(int t = 0 ; t < 16 ; ++t)
+            ok &= sums[t] == 50*t + 49*50/2;
+
+        // Exceptions of nested tasks make it to `wait`, the pool survives.
+        pool.spawn([]() {
+            parallel_for(8, 0, [](int i) {
+                if(i == 5)
+                    throw std::runtime_error("expected");
+            });
+        });
+        try {
+            pool.wait();
+            ok = false;
+        } catch(const std::runtime_error&) { }
+
+        pool.spawn([&count]() { ++count; });
+        pool.wait();
+        ok &= count == 16*50*10 + 1 && TaskPool::current() == nullptr;
+
+        // Waiting for tasks, in `wait` and in `fork_join`, sleeps until some
+        // task got queued or done instead of spinning: each of the (at most
+        // two) waiting threads sleeps once per such event, plus once at the
+        // end. The threads which end up waiting run their share quicker,
+        // leaving the others time to steal theirs.
+        const unsigned long events0 = pool._events, sleeps0 = pool._sleeps;
+        const auto waiter = std::this_thread::get_id();
+        pool.spawn([waiter]() {
+            const auto joiner = std::this_thread::get_id();
+            parallel_for(8, 0, [waiter, joiner](int) {
+                const auto me = std::this_thread::get_id();
+                std::this_thread::sleep_for(std::chrono::milliseconds(me == waiter || me == joiner ? 5 : 100));
+            });
+        });
+        pool.wait();
+        ok &= pool._sleeps - sleeps0 <= 2*(pool._events - events0 + 1);
+    }
+
+    if(! ok) {
+        std::cerr << "Failed! (tasks went missing, ran more than once, or were waited for busily)" << std::endl;
+        throw std::runtime_error("Test assertion failed.");
+    }
+
+    std::cout << "SUCCESS" << std::endl;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+namespace warco {
+
+    // A fixed set of threads, each with its own deque of tasks. A worker
+    // runs the newest task of its own deque and, once that's empty, steals
+    // the oldest one of another's. Tasks may fork nested tasks with
+    // `fork_join`, whose worker doesn't block meanwhile but runs nested tasks
+    // too, such that the stages of all patches' trainings share the cores
+    // without one thread per nesting level.
+    class TaskPool {
+    public:
+        typedef std::function<void()> Task;
+
+        // 0 threads means OpenMP's default, or else the number of cores.
+        explicit TaskPool(unsigned nthreads = 0);
+        ~TaskPool();
+
+        // Queues a top-level task: on the caller's own deque if it's one of
+        // the workers, or else round-robin on all of them.
+        void spawn(Task task);
+        // Works as one of the workers until all spawned tasks are done, then
+        // rethrows the first exception any of them threw.
+        void wait();
+
+        // Runs body(0..n-1) as tasks nested in the current one and returns
+        // once they're all done, rethrowing the first exception of those.
+        void fork_join(int n, const std::function<void(int)>& body);
+
+        unsigned nthreads() const { return _queues.size(); }
+
+        // The pool the calling thread currently works for, if any.
+        static TaskPool* current();
+        // How many threads a pool of 0 threads gets.
+        static unsigned default_nthreads();
+
+    protected:
+        friend void test_tasks();
+
+        TaskPool(const TaskPool&) = delete;
+        TaskPool& operator=(const TaskPool&) = delete;
+
+        struct Item {
+            Task fn;
+            // How deeply nested the task is, 0 for spawned ones.
+            int depth;
+        };
+
+        struct Queue {
+            std::mutex m;
+            std::deque<Item> items;
+        };
+
+        // Queues it without waking anyone yet, see `notify`.
+        void push(unsigned q, Item item);
+        bool pop(unsigned self, int mindepth, Item& item);
+        // Wakes everyone sleeping on `_cv` after tasks got queued or done.
+        void notify();
+        bool run_one(unsigned self, int mindepth);
+        void work(unsigned self);
+
+        std::vector<std::unique_ptr<Queue>> _queues;
+        std::vector<std::thread> _threads;
+
+        // Queued, and spawned but not finished, tasks.
+        std::atomic<long> _queued;
+        std::atomic<long> _pending;
+        std::atomic<unsigned> _next;
+
+        // Idle workers sleep on this, and so do `wait` and `fork_join` until
+        // `_events` changes, i.e. until some task got queued or done. It's
+        // only changed under `_m`.
+        std::mutex _m;
+        std::condition_variable _cv;
+        std::atomic<unsigned long> _events;
+        bool _stop;
+        // How often `wait` and `fork_join` went to sleep, for test_tasks.
+        std::atomic<unsigned long> _sleeps;
+
+        std::mutex _err_m;
+        std::exception_ptr _err;
+    };
+
+    // Runs body(i) for i in [0, n): as nested tasks of the current TaskPool
+    // when called from one of its workers, or else in an OpenMP loop of
+    // `nthreads` threads (0 meaning OpenMP's default).
+    template<typename Fn>
+    void parallel_for(int n, unsigned nthreads, Fn body)
+    {
+        if(TaskPool* pool = TaskPool::current())
+            return pool->fork_join(n, body);
+
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) num_threads(nthreads ? nthreads : omp_get_max_threads())
+#endif
+        for(int i = 0 ; i < n ; ++i)
+            body(i);
+    }
+
+    void test_tasks();
+
+} // namespace warco
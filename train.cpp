@@ -6,37 +6,69 @@
 #include "dists.hpp"
 #include "filterbank.hpp"
 #include "mainutils.hpp"
+#include "model.hpp"
 #include "warco.hpp"
 
 int main(int argc, char** argv)
 {
-    if(argc != 3) {
-        std::cout << "Usage: " << argv[0] << " CONF_FILE MODEL_NAME" << std::endl;
+    if(argc != 3 && argc != 4) {
+        std::cout << "Usage: " << argv[0] << " CONF_FILE MODEL_NAME [BASE_MODEL]" << std::endl;
         std::cout << std::endl;
         std::cout << "CONF_FILE  Path to the JSON config file describing the dataset." << std::endl;
         std::cout << "MODEL_NAME Name of the model which should be save. Is a directory." << std::endl;
+        std::cout << "BASE_MODEL Model trained with \"keep_dists\" to which the dataset's" << std::endl;
+        std::cout << "           training images are added, instead of training from scratch." << std::endl;
         return 0;
     }
 
     Json::Value dataset = warco::readJson(argv[1]);
+    auto opts = warco::readTrainOpts(dataset);
+
+    if(argc == 4) {
+        warco::Warco model(argv[3]);
+
+        std::cout << "Loading new images... " << std::flush;
+        warco::addSamples(model, dataset, "train");
+        std::cout << "Done" << std::endl;
+
+        std::cout << "Training " << argv[3] << " incrementally" << std::flush;
+        double avg_train = model.train_incremental(opts, [](){ std::cout << "." << std::flush; });
+        std::cout << std::endl << "Average training score *per patch*: " << avg_train << std::endl;
+
+        std::cout << "Saving the model... " << std::flush;
+        model.save(argv[2]);
+        std::cout << "Done. Cya in predictions!" << std::endl;
+        return 0;
+    }
+
     auto patches = warco::readPatches(dataset);
     auto fb = cv::FilterBank(dataset["filterbank"].asCString());
     auto dfn = dataset.get("dist", "cbh").asString();
     warco::Warco model(fb, patches, dfn);
 
     std::cout << "Loading images... " << std::flush;
-    warco::foreach_img(dataset, "train", [&model](unsigned lbl, const cv::Mat& image, std::string) {
-        model.add_sample(image, lbl);
-    });
+    warco::addSamples(model, dataset, "train");
     std::cout << "Done" << std::endl;
 
     auto C = warco::readCrossvalCs(dataset);
     std::cout << "Training model with:" << std::endl
         << "- filterbank: " << dataset["filterbank"].asString() << std::endl
         << "- distance: " << dfn << std::endl
-        << "- #patches: " << patches.size() << std::endl;
-    double avg_train = model.train(C, [](){ std::cout << "." << std::flush; });
+        << "- model: " << opts.model << std::endl
+        << "- #patches: " << patches.size() << std::endl
+        << "- predicted peak memory: " << (model.train_peak(C, opts) >> 20) << " MB";
+    if(opts.max_train_mb)
+        std::cout << " (budget " << opts.max_train_mb << " MB)";
+    std::cout << std::endl;
+    double avg_train = model.train(C, opts, [](){ std::cout << "." << std::flush; });
     std::cout << std::endl << "Average training score *per patch*: " << avg_train << std::endl;
+    if(opts.knn && opts.knn_check) {
+        auto acc = model.knn_accuracy();
+        std::cout << "kNN kernel cross-validated on a subsample: " << acc.second
+                  << " vs. " << acc.first << " for the dense one, *per patch*" << std::endl;
+    }
+    if(model.npatches() != patches.size())
+        std::cout << "Kept " << model.npatches() << " of the " << patches.size() << " patches within the budget." << std::endl;
 
     std::cout << "Saving the model... " << std::flush;
     model.save(argv[2]);
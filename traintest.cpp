@@ -5,6 +5,7 @@
 
 #include "filterbank.hpp"
 #include "mainutils.hpp"
+#include "model.hpp"
 #include "warco.hpp"
 
 int main(int argc, char** argv)
@@ -20,17 +21,17 @@ int main(int argc, char** argv)
     auto dfn = dataset.get("dist", "cbh").asString();
     warco::Warco model(fb, patches, dfn);
     std::cout << "Loading images... " << std::flush;
-    warco::foreach_img(dataset, "train", [&model](unsigned lbl, const cv::Mat& image, std::string) {
-        model.add_sample(image, lbl);
-    });
+    warco::addSamples(model, dataset, "train");
     std::cout << "Done" << std::endl;
 
+    auto C = warco::readCrossvalCs(dataset);
+    auto opts = warco::readTrainOpts(dataset);
     std::cout << "Training model with:" << std::endl
         << "- filterbank: " << dataset["filterbank"].asString() << std::endl
         << "- distance: " << dfn << std::endl
+        << "- model: " << opts.model << std::endl
         << "- #patches: " << patches.size() << std::endl;
-    auto C = warco::readCrossvalCs(dataset);
-    double avg_train = model.train(C, [](){ std::cout << "." << std::flush; });
+    double avg_train = model.train(C, opts, [](){ std::cout << "." << std::flush; });
     std::cout << std::endl << "Average training score *per patch*: " << avg_train << std::endl;
 
     std::cout << "Testing" << std::flush;
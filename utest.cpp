@@ -6,10 +6,20 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "binmodel.hpp"
+#include "compiled.hpp"
 #include "covcorr.hpp"
 #include "cvutils.hpp"
+#include "distcache.hpp"
 #include "dists.hpp"
+#include "featmap.hpp"
+#include "gram.hpp"
+#include "knn.hpp"
+#include "lazymodel.hpp"
 #include "model.hpp"
+#include "quant.hpp"
+#include "samples.hpp"
+#include "tasks.hpp"
 
 int main(int argc, char** argv)
 {
@@ -18,10 +28,20 @@ int main(int argc, char** argv)
     cv::theRNG().state = seed;
     srand(seed);
 
+    warco::test_binmodel();
+    warco::test_compiled();
     warco::test_cv_utils();
     warco::test_covcorr();
+    warco::test_distcache();
     warco::test_dists();
+    warco::test_featmap();
+    warco::test_gram();
+    warco::test_knn();
+    warco::test_lazymodel();
     warco::test_model();
+    warco::test_quant();
+    warco::test_samples();
+    warco::test_tasks();
 
     return 0;
 }
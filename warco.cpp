@@ -1,14 +1,28 @@
 #include "warco.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <numeric>
 #include <stdexcept>
 
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
 // Only for resize.
 #include <opencv2/imgproc.hpp>
 
+#include "binmodel.hpp"
 #include "covcorr.hpp"
 #include "features.hpp"
+#include "gram.hpp"
+#include "lazymodel.hpp"
 #include "model.hpp"
+#include "tasks.hpp"
 #include "to_s.hpp"
 
 #ifndef NDEBUG
@@ -18,7 +32,13 @@
 warco::Warco::Patch::Patch(double x, double y, double w, double h, std::string distfname, double weight)
     : weight(weight)
     , x(x), y(y), w(w), h(h)
-    , model(new PatchModel(distfname))
+    , model(std::make_shared<LazyModel>(std::make_shared<PatchModel>(distfname)))
+{ }
+
+warco::Warco::Patch::Patch(double x, double y, double w, double h, std::function<void(PatchModel&)> loader, double weight)
+    : weight(weight)
+    , x(x), y(y), w(w), h(h)
+    , model(std::make_shared<LazyModel>(loader))
 { }
 
 warco::Warco::Warco(cv::FilterBank fb, const std::vector<warco::Patch>& patches, std::string distfname)
@@ -28,9 +48,9 @@ warco::Warco::Warco(cv::FilterBank fb, const std::vector<warco::Patch>& patches,
         _patchmodels.push_back(Patch(p.x, p.y, p.w, p.h, distfname));
 }
 
-warco::Warco::Warco(std::string name)
+warco::Warco::Warco(std::string name, bool lazy)
 {
-    this->load(name);
+    this->load(name, lazy);
 }
 
 warco::Warco::~Warco()
@@ -39,34 +59,130 @@ warco::Warco::~Warco()
 void warco::Warco::add_sample(const cv::Mat& img, unsigned label)
 {
     this->foreach_model(img, [label](const Patch& patch, cv::Mat& corr) {
-        patch.model->add_sample(corr, label);
+        patch.model->own()->add_sample(corr, label);
     });
 }
 
-double warco::Warco::train(const std::vector<double>& cvC, std::function<void()> progress)
+void warco::Warco::add_samples(const std::vector<cv::Mat>& imgs, const std::vector<unsigned>& labels)
 {
-    double w_tot = 0.0;
+    if(imgs.size() != labels.size())
+        throw std::runtime_error("Got " + to_s(imgs.size()) + " images but " + to_s(labels.size()) + " labels.");
+
+    // Each patch gets its samples in the images' order, no matter which
+    // thread computed them, so the training is the same as one by one.
+    auto corrs = this->corrs_batch(imgs);
+
+    const int s = _patchmodels.size();
 #ifdef _OPENMP
-    const unsigned s = _patchmodels.size();
-    #pragma omp parallel for reduction(+:w_tot)
-    for(unsigned i = 0 ; i < s ; ++i) {
-        auto& patch = _patchmodels[i];
-#else
-    for(auto& patch : _patchmodels) {
+    #pragma omp parallel for schedule(dynamic)
 #endif
-        if(patch.model->prepare())
+    for(int j = 0 ; j < s ; ++j) {
+        auto model = _patchmodels[j].model->own();
+        for(std::size_t i = 0 ; i < imgs.size() ; ++i)
+            model->add_sample(corrs[j][i], labels[i]);
+    }
+}
+
+std::vector<std::size_t> warco::Warco::train_peaks(const std::vector<double>& cvC, const TrainOpts& opts, unsigned nthreads) const
+{
+    std::vector<std::size_t> nrvo;
+    for(const auto& patch : _patchmodels)
+        nrvo.push_back(patch.model->get()->train_peak(cvC, opts, nthreads));
+    return nrvo;
+}
+
+std::size_t warco::Warco::train_peak(const std::vector<double>& cvC, const TrainOpts& opts) const
+{
+    // At most one patch per worker allocates at a time, and only as many as
+    // fit in the budget, or the largest one by itself.
+    const unsigned nthreads = TaskPool::default_nthreads();
+    auto peaks = this->train_peaks(cvC, opts, nthreads);
+    std::sort(peaks.rbegin(), peaks.rend());
+
+    std::size_t nrvo = 0;
+    for(std::size_t i = 0 ; i < std::min<std::size_t>(nthreads, peaks.size()) ; ++i)
+        nrvo += peaks[i];
+
+    if(opts.max_train_mb && ! peaks.empty())
+        nrvo = std::max(peaks[0], std::min(nrvo, std::size_t(opts.max_train_mb) << 20));
+    return nrvo;
+}
+
+double warco::Warco::train(const std::vector<double>& cvC, const TrainOpts& opts, std::function<void()> progress)
+{
+    // Each patch is a task, and so are the pieces of its Gram matrix and
+    // cross-validation, which idle workers steal. That keeps all cores busy
+    // until the last patch is done, whatever the number of patches.
+    std::mutex progress_m;
+    TaskPool pool;
+
+    // With a memory budget, patches are only spawned while the sum of their
+    // estimated peaks fits, and each finished one makes room for the next
+    // ones. The cores this leaves idle steal the admitted patches' tasks.
+    const std::size_t budget = std::size_t(opts.max_train_mb) << 20;
+    const std::vector<std::size_t> peaks = budget ? this->train_peaks(cvC, opts, pool.nthreads())
+                                                  : std::vector<std::size_t>(_patchmodels.size(), 0);
+    std::vector<bool> admitted(_patchmodels.size(), false);
+    std::size_t used = 0;
+    std::mutex admit_m;
+
+    std::function<void(std::size_t)> run = [&](std::size_t i) {
+        auto model = _patchmodels[i].model->own();
+        if(model->prepare()) {
+            std::lock_guard<std::mutex> lock(progress_m);
             progress();
+        }
 
-        patch.weight = patch.model->train(cvC);
-        w_tot += patch.weight;
+        _patchmodels[i].weight = model->train(cvC, opts);
 
+        std::lock_guard<std::mutex> lock(progress_m);
         progress();
+    };
+
+    // Spawns all waiting patches which fit, in order. Needs `admit_m`.
+    std::function<void()> admit = [&]() {
+        for(std::size_t i = 0 ; i < _patchmodels.size() ; ++i) {
+            if(admitted[i] || (budget && used > 0 && used + peaks[i] > budget))
+                continue;
+
+            admitted[i] = true;
+            used += peaks[i];
+            pool.spawn([&, i]() {
+                auto release = [&]() {
+                    std::lock_guard<std::mutex> lock(admit_m);
+                    used -= peaks[i];
+                    admit();
+                };
+                try {
+                    run(i);
+                } catch(...) {
+                    release();
+                    throw;
+                }
+                release();
+            });
+        }
+    };
+    {
+        std::lock_guard<std::mutex> lock(admit_m);
+        admit();
+    }
+    pool.wait();
+
+    double w_tot = 0.0;
+    for(const auto& patch : _patchmodels) {
+        w_tot += patch.weight;
     }
 
     for(auto& patch : _patchmodels) {
         patch.weight /= w_tot;
     }
 
+    // The average is over all trained patches, not just the selected ones.
+    const std::size_t ntrained = _patchmodels.size();
+    if(opts.max_patches || opts.max_predict_us > 0.0)
+        this->select_patches(opts);
+
     progress();
 
 #ifndef NDEBUG
@@ -82,7 +198,166 @@ double warco::Warco::train(const std::vector<double>& cvC, std::function<void()>
 #endif
 
     // Return the average error.
-    return w_tot / _patchmodels.size();
+    return w_tot / ntrained;
+}
+
+double warco::Warco::train_incremental(const TrainOpts& opts, std::function<void()> progress)
+{
+    // Same tasks as `train`, but each patch keeps its C and weight.
+    std::vector<double> accs(_patchmodels.size());
+    std::mutex progress_m;
+    TaskPool pool;
+    for(std::size_t i = 0 ; i < _patchmodels.size() ; ++i) {
+        pool.spawn([&, i]() {
+            accs[i] = _patchmodels[i].model->own()->train_incremental(opts);
+
+            std::lock_guard<std::mutex> lock(progress_m);
+            progress();
+        });
+    }
+    pool.wait();
+
+    double acc_tot = 0.0;
+    for(double acc : accs)
+        acc_tot += acc;
+    return acc_tot / _patchmodels.size();
+}
+
+void warco::Warco::select_patches(const TrainOpts& opts)
+{
+    // Greedy forward selection: keep adding the patch which makes for the
+    // most accurate weighted vote on the held-out predictions, as long as
+    // it fits in the budget. Then keep the best of those prefixes.
+    const unsigned s = _patchmodels.size();
+    std::vector<std::shared_ptr<PatchModel>> models(s);
+    for(unsigned i = 0 ; i < s ; ++i)
+        models[i] = _patchmodels[i].model->get();
+
+    const std::vector<double>& truth = models[0]->cv_labels();
+    const unsigned N = truth.size();
+    const unsigned nlbl = 1 + static_cast<unsigned>(*std::max_element(truth.begin(), truth.end()));
+
+    std::vector<double> votes(N*nlbl, 0.0);
+    auto accuracy_with = [&](unsigned i) {
+        const std::vector<double>& pred = models[i]->cv_predictions();
+        unsigned correct = 0;
+        std::vector<double> v(nlbl);
+        for(unsigned n = 0 ; n < N ; ++n) {
+            std::copy(&votes[n*nlbl], &votes[n*nlbl] + nlbl, v.begin());
+            v[static_cast<unsigned>(pred[n])] += _patchmodels[i].weight;
+            correct += std::max_element(v.begin(), v.end()) - v.begin() == truth[n];
+        }
+        return correct / static_cast<double>(N);
+    };
+
+    std::vector<bool> chosen(s, false);
+    std::vector<unsigned> order;
+    double cost = 0.0, best_acc = -1.0;
+    unsigned best_n = 0;
+    while(opts.max_patches == 0 || order.size() < opts.max_patches) {
+        int pick = -1;
+        double pick_acc = -1.0;
+        for(unsigned i = 0 ; i < s ; ++i) {
+            if(chosen[i] || (opts.max_predict_us > 0.0 && cost + models[i]->predict_cost() > opts.max_predict_us))
+                continue;
+
+            // Ties go to the cheaper one.
+            double acc = accuracy_with(i);
+            if(acc > pick_acc || (acc == pick_acc && models[i]->predict_cost() < models[pick]->predict_cost())) {
+                pick = i;
+                pick_acc = acc;
+            }
+        }
+        if(pick < 0)
+            break;
+
+        chosen[pick] = true;
+        order.push_back(pick);
+        cost += models[pick]->predict_cost();
+        const std::vector<double>& pred = models[pick]->cv_predictions();
+        for(unsigned n = 0 ; n < N ; ++n)
+            votes[n*nlbl + static_cast<unsigned>(pred[n])] += _patchmodels[pick].weight;
+
+        if(pick_acc > best_acc) {
+            best_acc = pick_acc;
+            best_n = order.size();
+        }
+    }
+
+    if(best_n == 0)
+        throw std::runtime_error("Not even a single patch fits in the prediction budget.");
+
+    // The weights were each patch's own accuracy, which the ensemble of the
+    // kept ones needn't agree with. So they get re-fitted to that ensemble's
+    // held-out vote, by scaling each one in turn by whichever factor makes
+    // it most accurate, for a few rounds, only ever taking improvements.
+    std::vector<bool> keep(s, false);
+    std::vector<double> w(s, 0.0);
+    std::fill(votes.begin(), votes.end(), 0.0);
+    for(unsigned k = 0 ; k < best_n ; ++k) {
+        const unsigned i = order[k];
+        keep[i] = true;
+        w[i] = _patchmodels[i].weight;
+        const std::vector<double>& pred = models[i]->cv_predictions();
+        for(unsigned n = 0 ; n < N ; ++n)
+            votes[n*nlbl + static_cast<unsigned>(pred[n])] += w[i];
+    }
+    auto vote_accuracy = [&]() {
+        unsigned correct = 0;
+        for(unsigned n = 0 ; n < N ; ++n)
+            correct += std::max_element(&votes[n*nlbl], &votes[n*nlbl] + nlbl) - &votes[n*nlbl] == truth[n];
+        return correct / static_cast<double>(N);
+    };
+    auto add_votes = [&](unsigned i, double dw) {
+        const std::vector<double>& pred = models[i]->cv_predictions();
+        for(unsigned n = 0 ; n < N ; ++n)
+            votes[n*nlbl + static_cast<unsigned>(pred[n])] += dw;
+    };
+
+    best_acc = vote_accuracy();
+    for(unsigned round = 0 ; round < 3 ; ++round) {
+        bool improved = false;
+        for(unsigned k = 0 ; k < best_n ; ++k) {
+            const unsigned i = order[k];
+            for(double f : {0.5, 0.8, 1.25, 2.0}) {
+                add_votes(i, (f - 1.0)*w[i]);
+                const double acc = vote_accuracy();
+                if(acc > best_acc) {
+                    best_acc = acc;
+                    w[i] *= f;
+                    improved = true;
+                } else {
+                    add_votes(i, (1.0 - f)*w[i]);
+                }
+            }
+        }
+        if(! improved)
+            break;
+    }
+
+    // Keep them in their original order, with re-normalized weights.
+    std::vector<Patch> kept;
+    double w_tot = 0.0;
+    for(unsigned i = 0 ; i < s ; ++i) {
+        if(keep[i]) {
+            kept.push_back(_patchmodels[i]);
+            kept.back().weight = w[i];
+            w_tot += w[i];
+        }
+    }
+    for(auto& patch : kept)
+        patch.weight /= w_tot;
+    _patchmodels.swap(kept);
+
+#ifndef NDEBUG
+    if(getenv("WARCO_DEBUG")) {
+        double us = 0.0;
+        for(unsigned i = 0 ; i < best_n ; ++i)
+            us += models[order[i]]->predict_cost();
+        std::cout << "Kept " << best_n << " of " << s << " patches (~" << us << "us), "
+                  << "held-out ensemble accuracy " << 100.*best_acc << "%" << std::endl;
+    }
+#endif
 }
 
 unsigned warco::Warco::predict(const cv::Mat& img) const
@@ -90,7 +365,7 @@ unsigned warco::Warco::predict(const cv::Mat& img) const
     std::vector<double> votes(this->nlbl(), 0.0);
 
     this->foreach_model(img, [&votes](const Patch& patch, cv::Mat& corr) {
-        unsigned pred = patch.model->predict(corr);
+        unsigned pred = patch.model->get()->predict(corr);
 
 #ifdef _OPENMP
         #pragma omp critical
@@ -119,7 +394,7 @@ unsigned warco::Warco::predict_proba(const cv::Mat& img) const
     std::vector<double> probas(this->nlbl(), 0.0);
 
     this->foreach_model(img, [&probas](const Patch& patch, cv::Mat& corr) {
-        auto pred = patch.model->predict_probas(corr);
+        auto pred = patch.model->get()->predict_probas(corr);
 
 #ifdef _OPENMP
         #pragma omp critical
@@ -144,9 +419,180 @@ unsigned warco::Warco::predict_proba(const cv::Mat& img) const
     return std::max_element(begin(probas), end(probas)) - begin(probas);
 }
 
+std::vector<unsigned> warco::Warco::predict_batch(const std::vector<cv::Mat>& imgs) const
+{
+    // Each patch's predictions go to their own place, and are only summed
+    // up afterwards, in patch order, such that it's the same as `predict`.
+    const unsigned n = imgs.size();
+    std::vector<unsigned> preds(_patchmodels.size()*n);
+    this->foreach_model_batch(imgs, [&preds, n](unsigned ipatch, const Patch& patch, std::vector<cv::Mat>& corrs, unsigned first) {
+        auto pred = patch.model->get()->predict_batch(corrs);
+        std::copy(pred.begin(), pred.end(), preds.begin() + ipatch*n + first);
+    });
+
+    const unsigned nlbl = n ? this->nlbl() : 0;
+    std::vector<unsigned> nrvo(n);
+    for(unsigned i = 0 ; i < n ; ++i) {
+        std::vector<double> votes(nlbl, 0.0);
+        for(unsigned p = 0 ; p < _patchmodels.size() ; ++p)
+            votes[preds[p*n + i]] += _patchmodels[p].weight;
+        nrvo[i] = std::max_element(begin(votes), end(votes)) - begin(votes);
+    }
+
+    return nrvo;
+}
+
+std::vector<unsigned> warco::Warco::predict_proba_batch(const std::vector<cv::Mat>& imgs, std::vector<std::vector<double>>* probas) const
+{
+    const unsigned n = imgs.size();
+    std::vector<std::vector<double>> preds(_patchmodels.size()*n);
+    this->foreach_model_batch(imgs, [&preds, n](unsigned ipatch, const Patch& patch, std::vector<cv::Mat>& corrs, unsigned first) {
+        auto pred = patch.model->get()->predict_probas_batch(corrs);
+        std::move(pred.begin(), pred.end(), preds.begin() + ipatch*n + first);
+    });
+
+    const unsigned nlbl = n ? this->nlbl() : 0;
+    std::vector<std::vector<double>> sums(n, std::vector<double>(nlbl, 0.0));
+    std::vector<unsigned> nrvo(n);
+    for(unsigned i = 0 ; i < n ; ++i) {
+        for(unsigned p = 0 ; p < _patchmodels.size() ; ++p)
+            for(unsigned l = 0 ; l < nlbl ; ++l)
+                sums[i][l] += preds[p*n + i][l] * _patchmodels[p].weight;
+        nrvo[i] = std::max_element(begin(sums[i]), end(sums[i])) - begin(sums[i]);
+    }
+
+    if(probas)
+        probas->swap(sums);
+
+    return nrvo;
+}
+
+unsigned warco::Warco::predict_cascade(const cv::Mat& img, const CascadeOpts& opts, CascadeInfo* info) const
+{
+    auto t0 = std::chrono::steady_clock::now();
+
+    // TODO: take the actual size out of config.
+    cv::Mat img50 = img;
+    if(img.cols != 50 || img.rows != 50) {
+        resize(img, img50, cv::Size(50, 50));
+    }
+    auto feats = warco::mkfeats(img50, _fb);
+
+    const int s = _patchmodels.size();
+    std::vector<int> order(s);
+    double remaining = 0.0;
+    for(int i = 0 ; i < s ; ++i) {
+        order[i] = i;
+        remaining += _patchmodels[i].weight;
+    }
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+        return _patchmodels[a].weight > _patchmodels[b].weight;
+    });
+
+    // Evaluated in waves of as many patches as there are threads, such that
+    // a single prediction still uses them all.
+#ifdef _OPENMP
+    const int wave = omp_get_max_threads();
+#else
+    const int wave = 1;
+#endif
+
+    std::vector<double> votes(this->nlbl(), 0.0);
+    CascadeInfo nrvo = {CascadeInfo::ALL, 0};
+    for(int first = 0 ; first < s ; first += wave) {
+        const int last = std::min(s, first + wave);
+        std::vector<std::vector<double>> preds(last - first);
+#ifdef _OPENMP
+        #pragma omp parallel for
+#endif
+        for(int k = first ; k < last ; ++k) {
+            const auto& p = _patchmodels[order[k]];
+            cv::Mat corr = extract_corr(feats, p.x*img50.cols, p.y*img50.rows, p.w*img50.cols, p.h*img50.rows);
+            auto model = p.model->get();
+            if(opts.probas) {
+                preds[k - first] = model->predict_probas(corr);
+            } else {
+                preds[k - first].assign(votes.size(), 0.0);
+                preds[k - first][model->predict(corr)] = 1.0;
+            }
+        }
+
+        // Serially, to keep the sums deterministic.
+        for(int k = first ; k < last ; ++k) {
+            const double w = _patchmodels[order[k]].weight;
+            for(unsigned l = 0 ; l < votes.size() ; ++l)
+                votes[l] += preds[k - first][l] * w;
+            remaining -= w;
+        }
+        nrvo.nevaluated = last;
+        if(last == s)
+            break;
+
+        // Even if all of the remaining weight went to the runner-up, it'd
+        // still be behind.
+        std::vector<double> top(votes);
+        std::partial_sort(top.begin(), top.begin() + std::min<std::size_t>(2, top.size()), top.end(), std::greater<double>());
+        const double lead = top.size() > 1 ? top[0] - top[1] : top[0];
+        if(lead > remaining) {
+            nrvo.exit = CascadeInfo::DECIDED;
+            break;
+        }
+
+        const double done = std::accumulate(votes.begin(), votes.end(), 0.0);
+        if(opts.margin > 0.0 && done > 0.0 && lead/done >= opts.margin) {
+            nrvo.exit = CascadeInfo::MARGIN;
+            break;
+        }
+
+        if(opts.deadline_us > 0.0 && std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() >= opts.deadline_us) {
+            nrvo.exit = CascadeInfo::DEADLINE;
+            break;
+        }
+    }
+
+    if(info)
+        *info = nrvo;
+
+    // argmax
+    return std::max_element(begin(votes), end(votes)) - begin(votes);
+}
+
 unsigned warco::Warco::nlbl() const
 {
-    return _patchmodels.front().model->nlbls();
+    return _patchmodels.front().model->get()->nlbls();
+}
+
+void warco::Warco::quantize(std::string precision)
+{
+    for(auto& patch : _patchmodels)
+        patch.model->own()->quantize(precision);
+}
+
+std::size_t warco::Warco::descr_bytes() const
+{
+    std::size_t nrvo = 0;
+    for(const auto& patch : _patchmodels)
+        nrvo += patch.model->get()->descr_bytes();
+    return nrvo;
+}
+
+std::pair<double, double> warco::Warco::knn_accuracy() const
+{
+    std::pair<double, double> nrvo(0.0, 0.0);
+    for(const auto& patch : _patchmodels) {
+        const auto& acc = patch.model->get()->knn_accuracy();
+        nrvo.first += acc.first / _patchmodels.size();
+        nrvo.second += acc.second / _patchmodels.size();
+    }
+    return nrvo;
+}
+
+std::vector<std::size_t> warco::Warco::footprints() const
+{
+    std::vector<std::size_t> nrvo;
+    for(const auto& patch : _patchmodels)
+        nrvo.push_back(patch.model->footprint());
+    return nrvo;
 }
 
 void warco::Warco::foreach_model(const cv::Mat& img, std::function<void(const Patch& patch, cv::Mat& corr)> fn) const
@@ -172,8 +618,57 @@ void warco::Warco::foreach_model(const cv::Mat& img, std::function<void(const Pa
     }
 }
 
-void warco::Warco::load(std::string name)
+std::vector<std::vector<cv::Mat>> warco::Warco::corrs_batch(const std::vector<cv::Mat>& imgs) const
+{
+    const int n = imgs.size(), s = _patchmodels.size();
+
+    std::vector<std::vector<cv::Mat>> nrvo(s, std::vector<cv::Mat>(n));
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for(int i = 0 ; i < n ; ++i) {
+        // TODO: take the actual size out of config.
+        cv::Mat img50 = imgs[i];
+        if(img50.cols != 50 || img50.rows != 50) {
+            resize(imgs[i], img50, cv::Size(50, 50));
+        }
+
+        auto feats = warco::mkfeats(img50, _fb);
+        for(int j = 0 ; j < s ; ++j) {
+            const auto& p = _patchmodels[j];
+            nrvo[j][i] = extract_corr(feats, p.x*img50.cols, p.y*img50.rows, p.w*img50.cols, p.h*img50.rows);
+        }
+    }
+
+    return nrvo;
+}
+
+void warco::Warco::foreach_model_batch(const std::vector<cv::Mat>& imgs, std::function<void(unsigned ipatch, const Patch& patch, std::vector<cv::Mat>& corrs, unsigned first)> fn) const
+{
+    const int n = imgs.size(), s = _patchmodels.size();
+
+    // All descriptors first, then chunks of images times patches, such
+    // that there's enough to go around even for few patches, and each
+    // chunk's kernel block is a reasonably sized matrix product.
+    auto corrs = this->corrs_batch(imgs);
+    const int nchunks = (n + GRAM_TILE - 1) / GRAM_TILE;
+    const int ntasks = s*nchunks;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for(int t = 0 ; t < ntasks ; ++t) {
+        const int j = t / nchunks, first = (t % nchunks)*GRAM_TILE;
+        const int last = std::min<int>(n, first + GRAM_TILE);
+        std::vector<cv::Mat> chunk(corrs[j].begin() + first, corrs[j].begin() + last);
+        fn(j, _patchmodels[j], chunk, first);
+    }
+}
+
+void warco::Warco::load(std::string name, bool lazy)
 {
+    if(is_binary_model(name))
+        return this->load_binary(name, lazy);
+
     _patchmodels.clear();
 
     _fb.load((name + "/filterbank").c_str());
@@ -187,8 +682,10 @@ void warco::Warco::load(std::string name)
     f >> n;
     for(unsigned i = 0 ; i < n ; ++i) {
         f >> weight >> x >> y >> w >> h;
-        _patchmodels.push_back(Patch(x, y, w, h, "", weight));
-        _patchmodels.back().model->load(name + "/patch" + to_s(i));
+        std::string pname = name + "/patch" + to_s(i);
+        _patchmodels.push_back(Patch(x, y, w, h, [pname](PatchModel& m) { m.load(pname); }, weight));
+        if(! lazy)
+            _patchmodels.back().model->own();
     }
 }
 
@@ -204,7 +701,76 @@ void warco::Warco::save(std::string name) const
     of << _patchmodels.size() << std::endl;
     for(const auto& p : _patchmodels) {
         of << std::endl << p.weight << " " << p.x << " " << p.y << " " << p.w << " " << p.h;
-        p.model->save(name + "/patch" + to_s(i++));
+        p.model->get()->save(name + "/patch" + to_s(i++));
+    }
+}
+
+void warco::Warco::save_binary(std::string fname) const
+{
+    BinWriter w(fname);
+
+    // Header and patch table get filled in last.
+    BinHeader h = BinHeader();
+    std::memcpy(h.magic, BIN_MAGIC, sizeof(h.magic));
+    h.version = BIN_VERSION;
+    h.npatches = _patchmodels.size();
+    h.nfilters = _fb.size();
+    w.append(&h, sizeof(h));
+
+    std::vector<BinPatch> table(_patchmodels.size(), BinPatch());
+    h.patches_off = w.append(table.data(), table.size()*sizeof(BinPatch));
+
+    std::vector<BinMat> filters;
+    for(cv::Mat k : _fb.kernels()) {
+        k = k.isContinuous() ? k : k.clone();
+        BinMat m = BinMat();
+        m.rows = k.rows;
+        m.cols = k.cols;
+        m.type = k.type();
+        m.off = w.append(k.ptr(), k.total()*k.elemSize());
+        filters.push_back(m);
+    }
+    h.filters_off = w.append(filters.data(), filters.size()*sizeof(BinMat));
+
+    for(std::size_t i = 0 ; i < _patchmodels.size() ; ++i) {
+        const auto& p = _patchmodels[i];
+        table[i].weight = p.weight;
+        table[i].x = p.x;
+        table[i].y = p.y;
+        table[i].w = p.w;
+        table[i].h = p.h;
+        p.model->get()->save_binary(w, table[i]);
     }
+
+    h.size = w.size();
+    w.write_at(h.patches_off, table.data(), table.size()*sizeof(BinPatch));
+    w.write_at(0, &h, sizeof(h));
 }
 
+void warco::Warco::load_binary(std::string fname, bool lazy)
+{
+    _patchmodels.clear();
+
+    auto f = std::make_shared<MappedFile>(fname);
+    const BinHeader& h = *f->at<BinHeader>(0);
+    if(h.version != BIN_VERSION)
+        throw std::runtime_error("Binary model '" + fname + "' has version " + to_s(h.version) + ", expected " + to_s(BIN_VERSION));
+    if(h.size != f->size())
+        throw std::runtime_error("Binary model '" + fname + "' is truncated.");
+
+    const BinMat* filters = f->at<BinMat>(h.filters_off, h.nfilters);
+    for(uint32_t i = 0 ; i < h.nfilters ; ++i) {
+        const BinMat& m = filters[i];
+        cv::Mat k(m.rows, m.cols, m.type);
+        std::memcpy(k.ptr(), f->at<uint8_t>(m.off, k.total()*k.elemSize()), k.total()*k.elemSize());
+        _fb.add_filter(k);
+    }
+
+    const BinPatch* table = f->at<BinPatch>(h.patches_off, h.npatches);
+    for(uint32_t i = 0 ; i < h.npatches ; ++i) {
+        const BinPatch& p = table[i];
+        _patchmodels.push_back(Patch(p.x, p.y, p.w, p.h, [f, p](PatchModel& m) { m.load_binary(f, p); }, p.weight));
+        if(! lazy)
+            _patchmodels.back().model->own();
+    }
+}
@@ -3,6 +3,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 // For FilterBank.
@@ -15,45 +16,109 @@ namespace cv {
 
 namespace warco {
 
+    class LazyModel;
     struct PatchModel;
+    struct TrainOpts;
 
     struct Patch {
         double x, y, w, h;
     };
 
+    struct CascadeOpts {
+        // Vote with the patches' probabilities, like `predict_proba`, instead
+        // of their labels.
+        bool probas = false;
+        // Also stop once the leading class is this far ahead of the next one
+        // in the (normalized) votes so far, which may change the result.
+        double margin = 0.0;
+        // Return the best guess so far after this many microseconds, 0 for no limit.
+        double deadline_us = 0.0;
+    };
+
+    struct CascadeInfo {
+        enum Exit {
+            ALL,        // All patches were evaluated.
+            DECIDED,    // The remaining ones couldn't change the result.
+            MARGIN,
+            DEADLINE,
+        };
+        Exit exit;
+        unsigned nevaluated;
+    };
+
     struct Warco {
 
         Warco(cv::FilterBank fb, const std::vector<warco::Patch>& patches, std::string distfname);
-        Warco(std::string name);
+        Warco(std::string name, bool lazy = false);
         ~Warco();
 
         void add_sample(const cv::Mat& img, unsigned label);
+        // Same as calling the above on each of them in order, but computing
+        // their descriptors in parallel and filling the patches in parallel.
+        void add_samples(const std::vector<cv::Mat>& imgs, const std::vector<unsigned>& labels);
 
         void prepare();
 
-        double train(const std::vector<double>& cv_C, std::function<void()> progress = [](){});
+        double train(const std::vector<double>& cv_C, const TrainOpts& opts, std::function<void()> progress = [](){});
+        // Estimated peak bytes `train` allocates on top of the samples, given
+        // the number of cores and the `max_train_mb` budget.
+        std::size_t train_peak(const std::vector<double>& cv_C, const TrainOpts& opts) const;
+        // Retrains all patches on the samples added since they were trained
+        // (or loaded) with `keep_dists`, see PatchModel::train_incremental.
+        double train_incremental(const TrainOpts& opts, std::function<void()> progress = [](){});
         unsigned predict(const cv::Mat& img) const;
         unsigned predict_proba(const cv::Mat& img) const;
+        // Same as the above for many images at once, which is a lot faster
+        // than one by one. Also returns each image's (weighted) probabilities
+        // in `probas` if given.
+        std::vector<unsigned> predict_batch(const std::vector<cv::Mat>& imgs) const;
+        // Evaluates the patches by decreasing weight, stopping early as soon
+        // as possible according to `opts`.
+        unsigned predict_cascade(const cv::Mat& img, const CascadeOpts& opts = CascadeOpts(), CascadeInfo* info = nullptr) const;
+        std::vector<unsigned> predict_proba_batch(const std::vector<cv::Mat>& imgs, std::vector<std::vector<double>>* probas = nullptr) const;
 
         unsigned nlbl() const;
-
+        std::size_t npatches() const { return _patchmodels.size(); }
+
+        // Stores all patches' descriptors as "fp32", "fp16" or "int8".
+        void quantize(std::string precision);
+        std::size_t descr_bytes() const;
+        // Resident bytes of each patch model, 0 for lazy ones not in memory.
+        std::vector<std::size_t> footprints() const;
+        // Average PatchModel::knn_accuracy, only after `train` with `knn_check`.
+        std::pair<double, double> knn_accuracy() const;
+
+        // `name` is a directory, or for `load` also a binary model file.
+        // With `lazy`, each patch model is only loaded once it's first used,
+        // and may be unloaded again, see LazyModel::set_cap.
         void save(std::string name) const;
-        void load(std::string name);
+        void load(std::string name, bool lazy = false);
+        // Single file, memory-mapped when loaded. See binmodel.hpp.
+        void save_binary(std::string fname) const;
 
     protected:
         struct Patch {
             double weight;
             double x, y, w, h;
-            std::unique_ptr<PatchModel> model;
+            std::shared_ptr<LazyModel> model;
 
             Patch(double x, double y, double w, double h, std::string distfname, double weight = 0.0);
+            Patch(double x, double y, double w, double h, std::function<void(PatchModel&)> loader, double weight);
         };
 
         std::vector<Patch> _patchmodels;
 
         cv::FilterBank _fb;
 
+        void load_binary(std::string fname, bool lazy);
+        void select_patches(const TrainOpts& opts);
+        std::vector<std::size_t> train_peaks(const std::vector<double>& cv_C, const TrainOpts& opts, unsigned nthreads) const;
         void foreach_model(const cv::Mat& img, std::function<void(const Patch& patch, cv::Mat& corr)> fn) const;
+        // All descriptors of all images in parallel, as corrs[patch][image].
+        std::vector<std::vector<cv::Mat>> corrs_batch(const std::vector<cv::Mat>& imgs) const;
+        // Calls `fn` with chunks of the images' descriptors for each patch,
+        // `first` being the index of the chunk's first image.
+        void foreach_model_batch(const std::vector<cv::Mat>& imgs, std::function<void(unsigned ipatch, const Patch& patch, std::vector<cv::Mat>& corrs, unsigned first)> fn) const;
     };
 
 } // namespace warco